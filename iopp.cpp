@@ -1,6 +1,11 @@
 // #pragma once
 #include "iopp.h"
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <condition_variable>
 
 namespace iopp {
 
@@ -23,7 +28,13 @@ static int threads1d(int n) {
 
 
 cl_mat::cl_mat(_opencl_context* context, cl_mem mem, int n, int m)
-	: context(context), mem(mem), n(n), m(m) {}
+	: context(context), mem(mem), n(n), m(m), off(0), ld(n), view(false) {}
+
+cl_mat::cl_mat(_opencl_context* context, cl_mem mem, int n, int m, int off, int ld)
+	: context(context), mem(mem), n(n), m(m), off(off), ld(ld), view(true)
+{
+	context->retain(mem);
+}
 
 void cl_mat::check(const cl_mat& b) const {
 	if (!(n == b.n && m == b.m))
@@ -34,31 +45,57 @@ void cl_mat::check(const cl_mat& b) const {
 
 void cl_mat::destroy() {
 	if (context && mem) {
-		context->recycle(n*m*sizeof(float), mem);
+		context->recycle(view ? -1 : n*m*(int)sizeof(float), mem);
 		mem = NULL;
 	}
 }
 
+// element (i, j) of op(*this), the transpose if t
+cl_int4 cl_mat::desc(bool t) const {
+	cl_int4 d = {{off, t ? m : n, t ? ld : 1, t ? 1 : ld}};
+	return d;
+}
+
+// copies the elements of b into the memory of *this
+void cl_mat::assign(const cl_mat& b) {
+	if (view || b.view)
+		context->run_kernel("vcopy", {threads1d(n*m)},
+			b.mem, b.desc(), mem, desc(), n*m);
+	else
+		context->mem_copy(b.mem, mem, n*m*sizeof(float));
+}
+
 cl_mat::cl_mat(const cl_mat& b) : context(b.context),
-	mem(b.context->new_buffer(b.n*b.m*sizeof(float))), n(b.n), m(b.m)
+	mem(b.context->new_buffer(b.n*b.m*sizeof(float))), n(b.n), m(b.m),
+	off(0), ld(b.n), view(false)
 {
-	context->mem_copy(b.mem, mem, n*m*sizeof(float));
+	assign(b);
 }
 
-cl_mat::cl_mat(cl_mat&& b) : context(b.context), mem(b.mem), n(b.n), m(b.m) {
+cl_mat::cl_mat(cl_mat&& b) : context(b.context), mem(b.mem), n(b.n), m(b.m),
+	off(b.off), ld(b.ld), view(b.view)
+{
 	b.mem = NULL;
 }
 
 cl_mat& cl_mat::operator= (const cl_mat& b) {
 	if (this != &b) {
 		check(b);
-		destroy();
-		context->mem_copy(b.mem, mem, n*m*sizeof(float));
+		if (!mem) {
+			mem = context->new_buffer(n*m*sizeof(float));
+			off = 0;
+			ld = n;
+			view = false;
+		}
+		assign(b);
 	}
 	return *this;
 }
 
+// a view never gives up its memory, so moving into or out of one copies
 cl_mat& cl_mat::operator= (cl_mat&& b) {
+	if (view || b.view)
+		return *this = (const cl_mat&)b;
 	if (this != &b) {
 		check(b);
 		destroy();
@@ -72,10 +109,18 @@ cl_mat::~cl_mat() {
 	destroy();
 }
 
+int cl_mat::rows() const {
+	return n;
+}
+
+int cl_mat::cols() const {
+	return m;
+}
+
 la::mat cl_mat::get() const {
 	la::mat a(n, m);
 	float* buff = new float[n * m];
-	context->mem_read(mem, buff, n*m*sizeof(float));
+	read(buff);
 	for (int i=0; i<n; i++) {
 		for (int j=0; j<m; j++) {
 			a[i][j] = buff[i + j*n];
@@ -95,57 +140,331 @@ void cl_mat::set(const la::mat& a) {
 			buff[i + j*n] = row[j];
 		}
 	}
-	context->mem_write(buff, mem, n*m*sizeof(float));
+	write(buff);
 	delete[] buff;
 }
 
+void cl_mat::run_function(const char* fn) {
+	context->run_kernel(fn, {threads1d(n*m)}, mem, desc(), n*m);
+}
+
+void cl_mat::read(float* dst) const {
+	context->mem_read(mem, off, ld, dst, n, m);
+}
+
+void cl_mat::write(const float* src) {
+	context->mem_write(src, mem, off, ld, n, m);
+}
+
+cl_mat cl_mat::block(int i, int j, int h, int w) const {
+	if (i < 0 || j < 0 || h < 0 || w < 0 || i + h > n || j + w > m)
+		throw "view out of range";
+	return cl_mat(context, mem, h, w, off + i + j*ld, ld);
+}
+
+cl_mat cl_mat::cols(int j, int w) const {
+	return block(0, j, n, w);
+}
+
+cl_vec cl_mat::col(int j) const {
+	if (j < 0 || j >= m)
+		throw "view out of range";
+	return cl_vec(context, mem, n, off + j*ld, 1);
+}
+
+cl_vec cl_mat::row(int i) const {
+	if (i < 0 || i >= n)
+		throw "view out of range";
+	return cl_vec(context, mem, m, off + i, ld);
+}
+
 cl_mat cl_mat::T() const {
 	auto r = context->mat(m, n);
-	context->run_kernel("mt", {n, m}, mem, r.mem, n, m);
+	context->run_kernel("mt", {n, m}, mem, desc(), r.mem, r.desc(), n, m);
 	return r;
 }
 
 cl_vec cl_mat::dot(const cl_vec& v) const {
-	check_dims(m, v.n);
 	auto r = context->vec(n);
-	context->run_kernel("mvdot", {n}, mem, v.mem, r.mem, n, m);
+	r.gemv(1, *this, false, v, 0);
 	return r;
 }
 
 cl_mat cl_mat::dot(const cl_mat& v) const {
-	check_dims(m, v.n);
 	auto r = context->mat(n, v.m);
-	context->run_kernel("mmdot", {n, v.m}, mem, v.mem, r.mem, n, m, v.m);
+	r.gemm(1, *this, false, v, false, 0);
+	return r;
+}
+
+cl_vec cl_mat::dense(const cl_vec& x, const cl_vec& b, act f, cl_vec* z) const {
+	check_dims(m, x.n);
+	check_dims(n, b.n);
+	if (z)
+		check_dims(n, z->n);
+	auto r = context->vec(n);
+	cl_mem zm = z ? z->mem : NULL;
+	cl_int4 dz = z ? z->desc() : r.desc();
+	context->run_kernel("mvdense", {n}, mem, desc(), x.mem, x.desc(),
+		b.mem, b.desc(), r.mem, r.desc(), zm, dz, n, m, (int)f);
+	return r;
+}
+
+cl_mat cl_mat::dense(const cl_mat& x, const cl_vec& b, act f, cl_mat* z) const {
+	check_dims(m, x.n);
+	check_dims(n, b.n);
+	if (z) {
+		check_dims(n, z->n);
+		check_dims(x.m, z->m);
+	}
+	auto r = context->mat(n, x.m);
+	cl_mem zm = z ? z->mem : NULL;
+	cl_int4 dz = z ? z->desc() : r.desc();
+	context->run_kernel("mmdense", {n, x.m}, mem, desc(), x.mem, x.desc(),
+		b.mem, b.desc(), r.mem, r.desc(), zm, dz, n, m, x.m, (int)f);
+	return r;
+}
+
+
+
+cl_mat& cl_mat::gemm(float alpha, const cl_mat& a, bool ta,
+	const cl_mat& b, bool tb, float beta
+) {
+	int an = ta ? a.m : a.n, am = ta ? a.n : a.m;
+	int bn = tb ? b.m : b.n, bm = tb ? b.n : b.m;
+	check_dims(n, an);
+	check_dims(am, bn);
+	check_dims(m, bm);
+	context->run_kernel("gemm", {n, m}, a.mem, a.desc(ta), b.mem, b.desc(tb),
+		mem, desc(), n, am, m, alpha, beta);
+	return *this;
+}
+
+cl_mat& cl_mat::gemm(float alpha, const cl_hmat& a, bool ta,
+	const cl_mat& b, bool tb, float beta
+) {
+	int an = ta ? a.m : a.n, am = ta ? a.n : a.m;
+	int bn = tb ? b.m : b.n, bm = tb ? b.n : b.m;
+	check_dims(n, an);
+	check_dims(am, bn);
+	check_dims(m, bm);
+	context->run_kernel("hgemm", {n, m}, a.mem, a.desc(ta), b.mem, b.desc(tb),
+		mem, desc(), n, am, m, alpha, beta);
+	return *this;
+}
+
+// the kernels get the views of the first matrices, the others are
+// whole multiples of their widths further in memory
+cl_mat& cl_mat::gemm_batched(int count, float alpha, const cl_mat& a,
+	bool ta, const cl_mat& b, bool tb, float beta
+) {
+	if (count <= 0 || m % count || a.m % count || b.m % count)
+		throw "batch size mismatch";
+	int w = m / count, wa = a.m / count, wb = b.m / count;
+	int an = ta ? wa : a.n, am = ta ? a.n : wa;
+	int bn = tb ? wb : b.n, bm = tb ? b.n : wb;
+	check_dims(n, an);
+	check_dims(am, bn);
+	check_dims(w, bm);
+	int s = std::max(n, std::max(am, w));
+	const char* fn = s <= 8 ? "bgemm_8" : s <= 16 ? "bgemm_16" :
+		s <= 32 ? "bgemm_32" : s <= 64 ? "bgemm_64" : NULL;
+	if (fn)
+		context->run_kernel(fn, {count * LOCAL_SIZE},
+			a.mem, a.desc(ta), wa * a.ld, b.mem, b.desc(tb), wb * b.ld,
+			mem, desc(), w * ld, n, am, w, alpha, beta);
+	else
+		context->run_kernel("bgemm", {n, w * count},
+			a.mem, a.desc(ta), wa * a.ld, b.mem, b.desc(tb), wb * b.ld,
+			mem, desc(), w * ld, n, am, w, alpha, beta, count);
+	return *this;
+}
+
+cl_mat& cl_mat::ger(float alpha, const cl_vec& x, const cl_vec& y) {
+	check_dims(n, x.n);
+	check_dims(m, y.n);
+	context->run_kernel("ger", {n, m},
+		mem, desc(), x.mem, x.desc(), y.mem, y.desc(), n, m, alpha);
+	return *this;
+}
+
+cl_mat& cl_mat::axpy(float alpha, const cl_mat& x) {
+	check(x);
+	context->run_kernel("axpy", {threads1d(n*m)},
+		x.mem, x.desc(), mem, desc(), n*m, alpha);
+	return *this;
+}
+
+// CGLS: r = b - A x, s = A^T r, p = s, g = |s|^2, then per step
+// q = A p, d = |q|^2, x += g/d p, r -= g/d q, s = A^T r, p = s + g'/g p
+int cl_mat::cgls(cl_vec& x, const cl_vec& b, int iters, float tol,
+	int check
+) const {
+	check_dims(m, x.n);
+	check_dims(n, b.n);
+	if (iters < 0 || check <= 0)
+		throw "invalid iteration counts";
+	cl_vec r = b, q = context->vec(n);
+	cl_vec s = context->vec(m), p = context->vec(m);
+	r.gemv(-1, *this, false, x, 1);
+	s.gemv(1, *this, true, r, 0);
+	p = s;
+	cl_val g = s.dot(s);
+	float g0 = g.get();
+	int i = 0;
+	while (g0 > 0 && i < iters) {
+		q.gemv(1, *this, false, p, 0);
+		cl_val d = q.dot(q);
+		context->run_kernel("vaxpyq", {threads1d(m)},
+			p.mem, p.desc(), x.mem, x.desc(), m, g.mem, d.mem, 1.0f);
+		context->run_kernel("vaxpyq", {threads1d(n)},
+			q.mem, q.desc(), r.mem, r.desc(), n, g.mem, d.mem, -1.0f);
+		s.gemv(1, *this, true, r, 0);
+		cl_val g1 = s.dot(s);
+		context->run_kernel("vxpayq", {threads1d(m)},
+			s.mem, s.desc(), p.mem, p.desc(), m, g1.mem, g.mem);
+		g = std::move(g1);
+		if (++i % check == 0 && g.get() <= tol * tol * g0)
+			break;
+	}
+	return i;
+}
+
+cl_mat cl_mat::cholesky() const {
+	check_dims(n, m);
+	cl_mat l = *this;
+	cl_mem flag = context->new_buffer(sizeof(int));
+	int bad = 0;
+	context->mem_write(&bad, flag, sizeof(int));
+	for (int k=0; k<n; k+=LOCAL_SIZE) {
+		int nb = std::min(LOCAL_SIZE, n - k), h = n - k - nb;
+		cl_mat d = l.block(k, k, nb, nb);
+		context->run_kernel("chol_diag", {LOCAL_SIZE}, l.mem, d.desc(), nb, flag);
+		if (h == 0)
+			break;
+		cl_mat p = l.block(k + nb, k, h, nb);
+		context->run_kernel("chol_panel", {h}, l.mem, d.desc(), p.desc(), h, nb);
+		l.block(k + nb, k + nb, h, h).gemm(-1, p, false, p, true, 1);
+	}
+	context->run_kernel("mtril", {n, n}, l.mem, l.desc(), n);
+	context->mem_read(flag, &bad, sizeof(int));
+	context->recycle(sizeof(int), flag);
+	if (bad)
+		throw "matrix is not positive definite";
+	return l;
+}
+
+// L y = b forward and L^T x = y backward, block by block; the rest of
+// the vector is updated with gemv
+cl_vec cl_mat::cho_solve(const cl_vec& b) const {
+	check_dims(n, m);
+	check_dims(n, b.n);
+	cl_vec x = b;
+	for (int k=0; k<n; k+=LOCAL_SIZE) {
+		int nb = std::min(LOCAL_SIZE, n - k), h = n - k - nb;
+		cl_vec xk = x.slice(k, nb);
+		context->run_kernel("trsv_l", {}, mem, block(k, k, nb, nb).desc(),
+			x.mem, xk.desc(), nb, 0);
+		if (h)
+			x.slice(k + nb, h).gemv(-1, block(k + nb, k, h, nb), false, xk, 1);
+	}
+	for (int k=(n-1) / LOCAL_SIZE * LOCAL_SIZE; k>=0; k-=LOCAL_SIZE) {
+		int nb = std::min(LOCAL_SIZE, n - k);
+		cl_vec xk = x.slice(k, nb);
+		context->run_kernel("trsv_l", {}, mem, block(k, k, nb, nb).desc(),
+			x.mem, xk.desc(), nb, 1);
+		if (k)
+			x.slice(0, k).gemv(-1, block(k, 0, nb, k), true, xk, 1);
+	}
+	return x;
+}
+
+// a row broadcast is a column broadcast on the transposed view
+
+cl_mat& cl_mat::add_col(float alpha, const cl_vec& b) {
+	check_dims(n, b.n);
+	context->run_kernel("mvadd", {n, m}, mem, desc(), b.mem, b.desc(),
+		n, m, alpha);
+	return *this;
+}
+
+cl_mat& cl_mat::add_row(float alpha, const cl_vec& b) {
+	check_dims(m, b.n);
+	context->run_kernel("mvadd", {m, n}, mem, desc(true), b.mem, b.desc(),
+		m, n, alpha);
+	return *this;
+}
+
+cl_vec cl_mat::reduce(const char* fn, bool rows) const {
+	int k = rows ? n : m;
+	auto r = context->vec(k);
+	context->run_kernel(fn, {k * LOCAL_SIZE}, mem, desc(rows),
+		r.mem, r.desc(), rows ? m : n);
 	return r;
 }
 
+cl_vec cl_mat::row_sums() const {
+	return reduce("msum", true);
+}
+
+cl_vec cl_mat::col_sums() const {
+	return reduce("msum", false);
+}
+
+cl_vec cl_mat::row_means() const {
+	return reduce("mmean", true);
+}
+
+cl_vec cl_mat::col_means() const {
+	return reduce("mmean", false);
+}
+
+cl_vec cl_mat::row_max() const {
+	return reduce("mmax", true);
+}
+
+cl_vec cl_mat::col_max() const {
+	return reduce("mmax", false);
+}
+
+cl_vec cl_mat::row_argmax() const {
+	return reduce("margmax", true);
+}
+
+cl_vec cl_mat::col_argmax() const {
+	return reduce("margmax", false);
+}
+
 
 
 cl_mat cl_mat::operator+(const cl_mat& b) const {
 	check(b);
 	auto r = context->mat(b.n, b.m);
-	context->run_kernel("vadd", {threads1d(n*m)}, mem, b.mem, r.mem, n*m);
+	context->run_kernel("vadd", {threads1d(n*m)},
+		mem, desc(), b.mem, b.desc(), r.mem, r.desc(), n*m);
 	return r;
 }
 
 cl_mat cl_mat::operator-(const cl_mat& b) const {
 	check(b);
 	auto r = context->mat(b.n, b.m);
-	context->run_kernel("vsub", {threads1d(n*m)}, mem, b.mem, r.mem, n*m);
+	context->run_kernel("vsub", {threads1d(n*m)},
+		mem, desc(), b.mem, b.desc(), r.mem, r.desc(), n*m);
 	return r;
 }
 
 cl_mat cl_mat::operator*(const cl_mat& b) const {
 	check(b);
 	auto r = context->mat(b.n, b.m);
-	context->run_kernel("vmul", {threads1d(n*m)}, mem, b.mem, r.mem, n*m);
+	context->run_kernel("vmul", {threads1d(n*m)},
+		mem, desc(), b.mem, b.desc(), r.mem, r.desc(), n*m);
 	return r;
 }
 
 cl_mat cl_mat::operator/(const cl_mat& b) const {
 	check(b);
 	auto r = context->mat(b.n, b.m);
-	context->run_kernel("vdiv", {threads1d(n*m)}, mem, b.mem, r.mem, n*m);
+	context->run_kernel("vdiv", {threads1d(n*m)},
+		mem, desc(), b.mem, b.desc(), r.mem, r.desc(), n*m);
 	return r;
 }
 
@@ -153,25 +472,25 @@ cl_mat cl_mat::operator/(const cl_mat& b) const {
 
 cl_mat& cl_mat::operator+= (const cl_mat& v) {
 	check(v);
-	context->run_kernel("vaddc", {threads1d(n*m)}, mem, v.mem, n*m);
+	context->run_kernel("vaddc", {threads1d(n*m)}, mem, desc(), v.mem, v.desc(), n*m);
 	return *this;
 }
 
 cl_mat& cl_mat::operator-= (const cl_mat& v) {
 	check(v);
-	context->run_kernel("vsubc", {threads1d(n*m)}, mem, v.mem, n*m);
+	context->run_kernel("vsubc", {threads1d(n*m)}, mem, desc(), v.mem, v.desc(), n*m);
 	return *this;
 }
 
 cl_mat& cl_mat::operator*= (const cl_mat& v) {
 	check(v);
-	context->run_kernel("vmulc", {threads1d(n*m)}, mem, v.mem, n*m);
+	context->run_kernel("vmulc", {threads1d(n*m)}, mem, desc(), v.mem, v.desc(), n*m);
 	return *this;
 }
 
 cl_mat& cl_mat::operator/= (const cl_mat& v) {
 	check(v);
-	context->run_kernel("vdivc", {threads1d(n*m)}, mem, v.mem, n*m);
+	context->run_kernel("vdivc", {threads1d(n*m)}, mem, desc(), v.mem, v.desc(), n*m);
 	return *this;
 }
 
@@ -179,52 +498,182 @@ cl_mat& cl_mat::operator/= (const cl_mat& v) {
 
 cl_mat cl_mat::operator+ (const cl_val& v) const {
 	auto r = context->mat(n, m);
-	context->run_kernel("vsadd", {threads1d(n*m)}, mem, r.mem, v.val, n*m);
+	if (v.mem)
+		context->run_kernel("vgadd", {threads1d(n*m)},
+			mem, desc(), r.mem, r.desc(), v.mem, n*m);
+	else
+		context->run_kernel("vsadd", {threads1d(n*m)},
+			mem, desc(), r.mem, r.desc(), v.val, n*m);
 	return r;
 }
 
 cl_mat cl_mat::operator- (const cl_val& v) const {
 	auto r = context->mat(n, m);
-	context->run_kernel("vssub", {threads1d(n*m)}, mem, r.mem, v.val, n*m);
+	if (v.mem)
+		context->run_kernel("vgsub", {threads1d(n*m)},
+			mem, desc(), r.mem, r.desc(), v.mem, n*m);
+	else
+		context->run_kernel("vssub", {threads1d(n*m)},
+			mem, desc(), r.mem, r.desc(), v.val, n*m);
 	return r;
 }
 
 cl_mat cl_mat::operator* (const cl_val& v) const {
 	auto r = context->mat(n, m);
-	context->run_kernel("vsmul", {threads1d(n*m)}, mem, r.mem, v.val, n*m);
+	if (v.mem)
+		context->run_kernel("vgmul", {threads1d(n*m)},
+			mem, desc(), r.mem, r.desc(), v.mem, n*m);
+	else
+		context->run_kernel("vsmul", {threads1d(n*m)},
+			mem, desc(), r.mem, r.desc(), v.val, n*m);
 	return r;
 }
 
 cl_mat cl_mat::operator/ (const cl_val& v) const {
 	auto r = context->mat(n, m);
-	context->run_kernel("vsdiv", {threads1d(n*m)}, mem, r.mem, v.val, n*m);
+	if (v.mem)
+		context->run_kernel("vgdiv", {threads1d(n*m)},
+			mem, desc(), r.mem, r.desc(), v.mem, n*m);
+	else
+		context->run_kernel("vsdiv", {threads1d(n*m)},
+			mem, desc(), r.mem, r.desc(), v.val, n*m);
 	return r;
 }
 
 
 
 cl_mat& cl_mat::operator+= (const cl_val& v) {
-	context->run_kernel("vsaddc", {threads1d(n*m)}, mem, v.val, n*m);
+	if (v.mem)
+		context->run_kernel("vgaddc", {threads1d(n*m)}, mem, desc(), v.mem, n*m);
+	else
+		context->run_kernel("vsaddc", {threads1d(n*m)}, mem, desc(), v.val, n*m);
 	return *this;
 }
 
 cl_mat& cl_mat::operator-= (const cl_val& v) {
-	context->run_kernel("vssubc", {threads1d(n*m)}, mem, v.val, n*m);
+	if (v.mem)
+		context->run_kernel("vgsubc", {threads1d(n*m)}, mem, desc(), v.mem, n*m);
+	else
+		context->run_kernel("vssubc", {threads1d(n*m)}, mem, desc(), v.val, n*m);
 	return *this;
 }
 
 cl_mat& cl_mat::operator*= (const cl_val& v) {
-	context->run_kernel("vsmulc", {threads1d(n*m)}, mem, v.val, n*m);
+	if (v.mem)
+		context->run_kernel("vgmulc", {threads1d(n*m)}, mem, desc(), v.mem, n*m);
+	else
+		context->run_kernel("vsmulc", {threads1d(n*m)}, mem, desc(), v.val, n*m);
 	return *this;
 }
 
 cl_mat& cl_mat::operator/= (const cl_val& v) {
-	context->run_kernel("vsdivc", {threads1d(n*m)}, mem, v.val, n*m);
+	if (v.mem)
+		context->run_kernel("vgdivc", {threads1d(n*m)}, mem, desc(), v.mem, n*m);
+	else
+		context->run_kernel("vsdivc", {threads1d(n*m)}, mem, desc(), v.val, n*m);
+	return *this;
+}
+
+
+
+// broadcasts, a row broadcast is a column broadcast on the transposed views
+
+cl_mat cl_mat::broadcast(const char* fn, const cl_bvec& b) const {
+	int bn = b.row ? m : n, bm = b.row ? n : m;
+	check_dims(bn, b.v.n);
+	auto r = context->mat(n, m);
+	context->run_kernel(fn, {bn, bm}, mem, desc(b.row), b.v.mem, b.v.desc(),
+		r.mem, r.desc(b.row), bn, bm);
+	return r;
+}
+
+void cl_mat::broadcast_c(const char* fn, const cl_bvec& b) {
+	int bn = b.row ? m : n, bm = b.row ? n : m;
+	check_dims(bn, b.v.n);
+	context->run_kernel(fn, {bn, bm}, mem, desc(b.row), b.v.mem, b.v.desc(),
+		bn, bm);
+}
+
+cl_mat cl_mat::operator+ (const cl_bvec& b) const {
+	return broadcast("mbadd", b);
+}
+
+cl_mat cl_mat::operator- (const cl_bvec& b) const {
+	return broadcast("mbsub", b);
+}
+
+cl_mat cl_mat::operator* (const cl_bvec& b) const {
+	return broadcast("mbmul", b);
+}
+
+cl_mat cl_mat::operator/ (const cl_bvec& b) const {
+	return broadcast("mbdiv", b);
+}
+
+
+
+cl_mat& cl_mat::operator+= (const cl_bvec& b) {
+	broadcast_c("mbaddc", b);
+	return *this;
+}
+
+cl_mat& cl_mat::operator-= (const cl_bvec& b) {
+	broadcast_c("mbsubc", b);
+	return *this;
+}
+
+cl_mat& cl_mat::operator*= (const cl_bvec& b) {
+	broadcast_c("mbmulc", b);
+	return *this;
+}
+
+cl_mat& cl_mat::operator/= (const cl_bvec& b) {
+	broadcast_c("mbdivc", b);
 	return *this;
 }
 
 
 
+cl_mat cl_mat::softmax() const {
+	auto r = context->mat(n, m);
+	context->run_kernel("msoftmax", {m * LOCAL_SIZE}, mem, desc(), r.mem, r.desc(), n);
+	return r;
+}
+
+cl_mat cl_mat::log_softmax() const {
+	auto r = context->mat(n, m);
+	context->run_kernel("mlogsoftmax", {m * LOCAL_SIZE}, mem, desc(), r.mem, r.desc(), n);
+	return r;
+}
+
+cl_mat cl_mat::softmax_d(const cl_mat& g) const {
+	check(g);
+	auto r = context->mat(n, m);
+	context->run_kernel("msoftmax_d", {m * LOCAL_SIZE},
+		mem, desc(), g.mem, g.desc(), r.mem, r.desc(), n);
+	return r;
+}
+
+cl_val cl_mat::softmax_xent(const cl_mat& y, cl_mat& s, cl_mat& g) const {
+	check(y);
+	check(s);
+	check(g);
+	auto l = context->vec(m);
+	context->run_kernel("msoftmax_xent", {m * LOCAL_SIZE},
+		mem, desc(), y.mem, y.desc(), s.mem, s.desc(), g.mem, g.desc(), l.mem, n);
+	return l.sum();
+}
+
+cl_mat cl_mat::softmax_xent_d(const cl_mat& y) const {
+	check(y);
+	auto r = context->mat(n, m);
+	context->run_kernel("msoftmax_xent_d", {m * LOCAL_SIZE},
+		mem, desc(), y.mem, y.desc(), r.mem, r.desc(), n);
+	return r;
+}
+
+
+
 //
 // cl_vec
 //
@@ -241,31 +690,56 @@ void cl_vec::check(const cl_vec& b) const {
 
 void cl_vec::destroy() {
 	if (context && mem) {
-		context->recycle(n*sizeof(float), mem);
+		context->recycle(view ? -1 : n*(int)sizeof(float), mem);
 		mem = NULL;
 	}
 }
 
+cl_int4 cl_vec::desc() const {
+	cl_int4 d = {{off, n, inc, n*inc}};
+	return d;
+}
+
+// copies the elements of b into the memory of *this
+void cl_vec::assign(const cl_vec& b) {
+	if (view || b.view)
+		context->run_kernel("vcopy", {threads1d(n)},
+			b.mem, b.desc(), mem, desc(), n);
+	else
+		context->mem_copy(b.mem, mem, n*sizeof(float));
+}
+
 cl_vec::cl_vec(const cl_vec& b) : context(b.context),
-	mem(b.context->new_buffer(b.n*sizeof(float))), n(b.n)
+	mem(b.context->new_buffer(b.n*sizeof(float))), n(b.n),
+	off(0), inc(1), view(false)
 {
-	context->mem_copy(b.mem, mem, n*sizeof(float));
+	assign(b);
 }
 
-cl_vec::cl_vec(cl_vec&& b) : context(b.context), mem(b.mem), n(b.n) {
+cl_vec::cl_vec(cl_vec&& b) : context(b.context), mem(b.mem), n(b.n),
+	off(b.off), inc(b.inc), view(b.view)
+{
 	b.mem = NULL;
 }
 
 cl_vec& cl_vec::operator= (const cl_vec& b) {
 	if (this != &b) {
 		check(b);
-		destroy();
-		context->mem_copy(b.mem, mem, n*sizeof(float));
+		if (!mem) {
+			mem = context->new_buffer(n*sizeof(float));
+			off = 0;
+			inc = 1;
+			view = false;
+		}
+		assign(b);
 	}
 	return *this;
 }
 
+// see cl_mat
 cl_vec& cl_vec::operator= (cl_vec&& b) {
+	if (view || b.view)
+		return *this = (const cl_vec&)b;
 	if (this != &b) {
 		check(b);
 		destroy();
@@ -279,68 +753,150 @@ cl_vec::~cl_vec() {
 	destroy();
 }
 
+int cl_vec::size() const {
+	return n;
+}
+
 la::vec cl_vec::get() const {
 	la::vec v(n);
-	context->mem_read(mem, v.begin(), n*sizeof(float));
+	read(v.begin());
 	return v;
 }
 
 void cl_vec::set(const la::vec& v) {
 	check_dims(n, v.size());
-	context->mem_write(v.begin(), mem, n*sizeof(float));
+	write(v.begin());
+}
+
+void cl_vec::read(float* dst) const {
+	context->mem_read(mem, off, inc, dst, 1, n);
+}
+
+void cl_vec::write(const float* src) {
+	context->mem_write(src, mem, off, inc, 1, n);
+}
+
+cl_vec cl_vec::slice(int i, int k) const {
+	if (i < 0 || k < 0 || i + k > n)
+		throw "view out of range";
+	return cl_vec(context, mem, k, off + i*inc, inc);
 }
 
 void cl_vec::run_function(const char* fn) {
-	context->run_kernel(fn, {threads1d(n)}, mem, n);
+	context->run_kernel(fn, {threads1d(n)}, mem, desc(), n);
 }
 
 cl_val cl_vec::sum() const {
 	int threads = std::max(LOCAL_SIZE, LOCAL_SIZE * (int)::sqrt(n / 512.0));
 	cl_vec temp = context->vec(threads);
-	context->run_kernel("rdsum_1", {threads}, mem, temp.mem, n, threads);
-	context->run_kernel("rdsum_2", {}, temp.mem, threads);
-	float x;
-	context->mem_read(temp.mem, &x, sizeof(float));
-	return context->val(x);
+	cl_val r(context, context->new_buffer(sizeof(float)));
+	context->run_kernel("rdsum_1", {threads}, mem, desc(), temp.mem, n, threads);
+	context->run_kernel("rdsum_2", {}, temp.mem, r.mem, threads);
+	return r;
 }
 
 cl_val cl_vec::dot(const cl_vec& b) const {
-	return (*this * b).sum();
+	check(b);
+	int threads = std::max(LOCAL_SIZE, LOCAL_SIZE * (int)::sqrt(n / 512.0));
+	cl_vec temp = context->vec(threads);
+	cl_val r(context, context->new_buffer(sizeof(float)));
+	context->run_kernel("rddot_1", {threads},
+		mem, desc(), b.mem, b.desc(), temp.mem, n, threads);
+	context->run_kernel("rdsum_2", {}, temp.mem, r.mem, threads);
+	return r;
 }
 
 cl_mat cl_vec::outer(const cl_vec& b) const {
 	auto r = context->mat(n, b.n);
-	context->run_kernel("vvouter", {n, b.n}, mem, b.mem, r.mem, n, b.n);
+	context->run_kernel("vvouter", {n, b.n},
+		mem, desc(), b.mem, b.desc(), r.mem, r.desc(), n, b.n);
 	return r;
 }
 
 
 
+cl_vec& cl_vec::gemv(float alpha, const cl_mat& a, bool ta,
+	const cl_vec& x, float beta
+) {
+	check_dims(n, ta ? a.m : a.n);
+	check_dims(x.n, ta ? a.n : a.m);
+	cl_int4 da = a.desc(ta);
+	if (da.s[3] == 1)
+		context->run_kernel("gemv_t", {n * LOCAL_SIZE}, a.mem, da,
+			x.mem, x.desc(), mem, desc(), n, x.n, alpha, beta);
+	else
+		context->run_kernel("gemv_n", {n}, a.mem, da,
+			x.mem, x.desc(), mem, desc(), n, x.n, alpha, beta);
+	return *this;
+}
+
+cl_vec& cl_vec::gemv_batched(int count, float alpha, const cl_mat& a,
+	bool ta, const cl_vec& x, float beta
+) {
+	if (count <= 0 || n % count || x.n % count || a.m % count)
+		throw "batch size mismatch";
+	int ny = n / count, nx = x.n / count, wa = a.m / count;
+	check_dims(ny, ta ? wa : a.n);
+	check_dims(nx, ta ? a.n : wa);
+	cl_int4 dx = {{x.off, nx, x.inc, nx * x.inc}};
+	cl_int4 dy = {{off, ny, inc, ny * inc}};
+	context->run_kernel("bgemv", {ny * count}, a.mem, a.desc(ta), wa * a.ld,
+		x.mem, dx, nx * x.inc, mem, dy, ny * inc, ny, nx, alpha, beta, count);
+	return *this;
+}
+
+cl_vec& cl_vec::gemv(float alpha, const cl_hmat& a, bool ta,
+	const cl_vec& x, float beta
+) {
+	check_dims(n, ta ? a.m : a.n);
+	check_dims(x.n, ta ? a.n : a.m);
+	cl_int4 da = a.desc(ta);
+	if (da.s[3] == 1)
+		context->run_kernel("hgemv_t", {n * LOCAL_SIZE}, a.mem, da,
+			x.mem, x.desc(), mem, desc(), n, x.n, alpha, beta);
+	else
+		context->run_kernel("hgemv_n", {n}, a.mem, da,
+			x.mem, x.desc(), mem, desc(), n, x.n, alpha, beta);
+	return *this;
+}
+
+cl_vec& cl_vec::axpy(float alpha, const cl_vec& x) {
+	check(x);
+	context->run_kernel("axpy", {threads1d(n)}, x.mem, x.desc(), mem, desc(), n, alpha);
+	return *this;
+}
+
+
+
 cl_vec cl_vec::operator+(const cl_vec& b) const {
 	check(b);
 	auto r = context->vec(b.n);
-	context->run_kernel("vadd", {threads1d(n)}, mem, b.mem, r.mem, n);
+	context->run_kernel("vadd", {threads1d(n)},
+		mem, desc(), b.mem, b.desc(), r.mem, r.desc(), n);
 	return r;
 }
 
 cl_vec cl_vec::operator-(const cl_vec& b) const {
 	check(b);
 	auto r = context->vec(b.n);
-	context->run_kernel("vsub", {threads1d(n)}, mem, b.mem, r.mem, n);
+	context->run_kernel("vsub", {threads1d(n)},
+		mem, desc(), b.mem, b.desc(), r.mem, r.desc(), n);
 	return r;
 }
 
 cl_vec cl_vec::operator*(const cl_vec& b) const {
 	check(b);
 	auto r = context->vec(b.n);
-	context->run_kernel("vmul", {threads1d(n)}, mem, b.mem, r.mem, n);
+	context->run_kernel("vmul", {threads1d(n)},
+		mem, desc(), b.mem, b.desc(), r.mem, r.desc(), n);
 	return r;
 }
 
 cl_vec cl_vec::operator/(const cl_vec& b) const {
 	check(b);
 	auto r = context->vec(b.n);
-	context->run_kernel("vdiv", {threads1d(n)}, mem, b.mem, r.mem, n);
+	context->run_kernel("vdiv", {threads1d(n)},
+		mem, desc(), b.mem, b.desc(), r.mem, r.desc(), n);
 	return r;
 }
 
@@ -348,25 +904,25 @@ cl_vec cl_vec::operator/(const cl_vec& b) const {
 
 cl_vec& cl_vec::operator+= (const cl_vec& v) {
 	check(v);
-	context->run_kernel("vaddc", {threads1d(n)}, mem, v.mem, n);
+	context->run_kernel("vaddc", {threads1d(n)}, mem, desc(), v.mem, v.desc(), n);
 	return *this;
 }
 
 cl_vec& cl_vec::operator-= (const cl_vec& v) {
 	check(v);
-	context->run_kernel("vsubc", {threads1d(n)}, mem, v.mem, n);
+	context->run_kernel("vsubc", {threads1d(n)}, mem, desc(), v.mem, v.desc(), n);
 	return *this;
 }
 
 cl_vec& cl_vec::operator*= (const cl_vec& v) {
 	check(v);
-	context->run_kernel("vmulc", {threads1d(n)}, mem, v.mem, n);
+	context->run_kernel("vmulc", {threads1d(n)}, mem, desc(), v.mem, v.desc(), n);
 	return *this;
 }
 
 cl_vec& cl_vec::operator/= (const cl_vec& v) {
 	check(v);
-	context->run_kernel("vdivc", {threads1d(n)}, mem, v.mem, n);
+	context->run_kernel("vdivc", {threads1d(n)}, mem, desc(), v.mem, v.desc(), n);
 	return *this;
 }
 
@@ -374,127 +930,1334 @@ cl_vec& cl_vec::operator/= (const cl_vec& v) {
 
 cl_vec cl_vec::operator+ (const cl_val& v) const {
 	auto r = context->vec(n);
-	context->run_kernel("vsadd", {threads1d(n)}, mem, r.mem, v.val, n);
+	if (v.mem)
+		context->run_kernel("vgadd", {threads1d(n)},
+			mem, desc(), r.mem, r.desc(), v.mem, n);
+	else
+		context->run_kernel("vsadd", {threads1d(n)},
+			mem, desc(), r.mem, r.desc(), v.val, n);
 	return r;
 }
 
 cl_vec cl_vec::operator- (const cl_val& v) const {
 	auto r = context->vec(n);
-	context->run_kernel("vssub", {threads1d(n)}, mem, r.mem, v.val, n);
+	if (v.mem)
+		context->run_kernel("vgsub", {threads1d(n)},
+			mem, desc(), r.mem, r.desc(), v.mem, n);
+	else
+		context->run_kernel("vssub", {threads1d(n)},
+			mem, desc(), r.mem, r.desc(), v.val, n);
 	return r;
 }
 
 cl_vec cl_vec::operator* (const cl_val& v) const {
 	auto r = context->vec(n);
-	context->run_kernel("vsmul", {threads1d(n)}, mem, r.mem, v.val, n);
+	if (v.mem)
+		context->run_kernel("vgmul", {threads1d(n)},
+			mem, desc(), r.mem, r.desc(), v.mem, n);
+	else
+		context->run_kernel("vsmul", {threads1d(n)},
+			mem, desc(), r.mem, r.desc(), v.val, n);
 	return r;
 }
 
 cl_vec cl_vec::operator/ (const cl_val& v) const {
 	auto r = context->vec(n);
-	context->run_kernel("vsdiv", {threads1d(n)}, mem, r.mem, v.val, n);
+	if (v.mem)
+		context->run_kernel("vgdiv", {threads1d(n)},
+			mem, desc(), r.mem, r.desc(), v.mem, n);
+	else
+		context->run_kernel("vsdiv", {threads1d(n)},
+			mem, desc(), r.mem, r.desc(), v.val, n);
 	return r;
 }
 
 
 
 cl_vec& cl_vec::operator+= (const cl_val& v) {
-	context->run_kernel("vsaddc", {threads1d(n)}, mem, v.val, n);
+	if (v.mem)
+		context->run_kernel("vgaddc", {threads1d(n)}, mem, desc(), v.mem, n);
+	else
+		context->run_kernel("vsaddc", {threads1d(n)}, mem, desc(), v.val, n);
 	return *this;
 }
 
 cl_vec& cl_vec::operator-= (const cl_val& v) {
-	context->run_kernel("vssubc", {threads1d(n)}, mem, v.val, n);
+	if (v.mem)
+		context->run_kernel("vgsubc", {threads1d(n)}, mem, desc(), v.mem, n);
+	else
+		context->run_kernel("vssubc", {threads1d(n)}, mem, desc(), v.val, n);
 	return *this;
 }
 
 cl_vec& cl_vec::operator*= (const cl_val& v) {
-	context->run_kernel("vsmulc", {threads1d(n)}, mem, v.val, n);
+	if (v.mem)
+		context->run_kernel("vgmulc", {threads1d(n)}, mem, desc(), v.mem, n);
+	else
+		context->run_kernel("vsmulc", {threads1d(n)}, mem, desc(), v.val, n);
 	return *this;
 }
 
 cl_vec& cl_vec::operator/= (const cl_val& v) {
-	context->run_kernel("vsdivc", {threads1d(n)}, mem, v.val, n);
+	if (v.mem)
+		context->run_kernel("vgdivc", {threads1d(n)}, mem, desc(), v.mem, n);
+	else
+		context->run_kernel("vsdivc", {threads1d(n)}, mem, desc(), v.val, n);
 	return *this;
 }
 
-//
-// _opencl_context (i ostalo, trenutno)
-//
+cl_vec cl_vec::softmax() const {
+	auto r = context->vec(n);
+	context->run_kernel("msoftmax", {LOCAL_SIZE}, mem, desc(), r.mem, r.desc(), n);
+	return r;
+}
 
+cl_vec cl_vec::log_softmax() const {
+	auto r = context->vec(n);
+	context->run_kernel("mlogsoftmax", {LOCAL_SIZE}, mem, desc(), r.mem, r.desc(), n);
+	return r;
+}
 
+cl_vec cl_vec::softmax_d(const cl_vec& g) const {
+	check(g);
+	auto r = context->vec(n);
+	context->run_kernel("msoftmax_d", {LOCAL_SIZE},
+		mem, desc(), g.mem, g.desc(), r.mem, r.desc(), n);
+	return r;
+}
 
+cl_val cl_vec::softmax_xent(const cl_vec& y, cl_vec& s, cl_vec& g) const {
+	check(y);
+	check(s);
+	check(g);
+	cl_val l(context, context->new_buffer(sizeof(float)));
+	context->run_kernel("msoftmax_xent", {LOCAL_SIZE},
+		mem, desc(), y.mem, y.desc(), s.mem, s.desc(), g.mem, g.desc(), l.mem, n);
+	return l;
+}
 
-cl_platform_id _opencl_context::get_platform() {
-	cl_platform_id a[1];
-	clGetPlatformIDs(1, a, NULL);
-	return a[0];
+cl_vec cl_vec::softmax_xent_d(const cl_vec& y) const {
+	check(y);
+	auto r = context->vec(n);
+	context->run_kernel("msoftmax_xent_d", {LOCAL_SIZE},
+		mem, desc(), y.mem, y.desc(), r.mem, r.desc(), n);
+	return r;
 }
 
-cl_device_id _opencl_context::get_device(cl_platform_id platform) {
-	cl_device_id a[1];
-	clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, a, NULL);
+//
+// cl_hmat
+//
 
-	return a[0];
+// IEEE halves, rounded to nearest even like vstore_half
+static cl_half half_of(float f) {
+	unsigned x;
+	memcpy(&x, &f, sizeof(x));
+	unsigned s = x >> 16 & 0x8000, e = x >> 23 & 0xff, m = x & 0x7fffff;
+	if (e == 0xff)
+		return s | 0x7c00 | (m ? 0x200 : 0);
+	int k = (int)e - 127 + 15;
+	if (k >= 31)
+		return s | 0x7c00;
+	if (k <= 0) {
+		// subnormal or zero
+		if (k < -10)
+			return s;
+		m |= 0x800000;
+		int sh = 14 - k;
+		unsigned r = m >> sh, rem = m & ((1u << sh) - 1), h = 1u << (sh - 1);
+		if (rem > h || (rem == h && (r & 1)))
+			r++;
+		return s | r;
+	}
+	// a carry out of the mantissa goes into the exponent, up to infinity
+	unsigned r = k << 10 | m >> 13, rem = m & 0x1fff;
+	if (rem > 0x1000 || (rem == 0x1000 && (r & 1)))
+		r++;
+	return s | r;
+}
+
+static float float_of(cl_half h) {
+	unsigned s = (h & 0x8000) << 16, e = h >> 10 & 0x1f, m = h & 0x3ff, x;
+	if (e == 0x1f) {
+		x = s | 0x7f800000 | m << 13;
+	} else if (e) {
+		x = s | (e + 112) << 23 | m << 13;
+	} else if (m) {
+		e = 113;
+		while (!(m & 0x400)) {
+			m <<= 1;
+			e--;
+		}
+		x = s | e << 23 | (m & 0x3ff) << 13;
+	} else {
+		x = s;
+	}
+	float f;
+	memcpy(&f, &x, sizeof(f));
+	return f;
 }
 
-cl_context _opencl_context::get_context(cl_platform_id platform) {
-	cl_context_properties properties[] = {
-		CL_CONTEXT_PLATFORM,
-		(cl_context_properties)platform,
-		0
-	};
-	return clCreateContextFromType(properties, CL_DEVICE_TYPE_GPU, NULL, NULL, NULL);
-}
+cl_hmat::cl_hmat(_opencl_context* context, cl_mem mem, int n, int m)
+	: context(context), mem(mem), n(n), m(m) {}
 
-cl_command_queue _opencl_context::get_command_queue(
-	cl_context context, cl_device_id device
-) {
-	return clCreateCommandQueueWithProperties(context, device, 0, NULL);
+void cl_hmat::destroy() {
+	if (context && mem) {
+		context->recycle(n*m*(int)sizeof(cl_half), mem);
+		mem = NULL;
+	}
 }
 
-cl_program _opencl_context::get_program(cl_device_id device, cl_context context) {
-	const char* PATH = "kernels.c";
-	FILE* f = fopen(PATH, "rb");
-	fseek(f, 0, SEEK_END);
-	long fsize = ftell(f);
-	fseek(f, 0, SEEK_SET);
-	char* source = new char[fsize + 1];
-	fread(source, fsize, 1, f);
-	fclose(f);
-	source[fsize] = 0;
+cl_int4 cl_hmat::desc(bool t) const {
+	cl_int4 d = {{0, t ? m : n, t ? n : 1, t ? 1 : n}};
+	return d;
+}
 
-	cl_program program = clCreateProgramWithSource(
-		context, 1, (const char**)&source, NULL, NULL
-	);
+cl_hmat::cl_hmat(const cl_hmat& b) : context(b.context),
+	mem(b.context->new_buffer(b.n*b.m*sizeof(cl_half))), n(b.n), m(b.m)
+{
+	context->mem_copy(b.mem, mem, n*m*sizeof(cl_half));
+}
 
-	cl_device_id devices[] = {device};
-	clBuildProgram(program, 1, devices, NULL, NULL, NULL);
+cl_hmat::cl_hmat(cl_hmat&& b) : context(b.context), mem(b.mem), n(b.n), m(b.m) {
+	b.mem = NULL;
+}
 
-	delete[] source;
-	return program;
+cl_hmat& cl_hmat::operator= (const cl_hmat& b) {
+	if (this != &b) {
+		check_dims(n, b.n);
+		check_dims(m, b.m);
+		if (!mem)
+			mem = context->new_buffer(n*m*sizeof(cl_half));
+		context->mem_copy(b.mem, mem, n*m*sizeof(cl_half));
+	}
+	return *this;
 }
 
-cl_kernel _opencl_context::get_kernel(std::string name) {
-	if (!kernel_cache.count(name)) {
-		int err;
-		kernel_cache[name] = clCreateKernel(program, name.c_str(), &err);
-		#ifdef IOPP_ENABLE_OPENCL_LOG
-			std::cerr << "kernel error " << name << ' ' << err << '\n';
-		#endif
+cl_hmat& cl_hmat::operator= (cl_hmat&& b) {
+	if (this != &b) {
+		check_dims(n, b.n);
+		check_dims(m, b.m);
+		destroy();
+		mem = b.mem;
+		b.mem = NULL;
 	}
-	return kernel_cache[name];
+	return *this;
 }
 
-_opencl_context::_opencl_context() {
+cl_hmat::~cl_hmat() {
+	destroy();
+}
+
+int cl_hmat::rows() const {
+	return n;
+}
+
+int cl_hmat::cols() const {
+	return m;
+}
+
+la::mat cl_hmat::get() const {
+	la::mat a(n, m);
+	std::vector<cl_half> buff(n * m);
+	context->mem_read(mem, buff.data(), n*m*sizeof(cl_half));
+	for (int i=0; i<n; i++)
+		for (int j=0; j<m; j++)
+			a[i][j] = float_of(buff[i + j*n]);
+	return a;
+}
+
+void cl_hmat::set(const la::mat& a) {
+	check_dims(n, a.rows());
+	check_dims(m, a.cols());
+	std::vector<cl_half> buff(n * m);
+	for (int i=0; i<n; i++)
+		for (int j=0; j<m; j++)
+			buff[i + j*n] = half_of(a[i][j]);
+	context->mem_write(buff.data(), mem, n*m*sizeof(cl_half));
+}
+
+cl_hmat& cl_hmat::pack(const cl_mat& a) {
+	check_dims(n, a.n);
+	check_dims(m, a.m);
+	context->run_kernel("hpack", {threads1d(n*m)},
+		a.mem, a.desc(), mem, desc(), n*m);
+	return *this;
+}
+
+cl_mat cl_hmat::full() const {
+	auto r = context->mat(n, m);
+	context->run_kernel("hunpack", {threads1d(n*m)},
+		mem, desc(), r.mem, r.desc(), n*m);
+	return r;
+}
+
+cl_val cl_hmat::sum() const {
+	int threads = std::max(LOCAL_SIZE, LOCAL_SIZE * (int)::sqrt(n*m / 512.0));
+	cl_vec temp = context->vec(threads);
+	cl_val r(context, context->new_buffer(sizeof(float)));
+	context->run_kernel("hrdsum_1", {threads}, mem, desc(), temp.mem, n*m, threads);
+	context->run_kernel("rdsum_2", {}, temp.mem, r.mem, threads);
+	return r;
+}
+
+cl_mat cl_hmat::dense(const cl_mat& x, const cl_vec& b, act f, cl_mat* z) const {
+	check_dims(m, x.n);
+	check_dims(n, b.n);
+	if (z) {
+		check_dims(n, z->n);
+		check_dims(x.m, z->m);
+	}
+	auto r = context->mat(n, x.m);
+	cl_mem zm = z ? z->mem : NULL;
+	cl_int4 dz = z ? z->desc() : r.desc();
+	context->run_kernel("hmmdense", {n, x.m}, mem, desc(), x.mem, x.desc(),
+		b.mem, b.desc(), r.mem, r.desc(), zm, dz, n, m, x.m, (int)f);
+	return r;
+}
+
+cl_hmat _opencl_context::hmat(int n, int m) {
+	return cl_hmat(this, new_buffer(n*m*sizeof(cl_half)), n, m);
+}
+
+cl_hmat _opencl_context::half(const cl_mat& a) {
+	auto r = hmat(a.n, a.m);
+	r.pack(a);
+	return r;
+}
+
+//
+// cl_dataset
+//
+
+
+
+
+cl_dataset::cl_dataset(_opencl_context* context, int n, int d, int k,
+	bool bytes, float scale
+) : context(context), n(n), d(d), k(k), bytes(bytes), scale(scale) {
+	data = context->new_buffer(n*d*(bytes ? 1 : sizeof(float)));
+	labels = context->new_buffer(n*sizeof(int));
+	perm = context->new_buffer(n*sizeof(int));
+	conf = context->new_buffer(k*k*sizeof(int));
+	std::vector<int> p(n);
+	for (int i=0; i<n; i++)
+		p[i] = i;
+	context->mem_write(p.data(), perm, n*sizeof(int));
+	clear_counts();
+}
+
+void cl_dataset::destroy() {
+	if (context && data) {
+		context->recycle(n*d*(bytes ? 1 : sizeof(float)), data);
+		context->recycle(n*sizeof(int), labels);
+		context->recycle(n*sizeof(int), perm);
+		context->recycle(k*k*sizeof(int), conf);
+		data = NULL;
+	}
+}
+
+cl_dataset::cl_dataset(cl_dataset&& b) : context(b.context), data(b.data),
+	labels(b.labels), perm(b.perm), conf(b.conf), n(b.n), d(b.d), k(b.k),
+	bytes(b.bytes), scale(b.scale)
+{
+	b.data = NULL;
+}
+
+cl_dataset& cl_dataset::operator= (cl_dataset&& b) {
+	if (this != &b) {
+		destroy();
+		context = b.context;
+		data = b.data;
+		labels = b.labels;
+		perm = b.perm;
+		conf = b.conf;
+		n = b.n;
+		d = b.d;
+		k = b.k;
+		bytes = b.bytes;
+		scale = b.scale;
+		b.data = NULL;
+	}
+	return *this;
+}
+
+cl_dataset::~cl_dataset() {
+	destroy();
+}
+
+int cl_dataset::size() const {
+	return n;
+}
+
+void cl_dataset::shuffle() {
+	int h = 1;
+	while ((1LL << 2*h) < n)
+		h++;
+	unsigned key = (unsigned)rand() * 2654435761u ^ (unsigned)rand();
+	context->run_kernel("dshuffle", {n}, perm, n, h, key);
+}
+
+void cl_dataset::gather(int i, cl_mem x, cl_int4 dx, cl_mem t, cl_int4 dt,
+	int l
+) const {
+	context->run_kernel(bytes ? "dgather_u8" : "dgather", {std::max(d, k), l},
+		data, labels, perm, x, dx, t, dt, n, d, k, i % n, l, scale);
+}
+
+void cl_dataset::batch(int i, cl_mat& x, cl_mat& t) const {
+	check_dims(d, x.n);
+	check_dims(k, t.n);
+	check_dims(x.m, t.m);
+	gather(i, x.mem, x.desc(), t.mem, t.desc(), x.m);
+}
+
+void cl_dataset::batch(int i, cl_vec& x, cl_vec& t) const {
+	check_dims(d, x.n);
+	check_dims(k, t.n);
+	gather(i, x.mem, x.desc(), t.mem, t.desc(), 1);
+}
+
+void cl_dataset::clear_counts() {
+	std::vector<int> c(k*k, 0);
+	context->mem_write(c.data(), conf, k*k*sizeof(int));
+}
+
+void cl_dataset::count(int i, const cl_mat& a) {
+	check_dims(k, a.n);
+	context->run_kernel("dcount", {a.m}, a.mem, a.desc(), labels, perm, conf,
+		n, k, i % n, a.m);
+}
+
+std::vector<int> cl_dataset::counts() const {
+	std::vector<int> c(k*k);
+	context->mem_read(conf, c.data(), k*k*sizeof(int));
+	return c;
+}
+
+cl_dataset _opencl_context::dataset(int n, int d, int k,
+	const float* x, const int* y
+) {
+	cl_dataset r(this, n, d, k, false, 1);
+	mem_write(x, r.data, n*d*sizeof(float));
+	mem_write(y, r.labels, n*sizeof(int));
+	return r;
+}
+
+cl_dataset _opencl_context::dataset(int n, int d, int k,
+	const unsigned char* x, const int* y, float scale
+) {
+	cl_dataset r(this, n, d, k, true, scale);
+	mem_write(x, r.data, n*d);
+	mem_write(y, r.labels, n*sizeof(int));
+	return r;
+}
+
+//
+// cl_qmat
+//
+
+cl_qmat::cl_qmat(_opencl_context* context, int n, int m) :
+	context(context), n(n), m(m)
+{
+	q = context->new_buffer(n*m);
+	s = context->new_buffer(n*sizeof(float));
+}
+
+void cl_qmat::destroy() {
+	if (context && q) {
+		context->recycle(n*m, q);
+		context->recycle(n*sizeof(float), s);
+		q = NULL;
+	}
+}
+
+cl_qmat::cl_qmat(cl_qmat&& b) : context(b.context), q(b.q), s(b.s),
+	n(b.n), m(b.m)
+{
+	b.q = NULL;
+}
+
+cl_qmat& cl_qmat::operator= (cl_qmat&& b) {
+	if (this != &b) {
+		destroy();
+		context = b.context;
+		q = b.q;
+		s = b.s;
+		n = b.n;
+		m = b.m;
+		b.q = NULL;
+	}
+	return *this;
+}
+
+cl_qmat::~cl_qmat() {
+	destroy();
+}
+
+int cl_qmat::rows() const {
+	return n;
+}
+
+int cl_qmat::cols() const {
+	return m;
+}
+
+void cl_qmat::dense(const cl_dataset& data, int i, const cl_vec& b, act f,
+	cl_mat& y
+) const {
+	if (!data.bytes)
+		throw "quantized dense needs byte samples";
+	check_dims(m, data.d);
+	check_dims(n, b.n);
+	check_dims(n, y.n);
+	context->run_kernel("qdense_u8", {n, y.m}, q, s, data.data, data.perm,
+		i, data.n, b.mem, b.desc(), y.mem, y.desc(), n, m, y.m, data.scale,
+		(int)f);
+}
+
+cl_qmat _opencl_context::quantize(const cl_mat& w) {
+	cl_qmat r(this, w.n, w.m);
+	run_kernel("qpack", {w.n * LOCAL_SIZE}, w.mem, w.desc(), r.q, r.s,
+		w.n, w.m);
+	return r;
+}
+
+//
+// cl_workspace
+//
+
+// at most one per thread is active, see begin()
+static thread_local cl_workspace* active_workspace = NULL;
+
+cl_workspace::cl_workspace(_opencl_context* context, bool strict) :
+	context(context), steps(0), taken(0), missed(0), reported(0),
+	strict(strict), active(false) {}
+
+void cl_workspace::destroy() {
+	if (active) {
+		active_workspace = NULL;
+		active = false;
+	}
+	for (auto& f : arena)
+		for (cl_mem m : f.second)
+			context->recycle(f.first, m);
+	arena.clear();
+}
+
+cl_workspace::cl_workspace(cl_workspace&& b) : context(b.context),
+	arena(std::move(b.arena)), steps(b.steps), taken(b.taken),
+	missed(b.missed), reported(b.reported), strict(b.strict),
+	active(b.active)
+{
+	if (active)
+		active_workspace = this;
+	b.arena.clear();
+	b.active = false;
+}
+
+cl_workspace& cl_workspace::operator= (cl_workspace&& b) {
+	if (this != &b) {
+		destroy();
+		context = b.context;
+		arena = std::move(b.arena);
+		steps = b.steps;
+		taken = b.taken;
+		missed = b.missed;
+		reported = b.reported;
+		strict = b.strict;
+		active = b.active;
+		if (active)
+			active_workspace = this;
+		b.arena.clear();
+		b.active = false;
+	}
+	return *this;
+}
+
+cl_workspace::~cl_workspace() {
+	destroy();
+}
+
+// only the thread that began the step gets here, no lock is needed
+cl_mem cl_workspace::take(int len) {
+	auto& f = arena[len];
+	if (!f.empty()) {
+		cl_mem m = f.back();
+		f.pop_back();
+		return m;
+	}
+	taken++;
+	if (steps >= 2) {
+		missed++;
+		#ifdef IOPP_ENABLE_OPENCL_LOG
+			std::cerr << "workspace miss " << len << " in step " << steps << '\n';
+		#endif
+	}
+	return context->pool_buffer(len);
+}
+
+void cl_workspace::begin() {
+	if (active_workspace)
+		throw "a workspace is already active on this thread";
+	active_workspace = this;
+	active = true;
+}
+
+void cl_workspace::end() {
+	if (!active)
+		throw "workspace end without begin";
+	active_workspace = NULL;
+	active = false;
+	steps++;
+	bool fresh = missed > reported;
+	reported = missed;
+	if (strict && fresh)
+		throw "allocation in a steady-state workspace step";
+}
+
+int cl_workspace::allocations() const {
+	return taken;
+}
+
+int cl_workspace::misses() const {
+	return missed;
+}
+
+cl_workspace _opencl_context::workspace(bool strict) {
+	return cl_workspace(this, strict);
+}
+
+//
+// cl_graph
+//
+
+// the graph recording on this thread
+static thread_local cl_graph* recording_graph = NULL;
+
+cl_graph::cl_graph(_opencl_context* context) :
+	context(context), active(false) {}
+
+// a graph holds a buffer as one more handle, like a view
+void cl_graph::hold(cl_mem mem) {
+	if (std::find(held.begin(), held.end(), mem) != held.end())
+		return;
+	context->retain(mem);
+	held.push_back(mem);
+}
+
+cl_kernel cl_graph::kernel(const std::string& name) {
+	cl_kernel k = clCreateKernel(context->program, name.c_str(), NULL);
+	if (!k)
+		throw "cannot record kernel";
+	return k;
+}
+
+void cl_graph::record(const std::vector<cl_mem>& mems,
+	const std::vector<char>& writes, cl_kernel k, int dc,
+	const size_t* gws, const size_t* lws, int n
+) {
+	command c;
+	c.kernel = k;
+	c.dc = dc;
+	c.n = n;
+	for (int i=0; i<2; i++) {
+		c.gws[i] = gws ? gws[i] : 0;
+		c.lws[i] = lws ? lws[i] : 0;
+	}
+	c.mems = mems;
+	c.writes = writes;
+	for (int a=0; a<(int)mems.size(); a++) {
+		if (!mems[a])
+			continue;
+		hold(mems[a]);
+		for (int i=0; i<(int)inputs.size(); i++)
+			if (inputs[i].mem == mems[a])
+				bindings.push_back({(int)commands.size(), a, i});
+	}
+	commands.push_back(c);
+}
+
+void cl_graph::clear() {
+	for (auto& c : commands)
+		if (c.kernel)
+			clReleaseKernel(c.kernel);
+	for (cl_mem m : held)
+		context->recycle(-1, m);
+	commands.clear();
+	bindings.clear();
+	held.clear();
+}
+
+void cl_graph::destroy() {
+	if (active) {
+		recording_graph = NULL;
+		active = false;
+	}
+	if (context)
+		clear();
+	for (auto& x : inputs)
+		context->recycle(-1, x.mem);
+	inputs.clear();
+}
+
+cl_graph::cl_graph(cl_graph&& b) : context(b.context),
+	commands(std::move(b.commands)), bindings(std::move(b.bindings)),
+	inputs(std::move(b.inputs)), held(std::move(b.held)), active(b.active)
+{
+	if (active)
+		recording_graph = this;
+	b.context = NULL;
+	b.active = false;
+}
+
+cl_graph& cl_graph::operator= (cl_graph&& b) {
+	if (this != &b) {
+		destroy();
+		context = b.context;
+		commands = std::move(b.commands);
+		bindings = std::move(b.bindings);
+		inputs = std::move(b.inputs);
+		held = std::move(b.held);
+		active = b.active;
+		if (active)
+			recording_graph = this;
+		b.context = NULL;
+		b.active = false;
+	}
+	return *this;
+}
+
+cl_graph::~cl_graph() {
+	destroy();
+}
+
+int cl_graph::input(const cl_mat& x) {
+	if (x.context != context)
+		throw "graph spans contexts";
+	if (!commands.empty() || active)
+		throw "graph inputs are marked before recording";
+	context->retain(x.mem);
+	inputs.push_back({x.mem, x.n, x.m, x.off, x.ld});
+	return inputs.size() - 1;
+}
+
+void cl_graph::bind(int i, const cl_mat& x) {
+	if (i < 0 || i >= (int)inputs.size())
+		throw "graph input out of range";
+	auto& d = inputs[i];
+	if (x.context != context || x.n != d.n || x.m != d.m
+		|| x.off != d.off || x.ld != d.ld)
+	{
+		throw "graph input shape mismatch";
+	}
+	if (x.mem == d.mem)
+		return;
+	context->retain(x.mem);
+	context->recycle(-1, d.mem);
+	d.mem = x.mem;
+	for (auto& b : bindings) {
+		if (b.i != i)
+			continue;
+		auto& c = commands[b.c];
+		c.mems[b.a] = x.mem;
+		if (c.kernel)
+			clSetKernelArg(c.kernel, b.a, sizeof(cl_mem), &x.mem);
+		hold(x.mem);
+	}
+}
+
+void cl_graph::begin() {
+	if (recording_graph)
+		throw "a graph is already recording on this thread";
+	clear();
+	recording_graph = this;
+	active = true;
+}
+
+void cl_graph::end() {
+	if (!active)
+		throw "graph end without begin";
+	recording_graph = NULL;
+	active = false;
+}
+
+void cl_graph::replay() {
+	if (active)
+		throw "graph replayed while recording";
+	auto& q = context->get_queue();
+	for (auto& c : commands) {
+		cl_event e = context->enqueue(q, c.mems.size(), c.mems.data(),
+			c.writes.data(), [&](cl_uint wn, const cl_event* w, cl_event* ev) {
+				if (!c.kernel)
+					return clEnqueueCopyBuffer(q.queue, c.mems[0], c.mems[1],
+						0, 0, c.n, wn, w, ev);
+				return clEnqueueNDRangeKernel(q.queue, c.kernel,
+					c.dc, NULL, c.gws, c.lws, wn, w, ev);
+			});
+		if (e)
+			clReleaseEvent(e);
+	}
+}
+
+bool cl_graph::empty() const {
+	return commands.empty();
+}
+
+int cl_graph::size() const {
+	return commands.size();
+}
+
+cl_graph _opencl_context::graph() {
+	return cl_graph(this);
+}
+
+//
+// cl_stream
+//
+
+struct _stream_state {
+	_opencl_context* context;
+	// the rows are m floats apart in data, or those of a
+	float* data;
+	la::mat* a;
+	// the file data is mapped from, if any
+	const la::mfile* file;
+	int n, m, h;
+	std::vector<cl_mat> tiles;
+	std::vector<float> staging;
+
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable cv;
+	// a pass over the blocks: how many are uploaded and how many have
+	// their kernels queued
+	int pass, blocks, ready, done;
+	bool write, stop, finished, quit;
+	const char* err;
+
+	void transfer(int k, bool up);
+	void copier();
+};
+
+// block k to or from the buffer it uses, blocking
+void _stream_state::transfer(int k, bool up) {
+	int i = k*h, w = std::min(h, n - i);
+	cl_mem mem = tiles[k % 2].mem;
+	float* src = data ? data + (long long)i*m : staging.data();
+	if (up && a)
+		for (int j=0; j<w; j++)
+			std::copy(&(*a)[i+j][0], &(*a)[i+j][0] + m, &staging[(long long)j*m]);
+	if (up && file && i + h < n)
+		file->prefetch(i + h, std::min(h, n - i - h));
+	if (up)
+		context->mem_write(src, mem, w*m*sizeof(float));
+	else
+		context->mem_read(mem, src, w*m*sizeof(float));
+	if (!up && a)
+		for (int j=0; j<w; j++)
+			std::copy(&staging[(long long)j*m], &staging[(long long)j*m] + m, &(*a)[i+j][0]);
+}
+
+// Block k goes into the buffer of block k-2 once the kernels of k-2 are
+// queued, the queue events make the upload wait for them. With write
+// block k-2 is read back first.
+void _stream_state::copier() {
+	std::unique_lock<std::mutex> g(lock);
+	int seen = 0;
+	for (;;) {
+		cv.wait(g, [&]() { return quit || pass != seen; });
+		if (quit)
+			return;
+		seen = pass;
+		try {
+			for (int k=0; k<blocks+2; k++) {
+				cv.wait(g, [&]() { return stop || done >= k-1; });
+				if (stop)
+					break;
+				g.unlock();
+				if (write && k >= 2)
+					transfer(k-2, false);
+				if (k < blocks)
+					transfer(k, true);
+				g.lock();
+				ready = std::min(k+1, blocks);
+				cv.notify_all();
+			}
+		} catch (const char* e) {
+			if (!g.owns_lock())
+				g.lock();
+			err = e;
+		}
+		finished = true;
+		cv.notify_all();
+	}
+}
+
+cl_stream::cl_stream(_opencl_context* context, float* data, la::mat* a,
+	int n, int m, long long tile_bytes
+) : context(context), n(n), m(m)
+{
+	long long rows = std::min(tile_bytes, 1LL << 30) / ((long long)m * sizeof(float));
+	h = (int)std::max(1LL, std::min(rows, (long long)n));
+	st = new _stream_state();
+	st->context = context;
+	st->data = data;
+	st->a = a;
+	st->file = NULL;
+	st->n = n;
+	st->m = m;
+	st->h = h;
+	st->tiles.reserve(2);
+	st->tiles.push_back(context->mat(m, h));
+	st->tiles.push_back(context->mat(m, h));
+	if (a)
+		st->staging.resize((long long)m * h);
+	st->pass = st->blocks = st->ready = st->done = 0;
+	st->write = st->stop = st->finished = st->quit = false;
+	st->err = NULL;
+	_stream_state* s = st;
+	st->thread = std::thread([s]() { s->copier(); });
+}
+
+void cl_stream::destroy() {
+	if (!st)
+		return;
+	{
+		std::lock_guard<std::mutex> g(st->lock);
+		st->quit = true;
+	}
+	st->cv.notify_all();
+	st->thread.join();
+	delete st;
+	st = NULL;
+}
+
+cl_stream::cl_stream(cl_stream&& b) : context(b.context), n(b.n), m(b.m),
+	h(b.h), st(b.st)
+{
+	b.st = NULL;
+}
+
+cl_stream& cl_stream::operator= (cl_stream&& b) {
+	if (this != &b) {
+		destroy();
+		context = b.context;
+		n = b.n;
+		m = b.m;
+		h = b.h;
+		st = b.st;
+		b.st = NULL;
+	}
+	return *this;
+}
+
+cl_stream::~cl_stream() {
+	destroy();
+}
+
+int cl_stream::rows() const {
+	return n;
+}
+
+int cl_stream::cols() const {
+	return m;
+}
+
+int cl_stream::tile() const {
+	return h;
+}
+
+void cl_stream::each(const std::function<void(cl_mat& x, int i)>& f,
+	bool write
+) {
+	if (recording_graph && recording_graph->context == context)
+		throw "host transfer in a recorded step";
+	_stream_state* s = st;
+	std::unique_lock<std::mutex> g(s->lock);
+	s->blocks = (n + h - 1) / h;
+	s->ready = s->done = 0;
+	s->write = write;
+	s->stop = s->finished = false;
+	s->err = NULL;
+	s->pass++;
+	s->cv.notify_all();
+	try {
+		for (int k=0; k<s->blocks; k++) {
+			s->cv.wait(g, [&]() { return s->ready > k || s->finished; });
+			if (s->ready <= k)
+				break;
+			g.unlock();
+			auto x = s->tiles[k % 2].cols(0, std::min(h, n - k*h));
+			f(x, k*h);
+			g.lock();
+			s->done = k+1;
+			s->cv.notify_all();
+		}
+	} catch (...) {
+		if (!g.owns_lock())
+			g.lock();
+		s->stop = true;
+		s->cv.notify_all();
+		s->cv.wait(g, [&]() { return s->finished; });
+		throw;
+	}
+	s->cv.wait(g, [&]() { return s->finished; });
+	if (s->err)
+		throw s->err;
+}
+
+cl_mat& cl_mat::gemm(float alpha, cl_stream& a, bool ta,
+	const cl_mat& b, bool tb, float beta
+) {
+	check_dims(n, ta ? a.cols() : a.rows());
+	check_dims(ta ? a.rows() : a.cols(), tb ? b.m : b.n);
+	check_dims(m, tb ? b.n : b.m);
+	if (!ta) {
+		a.each([&](cl_mat& x, int i) {
+			block(i, 0, x.m, m).gemm(alpha, x, true, b, tb, beta);
+		});
+		return *this;
+	}
+	// a sum over the blocks, beta only scales the first term
+	a.each([&](cl_mat& x, int i) {
+		gemm(alpha, x, false, tb ? b.cols(i, x.m) : b.block(i, 0, x.m, b.m),
+			tb, i ? 1 : beta);
+	});
+	return *this;
+}
+
+cl_vec& cl_vec::gemv(float alpha, cl_stream& a, bool ta, const cl_vec& x,
+	float beta
+) {
+	check_dims(n, ta ? a.cols() : a.rows());
+	check_dims(x.n, ta ? a.rows() : a.cols());
+	if (!ta) {
+		a.each([&](cl_mat& y, int i) {
+			slice(i, y.m).gemv(alpha, y, true, x, beta);
+		});
+		return *this;
+	}
+	a.each([&](cl_mat& y, int i) {
+		gemv(alpha, y, false, x.slice(i, y.m), i ? 1 : beta);
+	});
+	return *this;
+}
+
+cl_stream _opencl_context::stream(la::mat& a, long long tile_bytes) {
+	return cl_stream(this, NULL, &a, a.rows(), a.cols(), tile_bytes);
+}
+
+cl_stream _opencl_context::stream(float* a, int n, int m, long long tile_bytes) {
+	return cl_stream(this, a, NULL, n, m, tile_bytes);
+}
+
+cl_stream _opencl_context::stream(la::mmat& a, long long tile_bytes) {
+	a.file().advise(la::mfile::sequential);
+	cl_stream s(this, a.file().data(), NULL, a.rows(), a.cols(), tile_bytes);
+	s.st->file = &a.file();
+	return s;
+}
+
+//
+// _opencl_context (i ostalo, trenutno)
+//
+
+
+
+
+cl_platform_id _opencl_context::get_platform() {
+	cl_platform_id a[1];
+	clGetPlatformIDs(1, a, NULL);
+	return a[0];
+}
+
+// the first GPU, or with several the one IOPP_DEVICE gives (modulo
+// their count), so processes on one machine can spread out
+cl_device_id _opencl_context::get_device(cl_platform_id platform) {
+	cl_device_id a[16];
+	cl_uint n = 0;
+	clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 16, a, &n);
+	const char* e = getenv("IOPP_DEVICE");
+	int k = e ? atoi(e) : 0;
+	if (n == 0 || k < 0)
+		k = 0;
+	else
+		k %= std::min(n, 16u);
+
+	return a[k];
+}
+
+cl_context _opencl_context::get_context(cl_platform_id platform) {
+	cl_context_properties properties[] = {
+		CL_CONTEXT_PLATFORM,
+		(cl_context_properties)platform,
+		0
+	};
+	return clCreateContextFromType(properties, CL_DEVICE_TYPE_GPU, NULL, NULL, NULL);
+}
+
+cl_command_queue _opencl_context::get_command_queue(
+	cl_context context, cl_device_id device
+) {
+	return clCreateCommandQueueWithProperties(context, device, 0, NULL);
+}
+
+cl_program _opencl_context::get_program(cl_device_id device, cl_context context) {
+	const char* PATH = "kernels.c";
+	FILE* f = fopen(PATH, "rb");
+	fseek(f, 0, SEEK_END);
+	long fsize = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char* source = new char[fsize + 1];
+	fread(source, fsize, 1, f);
+	fclose(f);
+	source[fsize] = 0;
+
+	cl_program program = clCreateProgramWithSource(
+		context, 1, (const char**)&source, NULL, NULL
+	);
+
+	cl_device_id devices[] = {device};
+	clBuildProgram(program, 1, devices, "-cl-kernel-arg-info", NULL, NULL);
+
+	delete[] source;
+	return program;
+}
+
+// The queues a host thread holds, by context id. When the thread exits
+// they go back to their contexts, if those still exist.
+struct _queue_owner {
+	std::map<int, _opencl_queue*> queues;
+	~_queue_owner();
+};
+
+// the live contexts by id; a function so that contexts made during
+// static initialization find it, and it outlives them
+static std::mutex contexts_lock;
+static std::map<int, _opencl_context*>& contexts() {
+	static std::map<int, _opencl_context*> m;
+	return m;
+}
+
+_queue_owner::~_queue_owner() {
+	std::lock_guard<std::mutex> g(contexts_lock);
+	for (auto& x : queues) {
+		auto it = contexts().find(x.first);
+		if (it != contexts().end())
+			it->second->release_queue(x.second);
+	}
+}
+
+_opencl_queue& _opencl_context::get_queue() {
+	thread_local _queue_owner mine;
+	auto it = mine.queues.find(id);
+	if (it != mine.queues.end())
+		return *it->second;
+
+	std::lock_guard<std::mutex> g(lock);
+	if (active > 0 && !shared) {
+		// buffers may be shared between queues from now on, drain the
+		// existing work so that it needs no events
+		for (auto q : queues)
+			clFinish(q->queue);
+		shared = true;
+	}
+	_opencl_queue* q;
+	if (!idle.empty()) {
+		q = idle.back();
+		idle.pop_back();
+	} else {
+		q = new _opencl_queue();
+		q->queue = get_command_queue(context, device);
+		queues.push_back(q);
+	}
+	active++;
+	return *(mine.queues[id] = q);
+}
+
+// q is done once its thread is gone; with a single queue left in use
+// nothing has to wait for another one, so the events are dropped
+void _opencl_context::release_queue(_opencl_queue* q) {
+	clFinish(q->queue);
+	std::lock_guard<std::mutex> g(lock);
+	idle.push_back(q);
+	if (--active > 1 || !shared)
+		return;
+	for (auto& x : uses) {
+		if (x.second.write)
+			clReleaseEvent(x.second.write);
+		for (auto& r : x.second.reads)
+			clReleaseEvent(r.second);
+	}
+	uses.clear();
+	shared = false;
+}
+
+_opencl_kernel& _opencl_context::get_kernel(_opencl_queue& q, const std::string& name) {
+	auto it = q.kernel_cache.find(name);
+	if (it != q.kernel_cache.end())
+		return it->second;
+
+	auto& k = q.kernel_cache[name];
+	k.capture = NULL;
+	int err;
+	k.kernel = clCreateKernel(program, name.c_str(), &err);
+	#ifdef IOPP_ENABLE_OPENCL_LOG
+		std::cerr << "kernel error " << name << ' ' << err << '\n';
+	#endif
+
+	cl_uint cnt = 0;
+	clGetKernelInfo(k.kernel, CL_KERNEL_NUM_ARGS, sizeof(cnt), &cnt, NULL);
+	k.writes.resize(cnt);
+	k.mems.resize(cnt);
+	for (cl_uint i=0; i<cnt; i++) {
+		// without arg info every buffer counts as written
+		cl_kernel_arg_address_qualifier aq = CL_KERNEL_ARG_ADDRESS_GLOBAL;
+		cl_kernel_arg_type_qualifier tq = CL_KERNEL_ARG_TYPE_NONE;
+		clGetKernelArgInfo(k.kernel, i, CL_KERNEL_ARG_ADDRESS_QUALIFIER,
+			sizeof(aq), &aq, NULL);
+		clGetKernelArgInfo(k.kernel, i, CL_KERNEL_ARG_TYPE_QUALIFIER,
+			sizeof(tq), &tq, NULL);
+		k.writes[i] = aq == CL_KERNEL_ARG_ADDRESS_GLOBAL
+			&& !(tq & CL_KERNEL_ARG_TYPE_CONST);
+	}
+	return k;
+}
+
+static int next_context_id = 0;
+
+_opencl_context::_opencl_context() : shared(false), active(0), nviews(0) {
+	id = __sync_fetch_and_add(&next_context_id, 1);
 	platform = get_platform();
 	device = get_device(platform);
 	context = get_context(platform);
-	queue = get_command_queue(context, device);
 	program = get_program(device, context);
+	std::lock_guard<std::mutex> g(contexts_lock);
+	contexts()[id] = this;
+}
+
+// b keeps no handles, its destructor does nothing
+_opencl_context::_opencl_context(_opencl_context&& b) :
+	id(b.id), platform(b.platform), device(b.device),
+	context(b.context), program(b.program), shared(b.shared),
+	queues(std::move(b.queues)), idle(std::move(b.idle)), active(b.active),
+	available_buffers(std::move(b.available_buffers)),
+	uses(std::move(b.uses)), views(std::move(b.views)),
+	nviews(b.nviews.load())
+{
+	b.context = NULL;
+	b.program = NULL;
+	b.queues.clear();
+	b.idle.clear();
+	b.available_buffers.clear();
+	b.uses.clear();
+	b.views.clear();
+	b.nviews = 0;
+	std::lock_guard<std::mutex> g(contexts_lock);
+	contexts()[id] = this;
+}
+
+// Queues still held by live threads are released here as well, those
+// threads must not use the context any more. Buffers of live cl_mats and
+// views stay theirs.
+_opencl_context::~_opencl_context() {
+	{
+		std::lock_guard<std::mutex> g(contexts_lock);
+		auto it = contexts().find(id);
+		if (it != contexts().end() && it->second == this)
+			contexts().erase(it);
+	}
+	if (!context)
+		return;
+	for (auto q : queues) {
+		clFinish(q->queue);
+		for (auto& k : q->kernel_cache)
+			clReleaseKernel(k.second.kernel);
+		clReleaseCommandQueue(q->queue);
+		delete q;
+	}
+	for (auto& x : uses) {
+		if (x.second.write)
+			clReleaseEvent(x.second.write);
+		for (auto& r : x.second.reads)
+			clReleaseEvent(r.second);
+	}
+	for (auto& x : available_buffers)
+		for (auto m : x.second)
+			clReleaseMemObject(m);
+	clReleaseProgram(program);
+	clReleaseContext(context);
+}
+
+// Runs cmd(num_events, wait_list, event) for a command on queue q that
+// uses the given buffers. Once several queues exist the command waits
+// for the last conflicting uses from other queues and is recorded as
+// the newest use; its event is returned (the caller releases it),
+// otherwise the event is NULL and cmd should block if it has to.
+template<class F>
+cl_event _opencl_context::enqueue(_opencl_queue& q, int cnt,
+	const cl_mem* mems, const char* writes, F cmd
+) {
+	std::lock_guard<std::mutex> g(lock);
+	if (!shared) {
+		cmd(0, NULL, NULL);
+		return NULL;
+	}
+
+	std::vector<cl_event> wait;
+	for (int i=0; i<cnt; i++) {
+		if (!mems[i])
+			continue;
+		auto& u = uses[mems[i]];
+		if (u.write && u.queue != q.queue)
+			wait.push_back(u.write);
+		if (writes[i])
+			for (auto& r : u.reads)
+				if (r.first != q.queue)
+					wait.push_back(r.second);
+	}
+
+	cl_event e = NULL;
+	cmd(wait.size(), wait.empty() ? NULL : wait.data(), &e);
+
+	for (int i=0; i<cnt; i++) {
+		if (!mems[i])
+			continue;
+		auto& u = uses[mems[i]];
+		clRetainEvent(e);
+		if (writes[i]) {
+			if (u.write)
+				clReleaseEvent(u.write);
+			for (auto& r : u.reads)
+				clReleaseEvent(r.second);
+			u.reads.clear();
+			u.queue = q.queue;
+			u.write = e;
+		} else {
+			bool found = false;
+			for (auto& r : u.reads) {
+				if (r.first == q.queue) {
+					clReleaseEvent(r.second);
+					r.second = e;
+					found = true;
+				}
+			}
+			if (!found)
+				u.reads.push_back({q.queue, e});
+		}
+	}
+	return e;
 }
 
 cl_mem _opencl_context::new_buffer(int len) {
+	cl_workspace* w = active_workspace;
+	if (w && w->context == this)
+		return w->take(len);
+	return pool_buffer(len);
+}
+
+cl_mem _opencl_context::pool_buffer(int len) {
+	std::lock_guard<std::mutex> g(lock);
 	if (available_buffers[len].empty()) {
 		#ifdef IOPP_ENABLE_OPENCL_LOG
 			std::cerr << "allocating new buffer " << len << '\n';
@@ -509,7 +2272,13 @@ cl_mem _opencl_context::new_buffer(int len) {
 }
 
 cl_vec::cl_vec(_opencl_context* context, cl_mem mem, int n)
-	: context(context), mem(mem), n(n) {}
+	: context(context), mem(mem), n(n), off(0), inc(1), view(false) {}
+
+cl_vec::cl_vec(_opencl_context* context, cl_mem mem, int n, int off, int inc)
+	: context(context), mem(mem), n(n), off(off), inc(inc), view(true)
+{
+	context->retain(mem);
+}
 
 cl_mat _opencl_context::mat(int n, int m) {
 	return cl_mat(this, new_buffer(n*m*sizeof(float)), n, m);
@@ -519,7 +2288,9 @@ cl_vec _opencl_context::vec(int n) {
 	return cl_vec(this, new_buffer(n*sizeof(float)), n);
 }
 
-void _opencl_context::run_kernel_impl(std::string name, std::vector<int> dims, int cnt) {
+void _opencl_context::run_kernel_impl(_opencl_queue& q, _opencl_kernel& k,
+	const std::vector<int>& dims, int cnt
+) {
 	size_t gws[2];
 	size_t lws[2];
 	int dc;
@@ -540,65 +2311,1040 @@ void _opencl_context::run_kernel_impl(std::string name, std::vector<int> dims, i
 		throw "invalid number of dimensions";
 	}
 
-	clEnqueueNDRangeKernel(queue, get_kernel(name),
-		dc, NULL, gws, lws,
-		0, NULL, NULL);
+	if (k.capture) {
+		recording_graph->record(k.mems, k.writes, k.capture, dc, gws, lws, 0);
+		k.capture = NULL;
+	}
 
-	clFinish(queue);
+	cl_event e = enqueue(q, cnt, k.mems.data(), k.writes.data(),
+		[&](cl_uint wn, const cl_event* w, cl_event* ev) {
+			return clEnqueueNDRangeKernel(q.queue, k.kernel,
+				dc, NULL, gws, lws,
+				wn, w, ev);
+		});
+	if (e)
+		clReleaseEvent(e);
 }
 
 template<class T, class... U>
-void _opencl_context::run_kernel_impl(std::string name, std::vector<int> dims,
-	int cnt, T arg, U... args
+void _opencl_context::run_kernel_impl(_opencl_queue& q, _opencl_kernel& k,
+	const std::vector<int>& dims, int cnt, T arg, U... args
 ) {
-	clSetKernelArg(get_kernel(name), cnt, sizeof(T), &arg);
-	run_kernel_impl(name, dims, cnt+1, args...);
+	clSetKernelArg(k.kernel, cnt, sizeof(T), &arg);
+	if (k.capture)
+		clSetKernelArg(k.capture, cnt, sizeof(T), &arg);
+	if (cnt < (int)k.mems.size())
+		k.mems[cnt] = buffer_of(arg);
+	run_kernel_impl(q, k, dims, cnt+1, args...);
 }
 
 template<class... T>
 void _opencl_context::run_kernel(std::string name, std::vector<int> dims, T... args) {
-	run_kernel_impl(name, dims, 0, args...);
+	auto& q = get_queue();
+	auto& k = get_kernel(q, name);
+	cl_graph* g = recording_graph;
+	if (g && g->context == this)
+		k.capture = g->kernel(name);
+	try {
+		run_kernel_impl(q, k, dims, 0, args...);
+	} catch (...) {
+		// a launch that failed before it was recorded
+		if (k.capture)
+			clReleaseKernel(k.capture);
+		k.capture = NULL;
+		throw;
+	}
 }
 
 _opencl_context opencl_context() {
 	return _opencl_context();
 }
 
+// a view is one more handle to the buffer of its parent
+void _opencl_context::retain(cl_mem mem) {
+	std::lock_guard<std::mutex> g(lock);
+	auto it = views.find(mem);
+	if (it == views.end()) {
+		views[mem] = {2, -1};
+		nviews++;
+	} else
+		it->second.first++;
+}
+
+// views pass n = -1, the buffer is reused once its last handle is gone
 void _opencl_context::recycle(int n, cl_mem mem) {
-	available_buffers[n].push_back(mem);
+	// inside a workspace step every freed buffer joins the arena; with no
+	// views anywhere mem has none either, and the lock is not needed
+	cl_workspace* w = active_workspace;
+	if (w && w->context != this)
+		w = NULL;
+	if (w && nviews.load() == 0) {
+		w->arena[n].push_back(mem);
+		return;
+	}
+	std::lock_guard<std::mutex> g(lock);
+	auto it = views.find(mem);
+	if (it != views.end()) {
+		if (n >= 0)
+			it->second.second = n;
+		if (--it->second.first > 0)
+			return;
+		n = it->second.second;
+		views.erase(it);
+		nviews--;
+	}
+	if (w)
+		w->arena[n].push_back(mem);
+	else
+		available_buffers[n].push_back(mem);
 }
 
 cl_val::cl_val(_opencl_context* context, float val):
-	context(context), val(val) {}
+	context(context), mem(NULL), val(val) {}
+
+cl_val::cl_val(_opencl_context* context, cl_mem mem):
+	context(context), mem(mem), val(0) {}
+
+void cl_val::destroy() {
+	if (context && mem) {
+		context->recycle(sizeof(float), mem);
+		mem = NULL;
+	}
+}
+
+cl_val::cl_val(const cl_val& b) : context(b.context), mem(NULL), val(b.val) {
+	if (b.mem) {
+		mem = context->new_buffer(sizeof(float));
+		context->mem_copy(b.mem, mem, sizeof(float));
+	}
+}
+
+cl_val::cl_val(cl_val&& b) : context(b.context), mem(b.mem), val(b.val) {
+	b.mem = NULL;
+}
+
+cl_val& cl_val::operator= (const cl_val& b) {
+	if (this != &b) {
+		destroy();
+		context = b.context;
+		val = b.val;
+		if (b.mem) {
+			mem = context->new_buffer(sizeof(float));
+			context->mem_copy(b.mem, mem, sizeof(float));
+		}
+	}
+	return *this;
+}
+
+cl_val& cl_val::operator= (cl_val&& b) {
+	if (this != &b) {
+		destroy();
+		context = b.context;
+		mem = b.mem;
+		val = b.val;
+		b.mem = NULL;
+	}
+	return *this;
+}
+
+cl_val::~cl_val() {
+	destroy();
+}
 
 cl_val _opencl_context::val(float f) {
 	return cl_val(this, f);
 }
 
 float cl_val::get() const {
-	return val;
+	if (!mem)
+		return val;
+	float x;
+	context->mem_read(mem, &x, sizeof(float));
+	return x;
+}
+
+void _opencl_context::finish() {
+	std::vector<_opencl_queue*> all;
+	{
+		std::lock_guard<std::mutex> g(lock);
+		all = queues;
+	}
+	for (auto q : all)
+		clFinish(q->queue);
 }
 
 void _opencl_context::mem_copy(cl_mem src, cl_mem dest, int n) {
-	clEnqueueCopyBuffer(queue, src, dest, 0, 0, n, 0, NULL, NULL);
-	clFinish(queue);
+	cl_graph* g = recording_graph;
+	if (g && g->context == this) {
+		std::vector<cl_mem> mems = {src, dest};
+		g->record(mems, {0, 1}, NULL, 0, NULL, NULL, n);
+	}
+	auto& q = get_queue();
+	cl_mem mems[] = {src, dest};
+	char writes[] = {0, 1};
+	cl_event e = enqueue(q, 2, mems, writes,
+		[&](cl_uint wn, const cl_event* w, cl_event* ev) {
+			return clEnqueueCopyBuffer(q.queue, src, dest, 0, 0, n, wn, w, ev);
+		});
+	if (e)
+		clReleaseEvent(e);
 }
 
+void _opencl_context::check_draw() {
+	if (recording_graph && recording_graph->context == this)
+		throw "random draw in a recorded step";
+}
+
+// blocking; once the queues are shared the wait happens outside the lock
 void _opencl_context::mem_read(cl_mem src, void* dest, int n) {
-	clEnqueueReadBuffer(queue, src, 1,
-		0, n, dest,
-		0, NULL, NULL);
-	clFinish(queue);
+	if (recording_graph && recording_graph->context == this)
+		throw "host transfer in a recorded step";
+	auto& q = get_queue();
+	cl_mem mems[] = {src};
+	char writes[] = {0};
+	cl_event e = enqueue(q, 1, mems, writes,
+		[&](cl_uint wn, const cl_event* w, cl_event* ev) {
+			return clEnqueueReadBuffer(q.queue, src, ev ? CL_FALSE : CL_TRUE,
+				0, n, dest,
+				wn, w, ev);
+		});
+	if (e) {
+		clWaitForEvents(1, &e);
+		clReleaseEvent(e);
+	}
 }
 
 void _opencl_context::mem_write(const void* src, cl_mem dest, int n) {
-	clEnqueueWriteBuffer(queue, dest, 1,
-		0, n, src,
-		0, NULL, NULL);
-	clFinish(queue);
+	if (recording_graph && recording_graph->context == this)
+		throw "host transfer in a recorded step";
+	auto& q = get_queue();
+	cl_mem mems[] = {dest};
+	char writes[] = {1};
+	cl_event e = enqueue(q, 1, mems, writes,
+		[&](cl_uint wn, const cl_event* w, cl_event* ev) {
+			return clEnqueueWriteBuffer(q.queue, dest, ev ? CL_FALSE : CL_TRUE,
+				0, n, src,
+				wn, w, ev);
+		});
+	if (e) {
+		clWaitForEvents(1, &e);
+		clReleaseEvent(e);
+	}
+}
+
+void _opencl_context::mem_read(cl_mem src, int off, int pitch,
+	float* dest, int w, int h
+) {
+	if (recording_graph && recording_graph->context == this)
+		throw "host transfer in a recorded step";
+	if (pitch == w) {
+		w *= h;
+		pitch = w;
+		h = 1;
+	}
+	size_t bo[] = {off*sizeof(float), 0, 0};
+	size_t ho[] = {0, 0, 0};
+	size_t r[] = {w*sizeof(float), (size_t)h, 1};
+	auto& q = get_queue();
+	cl_mem mems[] = {src};
+	char writes[] = {0};
+	cl_event e = enqueue(q, 1, mems, writes,
+		[&](cl_uint wn, const cl_event* wl, cl_event* ev) {
+			return clEnqueueReadBufferRect(q.queue, src, ev ? CL_FALSE : CL_TRUE,
+				bo, ho, r, pitch*sizeof(float), 0, w*sizeof(float), 0, dest,
+				wn, wl, ev);
+		});
+	if (e) {
+		clWaitForEvents(1, &e);
+		clReleaseEvent(e);
+	}
+}
+
+void _opencl_context::mem_write(const float* src, cl_mem dest, int off,
+	int pitch, int w, int h
+) {
+	if (recording_graph && recording_graph->context == this)
+		throw "host transfer in a recorded step";
+	if (pitch == w) {
+		w *= h;
+		pitch = w;
+		h = 1;
+	}
+	size_t bo[] = {off*sizeof(float), 0, 0};
+	size_t ho[] = {0, 0, 0};
+	size_t r[] = {w*sizeof(float), (size_t)h, 1};
+	auto& q = get_queue();
+	cl_mem mems[] = {dest};
+	char writes[] = {1};
+	cl_event e = enqueue(q, 1, mems, writes,
+		[&](cl_uint wn, const cl_event* wl, cl_event* ev) {
+			return clEnqueueWriteBufferRect(q.queue, dest, ev ? CL_FALSE : CL_TRUE,
+				bo, ho, r, pitch*sizeof(float), 0, w*sizeof(float), 0, src,
+				wn, wl, ev);
+		});
+	if (e) {
+		clWaitForEvents(1, &e);
+		clReleaseEvent(e);
+	}
+}
+
+
+//
+// optimizers
+//
+
+
+
+
+void sgd::step(cl_vec& p, cl_vec& v, const cl_vec& g) const {
+	p.check(v);
+	p.check(g);
+	p.context->run_kernel("vsgd", {threads1d(p.n)},
+		p.mem, p.desc(), v.mem, v.desc(), g.mem, g.desc(),
+		p.n, rate, momentum, 1.0f - decay);
+}
+
+void sgd::step(cl_mat& p, cl_mat& v, const cl_mat& g) const {
+	p.check(v);
+	p.check(g);
+	p.context->run_kernel("vsgd", {threads1d(p.n*p.m)},
+		p.mem, p.desc(), v.mem, v.desc(), g.mem, g.desc(),
+		p.n*p.m, rate, momentum, 1.0f - decay);
+}
+
+void sgd::step(cl_mat& p, cl_mat& v, const cl_vec& u, const cl_vec& w) const {
+	p.check(v);
+	check_dims(p.n, u.n);
+	check_dims(p.m, w.n);
+	p.context->run_kernel("msgd_outer", {p.n, p.m},
+		p.mem, p.desc(), v.mem, v.desc(), u.mem, u.desc(), w.mem, w.desc(),
+		p.n, p.m, rate, momentum, 1.0f - decay);
+}
+
+void sgd::step(cl_mat& p, cl_mat& v, const cl_mat& g, cl_hmat& h) const {
+	p.check(v);
+	p.check(g);
+	check_dims(p.n, h.n);
+	check_dims(p.m, h.m);
+	p.context->run_kernel("vsgd_h", {threads1d(p.n*p.m)},
+		p.mem, p.desc(), v.mem, v.desc(), g.mem, g.desc(), h.mem, h.desc(),
+		p.n*p.m, rate, momentum, 1.0f - decay);
+}
+
+void rmsprop::step(cl_vec& p, cl_vec& s, const cl_vec& g) const {
+	p.check(s);
+	p.check(g);
+	p.context->run_kernel("vrmsprop", {threads1d(p.n)},
+		p.mem, p.desc(), s.mem, s.desc(), g.mem, g.desc(),
+		p.n, rate, rho, eps, 1.0f - decay);
+}
+
+void rmsprop::step(cl_mat& p, cl_mat& s, const cl_mat& g) const {
+	p.check(s);
+	p.check(g);
+	p.context->run_kernel("vrmsprop", {threads1d(p.n*p.m)},
+		p.mem, p.desc(), s.mem, s.desc(), g.mem, g.desc(),
+		p.n*p.m, rate, rho, eps, 1.0f - decay);
+}
+
+void rmsprop::step(cl_mat& p, cl_mat& s, const cl_vec& u, const cl_vec& w) const {
+	p.check(s);
+	check_dims(p.n, u.n);
+	check_dims(p.m, w.n);
+	p.context->run_kernel("mrmsprop_outer", {p.n, p.m},
+		p.mem, p.desc(), s.mem, s.desc(), u.mem, u.desc(), w.mem, w.desc(),
+		p.n, p.m, rate, rho, eps, 1.0f - decay);
+}
+
+void adam::next() {
+	t++;
+}
+
+void adam::step(cl_vec& p, cl_vec& m, cl_vec& v, const cl_vec& g) const {
+	p.check(m);
+	p.check(v);
+	p.check(g);
+	float c1 = 1.0f / (1.0f - ::pow(beta1, t));
+	float c2 = 1.0f / (1.0f - ::pow(beta2, t));
+	p.context->run_kernel("vadam", {threads1d(p.n)},
+		p.mem, p.desc(), m.mem, m.desc(), v.mem, v.desc(), g.mem, g.desc(),
+		p.n, rate, beta1, beta2, eps, 1.0f - decay, c1, c2);
+}
+
+void adam::step(cl_mat& p, cl_mat& m, cl_mat& v, const cl_mat& g) const {
+	p.check(m);
+	p.check(v);
+	p.check(g);
+	float c1 = 1.0f / (1.0f - ::pow(beta1, t));
+	float c2 = 1.0f / (1.0f - ::pow(beta2, t));
+	p.context->run_kernel("vadam", {threads1d(p.n*p.m)},
+		p.mem, p.desc(), m.mem, m.desc(), v.mem, v.desc(), g.mem, g.desc(),
+		p.n*p.m, rate, beta1, beta2, eps, 1.0f - decay, c1, c2);
+}
+
+void adam::step(cl_mat& p, cl_mat& m, cl_mat& v, const cl_vec& u, const cl_vec& w) const {
+	p.check(m);
+	p.check(v);
+	check_dims(p.n, u.n);
+	check_dims(p.m, w.n);
+	float c1 = 1.0f / (1.0f - ::pow(beta1, t));
+	float c2 = 1.0f / (1.0f - ::pow(beta2, t));
+	p.context->run_kernel("madam_outer", {p.n, p.m},
+		p.mem, p.desc(), m.mem, m.desc(), v.mem, v.desc(),
+		u.mem, u.desc(), w.mem, w.desc(),
+		p.n, p.m, rate, beta1, beta2, eps, 1.0f - decay, c1, c2);
+}
+
+
+
+//
+// philox
+//
+
+// the seed is the key, the counter the position of the first element
+void philox::fill(const char* fn, _opencl_context* context, cl_mem mem,
+	cl_int4 d, int n, float x, float y
+) {
+	context->check_draw();
+	context->run_kernel(fn, {threads1d(n)}, mem, d, n,
+		(cl_uint)seed, (cl_uint)(seed >> 32),
+		(cl_uint)counter, (cl_uint)(counter >> 32), x, y);
+	counter += n;
+}
+
+void philox::uniform(cl_mat& a, float lo, float hi) {
+	fill("vrand_uniform", a.context, a.mem, a.desc(), a.n*a.m, lo, hi);
+}
+
+void philox::uniform(cl_vec& a, float lo, float hi) {
+	fill("vrand_uniform", a.context, a.mem, a.desc(), a.n, lo, hi);
+}
+
+void philox::normal(cl_mat& a, float mean, float sd) {
+	fill("vrand_normal", a.context, a.mem, a.desc(), a.n*a.m, mean, sd);
+}
+
+void philox::normal(cl_vec& a, float mean, float sd) {
+	fill("vrand_normal", a.context, a.mem, a.desc(), a.n, mean, sd);
+}
+
+void philox::xavier(cl_mat& w) {
+	float r = ::sqrt(6.0f / (w.n + w.m));
+	uniform(w, -r, r);
+}
+
+void philox::he(cl_mat& w) {
+	normal(w, 0, ::sqrt(2.0f / w.m));
+}
+
+unsigned long long philox::dropout(cl_mat& a, float p) {
+	a.context->check_draw();
+	unsigned long long at = counter;
+	dropout(a, p, at);
+	counter += a.n*a.m;
+	return at;
+}
+
+void philox::dropout(cl_mat& a, float p, unsigned long long at) const {
+	if (p < 0 || p >= 1)
+		throw "dropout probability out of range";
+	a.context->run_kernel("vdropout", {threads1d(a.n*a.m)},
+		a.mem, a.desc(), a.mem, a.desc(), a.n*a.m,
+		(cl_uint)seed, (cl_uint)(seed >> 32),
+		(cl_uint)at, (cl_uint)(at >> 32), p);
+}
+
+//
+// cl_tape
+//
+
+
+
+
+cl_tape::cl_tape() : context(NULL), planned(false) {}
+
+cl_tape::~cl_tape() {
+	clear();
+	for (auto p : leaves)
+		delete p;
+}
+
+void cl_tape::clear() {
+	for (auto p : values)
+		delete p;
+	for (auto p : aux)
+		delete p;
+	for (auto p : grads)
+		delete p;
+	values.clear();
+	aux.clear();
+	grads.clear();
+	slots.clear();
+	planned = false;
+}
+
+int cl_tape::add_node(_tape_node t) {
+	int k = nodes.size();
+	for (int i : {t.a, t.b, t.c})
+		if (i >= k)
+			throw "tape node out of range";
+	t.grad = t.op == _tape_node::param;
+	t.factored = false;
+	if (t.op != _tape_node::input && t.op != _tape_node::param)
+		for (int i : {t.a, t.b, t.c})
+			if (i >= 0)
+				t.grad = t.grad || nodes[i].grad;
+	clear();
+	nodes.push_back(t);
+	leaves.push_back(NULL);
+	return k;
+}
+
+// v is a new view of the caller's buffer, the tape owns it
+int cl_tape::leaf(int op, cl_mat* v, cl_mat* pm, cl_mat* vm,
+	cl_vec* pv, cl_vec* vv
+) {
+	if (context && context != v->context) {
+		delete v;
+		throw "tape spans contexts";
+	}
+	context = v->context;
+	_tape_node t = {};
+	t.op = op == _tape_node::input ? _tape_node::input : _tape_node::param;
+	t.a = t.b = t.c = -1;
+	t.n = v->n;
+	t.m = v->m;
+	t.pm = pm;
+	t.vm = vm;
+	t.pv = pv;
+	t.vv = vv;
+	int k = add_node(t);
+	leaves[k] = v;
+	return k;
+}
+
+cl_mat* cl_tape::column(const cl_vec& v) {
+	if (v.inc != 1)
+		throw "tape needs contiguous vectors";
+	return new cl_mat(v.context, v.mem, v.n, 1, v.off, v.n);
+}
+
+int cl_tape::input(const cl_mat& x) {
+	return leaf(_tape_node::input,
+		new cl_mat(x.context, x.mem, x.n, x.m, x.off, x.ld), NULL, NULL, NULL, NULL);
+}
+
+int cl_tape::input(const cl_vec& x) {
+	return leaf(_tape_node::input,
+		column(x), NULL, NULL, NULL, NULL);
+}
+
+int cl_tape::param(cl_mat& p) {
+	return leaf(_tape_node::param,
+		new cl_mat(p.context, p.mem, p.n, p.m, p.off, p.ld), &p, NULL, NULL, NULL);
+}
+
+int cl_tape::param(cl_vec& p) {
+	return leaf(_tape_node::param,
+		column(p), NULL, NULL, &p, NULL);
+}
+
+int cl_tape::param(cl_mat& p, cl_mat& v) {
+	p.check(v);
+	return leaf(_tape_node::param,
+		new cl_mat(p.context, p.mem, p.n, p.m, p.off, p.ld), &p, &v, NULL, NULL);
+}
+
+int cl_tape::param(cl_vec& p, cl_vec& v) {
+	p.check(v);
+	return leaf(_tape_node::param,
+		column(p), NULL, NULL, &p, &v);
+}
+
+int cl_tape::matmul(int a, int b, bool ta, bool tb) {
+	const _tape_node &x = nodes.at(a), &y = nodes.at(b);
+	check_dims(ta ? x.n : x.m, tb ? y.m : y.n);
+	_tape_node t = {};
+	t.op = _tape_node::matmul;
+	t.a = a;
+	t.b = b;
+	t.c = -1;
+	t.ta = ta;
+	t.tb = tb;
+	t.n = ta ? x.m : x.n;
+	t.m = tb ? y.n : y.m;
+	return add_node(t);
+}
+
+int cl_tape::add(int a, int b) {
+	const _tape_node &x = nodes.at(a), &y = nodes.at(b);
+	check_dims(x.n, y.n);
+	check_dims(x.m, y.m);
+	_tape_node t = {};
+	t.op = _tape_node::add;
+	t.a = a;
+	t.b = b;
+	t.c = -1;
+	t.n = x.n;
+	t.m = x.m;
+	return add_node(t);
+}
+
+int cl_tape::mul(int a, int b) {
+	int k = add(a, b);
+	nodes[k].op = _tape_node::mul;
+	return k;
+}
+
+int cl_tape::add_col(int a, int b) {
+	const _tape_node &x = nodes.at(a), &y = nodes.at(b);
+	check_dims(x.n, y.n);
+	check_dims(1, y.m);
+	_tape_node t = {};
+	t.op = _tape_node::add_col;
+	t.a = a;
+	t.b = b;
+	t.c = -1;
+	t.n = x.n;
+	t.m = x.m;
+	return add_node(t);
+}
+
+int cl_tape::tanh(int a) {
+	const _tape_node& x = nodes.at(a);
+	_tape_node t = {};
+	t.op = _tape_node::tanh;
+	t.a = a;
+	t.b = t.c = -1;
+	t.n = x.n;
+	t.m = x.m;
+	return add_node(t);
+}
+
+int cl_tape::relu(int a) {
+	int k = tanh(a);
+	nodes[k].op = _tape_node::relu;
+	return k;
+}
+
+int cl_tape::dense(int w, int x, int b, act f) {
+	const _tape_node &p = nodes.at(w), &q = nodes.at(x), &r = nodes.at(b);
+	check_dims(p.m, q.n);
+	check_dims(p.n, r.n);
+	check_dims(1, r.m);
+	_tape_node t = {};
+	t.op = _tape_node::dense;
+	t.a = w;
+	t.b = x;
+	t.c = b;
+	t.f = f;
+	t.n = p.n;
+	t.m = q.m;
+	return add_node(t);
+}
+
+int cl_tape::dropout(int a, float p, philox& rng) {
+	if (p < 0 || p >= 1)
+		throw "dropout probability out of range";
+	int k = tanh(a);
+	nodes[k].op = _tape_node::dropout;
+	nodes[k].p = p;
+	nodes[k].rng = &rng;
+	return k;
+}
+
+int cl_tape::softmax_xent(int o, int y) {
+	int k = add(o, y);
+	nodes[k].op = _tape_node::softmax_xent;
+	return k;
+}
+
+// Forward runs node i at step i, backward runs it at step 2N-1-i. Every
+// buffer gets the interval of steps it is live in, then intervals are
+// packed greedily into slots of the same size.
+void cl_tape::plan() {
+	clear();
+	int N = nodes.size(), E = 2*N;
+	if (nodes[N-1].op != _tape_node::softmax_xent)
+		throw "tape does not end in a loss";
+
+	// runs[j]: a gradient reaches j
+	runs.assign(N, 0);
+	runs[N-1] = nodes[N-1].grad;
+	for (int j=N-1; j>=0; j--)
+		if (runs[j])
+			for (int i : {nodes[j].a, nodes[j].b, nodes[j].c})
+				if (i >= 0 && nodes[i].grad)
+					runs[i] = 1;
+
+	std::vector<int> vend(N, -1), gbeg(N, E), gend(N, -1), uses(N, 0);
+	for (int j=0; j<N; j++) {
+		auto& t = nodes[j];
+		int bj = E - 1 - j;
+		// the operands the backward of j reads
+		bool keep_a = false, keep_b = false;
+		if (t.op == _tape_node::matmul || t.op == _tape_node::mul
+			|| t.op == _tape_node::dense)
+			keep_a = keep_b = true;
+		if (t.op == _tape_node::tanh || t.op == _tape_node::relu)
+			keep_a = true;
+		if (t.op == _tape_node::softmax_xent)
+			keep_b = true;
+		if (t.a >= 0)
+			vend[t.a] = std::max(vend[t.a], keep_a && runs[j] ? bj : j);
+		if (t.b >= 0)
+			vend[t.b] = std::max(vend[t.b], keep_b && runs[j] ? bj : j);
+		if (t.c >= 0)
+			vend[t.c] = std::max(vend[t.c], j);
+		if (!runs[j])
+			continue;
+		for (int i : {t.a, t.b, t.c}) {
+			if (i >= 0 && runs[i]) {
+				gbeg[i] = std::min(gbeg[i], bj);
+				gend[i] = std::max(gend[i], bj);
+				uses[i]++;
+			}
+		}
+	}
+	for (int i=0; i<N; i++) {
+		auto& t = nodes[i];
+		t.factored = false;
+		if (t.op == _tape_node::param && !t.vm && !t.vv) {
+			gend[i] = E;
+		} else if (t.op == _tape_node::param && t.vm && uses[i] == 1) {
+			// a product with a single column steps with u w^T
+			for (int j=i+1; j<N; j++) {
+				auto& c = nodes[j];
+				if (c.a == i && nodes[c.b].m == 1 && runs[j]
+					&& (c.op == _tape_node::dense
+						|| (c.op == _tape_node::matmul && !c.ta && !c.tb)))
+					t.factored = true;
+			}
+		} else if (t.op != _tape_node::param) {
+			gend[i] = std::max(gend[i], E - 1 - i);
+		}
+	}
+	vend[N-1] = E;
+	kept.assign(N, 0);
+	for (int i=0; i<N; i++)
+		kept[i] = (vend[i] == E || leaves[i]) | (gend[i] == E) << 1;
+
+	struct req { int beg, end; cl_mat** dst; int n, m; };
+	std::vector<req> reqs;
+	values.assign(N, NULL);
+	aux.assign(N, NULL);
+	grads.assign(N, NULL);
+	for (int i=0; i<N; i++) {
+		auto& t = nodes[i];
+		// kept buffers outlive the step, they share with nothing
+		if (t.op != _tape_node::input && t.op != _tape_node::param)
+			reqs.push_back({kept[i] & 1 ? 0 : i, vend[i], &values[i], t.n, t.m});
+		if (t.op == _tape_node::dense && t.f != act::identity && runs[i])
+			reqs.push_back({i, E - 1 - i, &aux[i], t.n, t.m});
+		// the products of the backward of i
+		if ((t.op == _tape_node::mul || t.op == _tape_node::tanh
+			|| t.op == _tape_node::relu) && runs[i])
+			reqs.push_back({E - 1 - i, E - 1 - i, &aux[i], t.n, t.m});
+		if (runs[i] && i < N-1 && !t.factored)
+			reqs.push_back({kept[i] & 2 ? 0 : gbeg[i], gend[i], &grads[i], t.n, t.m});
+	}
+	std::stable_sort(reqs.begin(), reqs.end(),
+		[](const req& x, const req& y) { return x.beg < y.beg; });
+	// no reallocation, growing would copy the slots
+	slots.reserve(reqs.size());
+	std::vector<int> free_at;
+	for (auto& r : reqs) {
+		int s = -1;
+		for (int k=0; k<(int)slots.size(); k++)
+			if (slots[k].n == r.n*r.m && free_at[k] < r.beg) {
+				s = k;
+				break;
+			}
+		if (s < 0) {
+			s = slots.size();
+			slots.push_back(context->mat(r.n*r.m, 1));
+			free_at.push_back(-1);
+		}
+		free_at[s] = r.end;
+		*r.dst = new cl_mat(context, slots[s].mem, r.n, r.m, 0, r.n);
+	}
+	written.assign(N, 0);
+	pending = uses;
+	planned = true;
+}
+
+cl_mat& cl_tape::val(int i) const {
+	cl_mat* v = leaves[i] ? leaves[i] : values[i];
+	if (!v)
+		throw "tape value not kept";
+	return *v;
+}
+
+void cl_tape::forward() {
+	if (nodes.empty())
+		return;
+	if (!planned)
+		plan();
+	for (int i=0; i<(int)nodes.size(); i++) {
+		auto& t = nodes[i];
+		if (t.op == _tape_node::input || t.op == _tape_node::param)
+			continue;
+		cl_mat& y = val(i);
+		const cl_mat& a = val(t.a);
+		switch (t.op) {
+		case _tape_node::matmul:
+			y.gemm(1, a, t.ta, val(t.b), t.tb, 0);
+			break;
+		case _tape_node::add:
+		case _tape_node::mul: {
+			const cl_mat& b = val(t.b);
+			context->run_kernel(t.op == _tape_node::add ? "vadd" : "vmul",
+				{threads1d(t.n*t.m)}, a.mem, a.desc(), b.mem, b.desc(),
+				y.mem, y.desc(), t.n*t.m);
+			break;
+		}
+		case _tape_node::add_col: {
+			const cl_mat& b = val(t.b);
+			context->run_kernel("mbadd", {t.n, t.m}, a.mem, a.desc(),
+				b.mem, b.desc(), y.mem, y.desc(), t.n, t.m);
+			break;
+		}
+		case _tape_node::tanh:
+		case _tape_node::relu:
+			context->run_kernel("vcopy", {threads1d(t.n*t.m)},
+				a.mem, a.desc(), y.mem, y.desc(), t.n*t.m);
+			y.run_function(t.op == _tape_node::tanh ? "vtanhc" : "vreluc");
+			break;
+		case _tape_node::dropout: {
+			auto& r = *t.rng;
+			context->check_draw();
+			t.at = r.counter;
+			r.counter += t.n*t.m;
+			context->run_kernel("vdropout", {threads1d(t.n*t.m)},
+				a.mem, a.desc(), y.mem, y.desc(), t.n*t.m,
+				(cl_uint)r.seed, (cl_uint)(r.seed >> 32),
+				(cl_uint)t.at, (cl_uint)(t.at >> 32), t.p);
+			break;
+		}
+		case _tape_node::dense: {
+			const cl_mat &x = val(t.b), &b = val(t.c);
+			cl_mem zm = aux[i] ? aux[i]->mem : NULL;
+			cl_int4 dz = aux[i] ? aux[i]->desc() : y.desc();
+			context->run_kernel("mmdense", {t.n, t.m}, a.mem, a.desc(),
+				x.mem, x.desc(), b.mem, b.desc(), y.mem, y.desc(), zm, dz,
+				t.n, a.m, t.m, (int)t.f);
+			break;
+		}
+		case _tape_node::softmax_xent:
+			context->run_kernel("msoftmax", {t.m * LOCAL_SIZE},
+				a.mem, a.desc(), y.mem, y.desc(), t.n);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+void cl_tape::acc(int i, const cl_mat& g) {
+	if (!runs[i])
+		return;
+	if (written[i])
+		*grads[i] += g;
+	else
+		*grads[i] = g;
+	written[i] = 1;
+}
+
+void cl_tape::acc(int i, const cl_vec& g) {
+	if (!runs[i])
+		return;
+	auto v = grads[i]->col(0);
+	if (written[i])
+		v += g;
+	else
+		v = g;
+	written[i] = 1;
+}
+
+// the row sums of g, added to the gradient of i
+void cl_tape::acc_sums(int i, const cl_mat& g) {
+	if (!runs[i])
+		return;
+	cl_mat& s = *grads[i];
+	context->run_kernel(written[i] ? "msum_acc" : "msum", {g.n * LOCAL_SIZE},
+		g.mem, g.desc(true), s.mem, s.desc(), g.m);
+	written[i] = 1;
+}
+
+void cl_tape::acc_gemm(int i, const cl_mat& a, bool ta, const cl_mat& b, bool tb) {
+	if (!runs[i])
+		return;
+	grads[i]->gemm(1, a, ta, b, tb, written[i] ? 1 : 0);
+	written[i] = 1;
+}
+
+void cl_tape::step(int i, const sgd* opt) {
+	auto& t = nodes[i];
+	if (t.vm)
+		opt->step(*t.pm, *t.vm, *grads[i]);
+	else
+		opt->step(*t.pv, *t.vv, grads[i]->col(0));
+}
+
+// the backward of a consumer of i is done
+void cl_tape::done(int i, const sgd* opt, const std::function<void(int)>* ready) {
+	if (i < 0 || !runs[i] || --pending[i] > 0)
+		return;
+	auto& t = nodes[i];
+	if (t.op == _tape_node::param && (t.vm || t.vv) && !t.factored)
+		step(i, opt);
+	else if (t.op == _tape_node::param && ready)
+		(*ready)(i);
+}
+
+void cl_tape::backward_impl(const sgd* opt, const std::function<void(int)>* ready) {
+	if (!planned)
+		throw "backward before forward";
+	int N = nodes.size();
+	for (auto& t : nodes)
+		if (t.op == _tape_node::param && (t.vm || t.vv) && !opt)
+			throw "tape needs an optimizer";
+	std::fill(written.begin(), written.end(), 0);
+	for (int i=0; i<N; i++)
+		pending[i] = 0;
+	for (int j=0; j<N; j++)
+		if (runs[j])
+			for (int i : {nodes[j].a, nodes[j].b, nodes[j].c})
+				if (i >= 0 && runs[i])
+					pending[i]++;
+
+	for (int j=N-1; j>=0; j--) {
+		auto& t = nodes[j];
+		if (!runs[j] || t.op == _tape_node::input || t.op == _tape_node::param)
+			continue;
+		switch (t.op) {
+		case _tape_node::softmax_xent:
+			if (runs[t.a]) {
+				const cl_mat &s = val(j), &y = val(t.b);
+				cl_mat& g = *grads[t.a];
+				context->run_kernel("msoftmax_xent_d", {t.m * LOCAL_SIZE},
+					s.mem, s.desc(), y.mem, y.desc(), g.mem, g.desc(), t.n);
+				written[t.a] = 1;
+			}
+			break;
+		case _tape_node::matmul: {
+			const cl_mat &g = *grads[j], &a = val(t.a), &b = val(t.b);
+			if (t.tb)
+				acc_gemm(t.b, g, true, a, t.ta);
+			else
+				acc_gemm(t.b, a, !t.ta, g, false);
+			if (nodes[t.a].factored)
+				opt->step(*nodes[t.a].pm, *nodes[t.a].vm, g.col(0), b.col(0));
+			else if (t.ta)
+				acc_gemm(t.a, b, t.tb, g, true);
+			else
+				acc_gemm(t.a, g, false, b, !t.tb);
+			break;
+		}
+		case _tape_node::add:
+			acc(t.a, *grads[j]);
+			acc(t.b, *grads[j]);
+			break;
+		case _tape_node::mul: {
+			const cl_mat& g = *grads[j];
+			cl_mat& p = *aux[j];
+			for (int k : {t.a, t.b}) {
+				if (!runs[k])
+					continue;
+				const cl_mat& b = val(k == t.a ? t.b : t.a);
+				context->run_kernel("vmul", {threads1d(t.n*t.m)},
+					g.mem, g.desc(), b.mem, b.desc(), p.mem, p.desc(), t.n*t.m);
+				acc(k, p);
+			}
+			break;
+		}
+		case _tape_node::add_col:
+			acc(t.a, *grads[j]);
+			acc_sums(t.b, *grads[j]);
+			break;
+		case _tape_node::tanh:
+		case _tape_node::relu: {
+			// the derivative at a goes into the planned slot, the
+			// gradient of j is not needed after this
+			const cl_mat& a = val(t.a);
+			cl_mat &g = *grads[j], &d = *aux[j];
+			context->run_kernel("vcopy", {threads1d(t.n*t.m)},
+				a.mem, a.desc(), d.mem, d.desc(), t.n*t.m);
+			d.run_function(t.op == _tape_node::tanh ? "vtanh_dc" : "vrelu_dc");
+			g *= d;
+			acc(t.a, g);
+			break;
+		}
+		case _tape_node::dropout:
+			// the mask is made again in place, nothing was kept for it
+			t.rng->dropout(*grads[j], t.p, t.at);
+			acc(t.a, *grads[j]);
+			break;
+		case _tape_node::dense: {
+			// neither z nor the gradient of j is needed after this, the
+			// gradient of z = W x + b is made in place
+			cl_mat& g = *grads[j];
+			if (t.f != act::identity) {
+				aux[j]->run_function(t.f == act::tanh ? "vtanh_dc" : "vrelu_dc");
+				g *= *aux[j];
+			}
+			const cl_mat &w = val(t.a), &x = val(t.b);
+			acc_gemm(t.b, w, true, g, false);
+			if (nodes[t.a].factored)
+				opt->step(*nodes[t.a].pm, *nodes[t.a].vm, g.col(0), x.col(0));
+			else
+				acc_gemm(t.a, g, false, x, true);
+			acc_sums(t.c, g);
+			break;
+		}
+		default:
+			break;
+		}
+		done(t.a, opt, ready);
+		done(t.b, opt, ready);
+		done(t.c, opt, ready);
+	}
+}
+
+void cl_tape::backward() {
+	backward_impl(NULL, NULL);
+}
+
+void cl_tape::backward(const sgd& opt) {
+	backward_impl(&opt, NULL);
+}
+
+void cl_tape::backward(const std::function<void(int)>& ready) {
+	backward_impl(NULL, &ready);
+}
+
+const cl_mat& cl_tape::value(int i) const {
+	if (i < 0 || i >= (int)nodes.size() || !planned || !(kept[i] & 1))
+		throw "tape value not kept";
+	return val(i);
+}
+
+const cl_mat& cl_tape::grad(int i) const {
+	if (i < 0 || i >= (int)nodes.size() || !planned || !grads[i]
+		|| !(kept[i] & 2))
+		throw "tape gradient not kept";
+	return *grads[i];
+}
+
+long long cl_tape::bytes() const {
+	long long s = 0;
+	for (auto& b : slots)
+		s += (long long)b.n * b.m * sizeof(float);
+	return s;
 }
 
 
+
 //
 // experiments etc
 //
@@ -641,5 +3387,65 @@ cl_vec tanh_d(const cl_vec& a) {
 	return b;
 }
 
+cl_vec softmax(const cl_vec& a) {
+	return a.softmax();
+}
+
+cl_vec log_softmax(const cl_vec& a) {
+	return a.log_softmax();
+}
+
+cl_mat sqrt(const cl_mat& a) {
+	auto b = a;
+	b.run_function("vsqrtc");
+	return b;
+}
+
+cl_mat exp(const cl_mat& a) {
+	auto b = a;
+	b.run_function("vexpc");
+	return b;
+}
+
+cl_mat relu(const cl_mat& a) {
+	auto b = a;
+	b.run_function("vreluc");
+	return b;
+}
+
+cl_mat relu_d(const cl_mat& a) {
+	auto b = a;
+	b.run_function("vrelu_dc");
+	return b;
+}
+
+cl_mat tanh(const cl_mat& a) {
+	auto b = a;
+	b.run_function("vtanhc");
+	return b;
+}
+
+cl_mat tanh_d(const cl_mat& a) {
+	auto b = a;
+	b.run_function("vtanh_dc");
+	return b;
+}
+
+cl_bvec by_col(const cl_vec& b) {
+	return {b, false};
+}
+
+cl_bvec by_row(const cl_vec& b) {
+	return {b, true};
+}
+
+cl_mat softmax(const cl_mat& a) {
+	return a.softmax();
+}
+
+cl_mat log_softmax(const cl_mat& a) {
+	return a.log_softmax();
+}
+
 
 } // end namespace iopp
\ No newline at end of file
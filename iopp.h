@@ -6,6 +6,9 @@
 #include <map>
 #include <vector>
 #include <string>
+#include <mutex>
+#include <atomic>
+#include <functional>
 
 #define LOCAL_SIZE 64
 #define LOCAL_SIZE_SQRT 8
@@ -13,22 +16,58 @@
 
 namespace iopp {
 
+// activations for the fused layer kernels
+enum class act { identity, tanh, relu };
+
 class _opencl_context;
 class cl_vec;
 class cl_val;
 class cl_mat;
+class cl_hmat;
+class cl_qmat;
+class cl_stream;
+struct _stream_state;
+class cl_dataset;
+class cl_tape;
+class cl_workspace;
+class cl_graph;
+struct cl_bvec;
+struct sgd;
+struct rmsprop;
+struct adam;
+struct philox;
 
 class cl_mat {
 	friend class _opencl_context;
 	friend class cl_vec;
 	friend class cl_val;
+	friend class cl_hmat;
+	friend class cl_qmat;
+	friend class cl_stream;
+	friend struct _stream_state;
+	friend class cl_dataset;
+	friend class cl_tape;
+	friend class cl_graph;
+	friend struct sgd;
+	friend struct rmsprop;
+	friend struct adam;
+	friend struct philox;
 protected:
 	_opencl_context* context;
 	cl_mem mem;
 	int n, m;
+	// a view starts off floats into mem, columns are ld apart
+	int off, ld;
+	bool view;
 	cl_mat(_opencl_context* context, cl_mem mem, int n, int m);
+	cl_mat(_opencl_context* context, cl_mem mem, int n, int m, int off, int ld);
 	void check(const cl_mat& b) const;
 	void destroy();
+	cl_int4 desc(bool t = false) const;
+	void assign(const cl_mat& b);
+	cl_mat broadcast(const char* fn, const cl_bvec& b) const;
+	void broadcast_c(const char* fn, const cl_bvec& b);
+	cl_vec reduce(const char* fn, bool rows) const;
 public:
 	cl_mat(const cl_mat& b);
 	cl_mat(cl_mat&& b);
@@ -36,13 +75,80 @@ public:
 	cl_mat& operator= (cl_mat&& b);
 	~cl_mat();
 
+	int rows() const;
+	int cols() const;
 	la::mat get() const;
 	void set(const la::mat& a);
+	// n*m floats in device order (column-major), without reordering
+	void read(float* dst) const;
+	void write(const float* src);
+	void run_function(const char* fn);
+
+	// Views share memory with *this and keep it alive, no data is copied.
+	// Assigning to a view writes through, copying one makes a new matrix.
+	cl_mat block(int i, int j, int h, int w) const;
+	cl_mat cols(int j, int w) const;
+	cl_vec col(int j) const;
+	cl_vec row(int i) const;
 
 	cl_mat T() const;
 	cl_vec dot(const cl_vec& v) const;
 	cl_mat dot(const cl_mat& v) const;
 
+	// f(A x + b) in one kernel, z gets A x + b if given (for backprop);
+	// for a batch b is added to every column of A X
+	cl_vec dense(const cl_vec& x, const cl_vec& b, act f, cl_vec* z = NULL) const;
+	cl_mat dense(const cl_mat& x, const cl_vec& b, act f, cl_mat* z = NULL) const;
+
+	// BLAS-style, in place; ta and tb select A^T and B^T without a copy
+	// C = alpha * op(A) op(B) + beta * C
+	cl_mat& gemm(float alpha, const cl_mat& a, bool ta,
+		const cl_mat& b, bool tb, float beta);
+	cl_mat& gemm(float alpha, const cl_hmat& a, bool ta,
+		const cl_mat& b, bool tb, float beta);
+	cl_mat& gemm(float alpha, cl_stream& a, bool ta,
+		const cl_mat& b, bool tb, float beta);
+	// Batched, for many small matrices in one buffer: *this, a and b
+	// each hold count matrices side by side, matrix k being cols(k*w, w)
+	// for the width w of its own, and C_k = alpha op(A_k) op(B_k) +
+	// beta C_k for every k in one launch. Up to 64 x 64 a work group
+	// keeps its product in local memory.
+	cl_mat& gemm_batched(int count, float alpha, const cl_mat& a, bool ta,
+		const cl_mat& b, bool tb, float beta);
+	// A += alpha * x y^T
+	cl_mat& ger(float alpha, const cl_vec& x, const cl_vec& y);
+	// A += alpha * X
+	cl_mat& axpy(float alpha, const cl_mat& x);
+
+	// Least squares, x = argmin |A x - b| by conjugate gradients on the
+	// normal equations (CGLS), A^T A is never formed; x holds the start.
+	// Step sizes stay on the device, the host reads |A^T r| only every
+	// check iterations and stops once it is tol times the first one;
+	// check has to be positive, iters not negative. Returns the number
+	// of iterations.
+	int cgls(cl_vec& x, const cl_vec& b, int iters, float tol = 1e-4f,
+		int check = 16) const;
+	// L with A = L L^T for a symmetric positive definite A, blocked by
+	// LOCAL_SIZE columns; the part of A above the diagonal is ignored
+	cl_mat cholesky() const;
+	// x with L L^T x = b, called on the factor L
+	cl_vec cho_solve(const cl_vec& b) const;
+	// broadcasts, A += alpha * b 1^T (b added to every column, n elements)
+	// and A += alpha * 1 b^T (b added to every row, m elements)
+	cl_mat& add_col(float alpha, const cl_vec& b);
+	cl_mat& add_row(float alpha, const cl_vec& b);
+
+	// reductions of every row (n elements) or every column (m elements);
+	// argmax gives the index as a float, the first one on ties
+	cl_vec row_sums() const;
+	cl_vec col_sums() const;
+	cl_vec row_means() const;
+	cl_vec col_means() const;
+	cl_vec row_max() const;
+	cl_vec col_max() const;
+	cl_vec row_argmax() const;
+	cl_vec col_argmax() const;
+
 	cl_mat operator+ (const cl_mat& b) const;
 	cl_mat operator- (const cl_mat& b) const;
 	cl_mat operator* (const cl_mat& b) const;
@@ -60,19 +166,49 @@ public:
 	cl_mat& operator-= (const cl_val& b);
 	cl_mat& operator*= (const cl_val& b);
 	cl_mat& operator/= (const cl_val& b);
+
+	cl_mat operator+ (const cl_bvec& b) const;
+	cl_mat operator- (const cl_bvec& b) const;
+	cl_mat operator* (const cl_bvec& b) const;
+	cl_mat operator/ (const cl_bvec& b) const;
+	cl_mat& operator+= (const cl_bvec& b);
+	cl_mat& operator-= (const cl_bvec& b);
+	cl_mat& operator*= (const cl_bvec& b);
+	cl_mat& operator/= (const cl_bvec& b);
+
+	// softmax family, applied to every column separately
+	cl_mat softmax() const;
+	cl_mat log_softmax() const;
+	cl_mat softmax_d(const cl_mat& g) const;
+	cl_val softmax_xent(const cl_mat& y, cl_mat& s, cl_mat& g) const;
+	cl_mat softmax_xent_d(const cl_mat& y) const;
 };
 
 class cl_vec {
 	friend class _opencl_context;
 	friend class cl_val;
 	friend class cl_mat;
+	friend class cl_hmat;
+	friend class cl_qmat;
+	friend class cl_dataset;
+	friend class cl_tape;
+	friend struct sgd;
+	friend struct rmsprop;
+	friend struct adam;
+	friend struct philox;
 protected:
 	_opencl_context* context;
 	cl_mem mem;
 	int n;
+	// a view starts off floats into mem, elements are inc apart
+	int off, inc;
+	bool view;
 	cl_vec(_opencl_context* context, cl_mem mem, int n);
+	cl_vec(_opencl_context* context, cl_mem mem, int n, int off, int inc);
 	void check(const cl_vec& b) const;
 	void destroy();
+	cl_int4 desc() const;
+	void assign(const cl_vec& b);
 public:
 	cl_vec(const cl_vec& b);
 	cl_vec(cl_vec&& b);
@@ -80,14 +216,32 @@ public:
 	cl_vec& operator= (cl_vec&& b);
 	~cl_vec();
 
+	int size() const;
 	la::vec get() const;
 	void set(const la::vec& v);
+	void read(float* dst) const;
+	void write(const float* src);
 	void run_function(const char* fn);
 
+	// elements i .. i+k-1 as a view, see cl_mat::block
+	cl_vec slice(int i, int k) const;
+
 	cl_val sum() const;
 	cl_val dot(const cl_vec& b) const;
 	cl_mat outer(const cl_vec& b) const;
 
+	// BLAS-style, in place; y = alpha * op(A) x + beta * y
+	cl_vec& gemv(float alpha, const cl_mat& a, bool ta, const cl_vec& x, float beta);
+	cl_vec& gemv(float alpha, const cl_hmat& a, bool ta, const cl_vec& x, float beta);
+	cl_vec& gemv(float alpha, cl_stream& a, bool ta, const cl_vec& x, float beta);
+	// Batched: a holds count matrices side by side as for
+	// cl_mat::gemm_batched, x and *this count vectors one after another;
+	// y_k = alpha op(A_k) x_k + beta y_k for every k in one launch
+	cl_vec& gemv_batched(int count, float alpha, const cl_mat& a, bool ta,
+		const cl_vec& x, float beta);
+	// y += alpha * x
+	cl_vec& axpy(float alpha, const cl_vec& x);
+
 	cl_vec operator+ (const cl_vec& b) const;
 	cl_vec operator- (const cl_vec& b) const;
 	cl_vec operator* (const cl_vec& b) const;
@@ -105,70 +259,595 @@ public:
 	cl_vec& operator-= (const cl_val& b);
 	cl_vec& operator*= (const cl_val& b);
 	cl_vec& operator/= (const cl_val& b);
+
+	// softmax family; softmax_d and softmax_xent_d are called on the
+	// softmax output, softmax_xent also writes it to s and returns the
+	// cross entropy against y, with its gradient w.r.t. *this in g
+	cl_vec softmax() const;
+	cl_vec log_softmax() const;
+	cl_vec softmax_d(const cl_vec& g) const;
+	cl_val softmax_xent(const cl_vec& y, cl_vec& s, cl_vec& g) const;
+	cl_vec softmax_xent_d(const cl_vec& y) const;
 };
 
+// A vector broadcast over a matrix, by_col(b) is applied to every column
+// (b has n elements) and by_row(b) to every row (m elements), as in
+// a * by_row(w) or a -= by_col(a.row_max()). It only lives for the
+// expression it is written in.
+struct cl_bvec {
+	const cl_vec& v;
+	bool row;
+};
+
+cl_bvec by_col(const cl_vec& b);
+cl_bvec by_row(const cl_vec& b);
+
 class cl_val {
 	friend class _opencl_context;
 	friend class cl_vec;
 	friend class cl_mat;
+	friend class cl_hmat;
 protected:
 	_opencl_context* context;
+	cl_mem mem;
 	float val;
 	cl_val(_opencl_context* context, float val);
+	cl_val(_opencl_context* context, cl_mem mem);
+	void destroy();
 public:
+	cl_val(const cl_val& b);
+	cl_val(cl_val&& b);
+	cl_val& operator= (const cl_val& b);
+	cl_val& operator= (cl_val&& b);
+	~cl_val();
+
+	// reads the value back to the host if it lives on the device
 	float get() const;
 };
 
+// A matrix stored in halves, column-major like cl_mat, for weights and
+// activations that only need fp16 range and precision but are read a
+// lot. Kernels load halves and compute and accumulate in fp32; set() and
+// get() convert on the host, pack() and full() on the device.
+class cl_hmat {
+	friend class _opencl_context;
+	friend class cl_mat;
+	friend class cl_vec;
+	friend struct sgd;
+protected:
+	_opencl_context* context;
+	cl_mem mem;
+	int n, m;
+	cl_hmat(_opencl_context* context, cl_mem mem, int n, int m);
+	void destroy();
+	cl_int4 desc(bool t = false) const;
+public:
+	cl_hmat(const cl_hmat& b);
+	cl_hmat(cl_hmat&& b);
+	cl_hmat& operator= (const cl_hmat& b);
+	cl_hmat& operator= (cl_hmat&& b);
+	~cl_hmat();
+
+	int rows() const;
+	int cols() const;
+	la::mat get() const;
+	void set(const la::mat& a);
+
+	// *this = a rounded to halves, and back
+	cl_hmat& pack(const cl_mat& a);
+	cl_mat full() const;
+
+	cl_val sum() const;
+	// f(A X + b) with A in halves, as cl_mat::dense
+	cl_mat dense(const cl_mat& x, const cl_vec& b, act f, cl_mat* z = NULL) const;
+};
+
+// A labelled dataset uploaded to the device once. Samples have d
+// features, stored as floats or as bytes (scaled when gathered), and
+// labels in [0, k). shuffle() draws a new order on the device and batch()
+// gathers samples i, i+1, ... of that order into the columns of x, with
+// one-hot labels in t, so training never writes to the device.
+// count() scores a batch against its labels into a k x k confusion
+// matrix kept on the device, only counts() reads it back.
+class cl_dataset {
+	friend class _opencl_context;
+	friend class cl_qmat;
+protected:
+	_opencl_context* context;
+	cl_mem data, labels, perm, conf;
+	int n, d, k;
+	bool bytes;
+	float scale;
+	cl_dataset(_opencl_context* context, int n, int d, int k, bool bytes, float scale);
+	void destroy();
+	void gather(int i, cl_mem x, cl_int4 dx, cl_mem t, cl_int4 dt, int l) const;
+public:
+	cl_dataset(const cl_dataset&) = delete;
+	cl_dataset(cl_dataset&& b);
+	cl_dataset& operator= (const cl_dataset&) = delete;
+	cl_dataset& operator= (cl_dataset&& b);
+	~cl_dataset();
+
+	int size() const;
+	void shuffle();
+	void batch(int i, cl_mat& x, cl_mat& t) const;
+	void batch(int i, cl_vec& x, cl_vec& t) const;
+
+	// a holds the scores of samples i, i+1, ... in its columns; the
+	// counts are indexed [predicted class][label]
+	void clear_counts();
+	void count(int i, const cl_mat& a);
+	std::vector<int> counts() const;
+};
+
+// Weights quantized to int8 for inference, w_ik ~ s_i q_ik with the
+// scale s_i = max |w_ik| / 127 calibrated per row by ct.quantize().
+// dense() reads byte samples straight from a dataset and accumulates
+// their products with q in int32, only the result is scaled.
+class cl_qmat {
+	friend class _opencl_context;
+protected:
+	_opencl_context* context;
+	cl_mem q, s;
+	int n, m;
+	cl_qmat(_opencl_context* context, int n, int m);
+	void destroy();
+public:
+	cl_qmat(const cl_qmat&) = delete;
+	cl_qmat(cl_qmat&& b);
+	cl_qmat& operator= (const cl_qmat&) = delete;
+	cl_qmat& operator= (cl_qmat&& b);
+	~cl_qmat();
+
+	int rows() const;
+	int cols() const;
+	// f(A x + b) for samples i, i+1, ... of the dataset order, one per
+	// column of y
+	void dense(const cl_dataset& data, int i, const cl_vec& b, act f, cl_mat& y) const;
+};
+
+// A host matrix larger than the device, n x m by rows, that is streamed
+// through two device blocks of h rows. A thread of its own uploads block
+// k+1 on its own queue while the kernels of block k run; the events of
+// the shared queues order the two. Each block is handed over transposed,
+// m x h, so column j is row i + j of the host matrix.
+class cl_stream {
+	friend class _opencl_context;
+protected:
+	_opencl_context* context;
+	int n, m, h;
+	// shared with the upload thread, it stays put when *this moves
+	_stream_state* st;
+	cl_stream(_opencl_context* context, float* data, la::mat* a, int n,
+		int m, long long tile_bytes);
+	void destroy();
+public:
+	cl_stream(const cl_stream&) = delete;
+	cl_stream(cl_stream&& b);
+	cl_stream& operator= (const cl_stream&) = delete;
+	cl_stream& operator= (cl_stream&& b);
+	~cl_stream();
+
+	int rows() const;
+	int cols() const;
+	// rows per block
+	int tile() const;
+	// f(x, i) for every block in order, x holds rows i .. i + x.cols() - 1
+	// transposed. With write the blocks go back to the host afterwards,
+	// so a chain of in-place ops on x updates the matrix
+	void each(const std::function<void(cl_mat& x, int i)>& f,
+		bool write = false);
+};
+
+// A private arena for a step that runs many times. Between begin() and
+// end() the buffers this thread allocates come from the arena and the
+// ones it frees go back to it, the shared pool is not touched. Views
+// keep their count under the context lock, so making one locks, and so
+// does a free while any buffer of the context has views. The first two steps record what a step needs, taking
+// buffers from the pool (a value kept across steps is replaced while
+// the old one is alive, the second step sees that). After that the
+// arena is fixed and an allocation it cannot serve is a miss, served
+// from the pool and counted, and end() throws on it if the workspace
+// is strict.
+class cl_workspace {
+	friend class _opencl_context;
+protected:
+	_opencl_context* context;
+	std::map<int, std::vector<cl_mem>> arena;
+	int steps, taken, missed, reported;
+	bool strict, active;
+	cl_workspace(_opencl_context* context, bool strict);
+	cl_mem take(int len);
+	void destroy();
+public:
+	cl_workspace(const cl_workspace&) = delete;
+	cl_workspace(cl_workspace&& b);
+	cl_workspace& operator= (const cl_workspace&) = delete;
+	cl_workspace& operator= (cl_workspace&& b);
+	~cl_workspace();
+
+	void begin();
+	void end();
+	// buffers taken from the pool, in total and after recording
+	int allocations() const;
+	int misses() const;
+};
+
+// A recorded step. Between begin() and end() the kernels and copies
+// this thread queues run as usual and are recorded, each into a kernel
+// object of its own with its arguments set, so replay() queues the step
+// again with no host work but the launches. Scalars are recorded by
+// value and buffers by handle; the graph keeps every buffer it uses
+// alive. Buffers of the inputs marked with input() before recording can
+// be rebound with bind(), to a matrix of the same shape and layout.
+// Host transfers cannot be recorded, nor philox draws that move the
+// counter, a replay would repeat the recorded numbers.
+class cl_graph {
+	friend class _opencl_context;
+	friend class cl_stream;
+protected:
+	struct command {
+		// a copy of n bytes from mems[0] to mems[1] if kernel is NULL
+		cl_kernel kernel;
+		int dc, n;
+		size_t gws[2], lws[2];
+		std::vector<cl_mem> mems;
+		std::vector<char> writes;
+	};
+	// argument a of command c is the buffer of input i
+	struct binding {
+		int c, a, i;
+	};
+	struct input_desc {
+		cl_mem mem;
+		int n, m, off, ld;
+	};
+	_opencl_context* context;
+	std::vector<command> commands;
+	std::vector<binding> bindings;
+	std::vector<input_desc> inputs;
+	std::vector<cl_mem> held;
+	bool active;
+	cl_graph(_opencl_context* context);
+	void hold(cl_mem mem);
+	cl_kernel kernel(const std::string& name);
+	void record(const std::vector<cl_mem>& mems, const std::vector<char>& writes,
+		cl_kernel k, int dc, const size_t* gws, const size_t* lws, int n);
+	void clear();
+	void destroy();
+public:
+	cl_graph(const cl_graph&) = delete;
+	cl_graph(cl_graph&& b);
+	cl_graph& operator= (const cl_graph&) = delete;
+	cl_graph& operator= (cl_graph&& b);
+	~cl_graph();
+
+	// returns the index for bind()
+	int input(const cl_mat& x);
+	void bind(int i, const cl_mat& x);
+
+	// begin() drops an earlier recording
+	void begin();
+	void end();
+	void replay();
+	bool empty() const;
+	int size() const;
+};
+
+// A kernel object belongs to one queue, so setting its arguments never
+// races another thread. writes marks the arguments that are non-const
+// global buffers, mems holds the buffers of the launch being set up.
+struct _opencl_kernel {
+	cl_kernel kernel;
+	// set while a graph records the launch being set up
+	cl_kernel capture;
+	std::vector<char> writes;
+	std::vector<cl_mem> mems;
+};
+
+// Every host thread gets its own in-order queue and kernel objects; they
+// go back to a pool of the context when the thread exits.
+struct _opencl_queue {
+	cl_command_queue queue;
+	std::map<std::string, _opencl_kernel> kernel_cache;
+};
+
+// The last write to a buffer and the last read from each queue since
+// then, only tracked once more than one queue exists.
+struct _opencl_use {
+	cl_command_queue queue;
+	cl_event write;
+	std::vector<std::pair<cl_command_queue, cl_event>> reads;
+};
+
 class _opencl_context {
 	friend class cl_mat;
 	friend class cl_vec;
 	friend class cl_val;
+	friend class cl_hmat;
+	friend class cl_qmat;
+	friend class cl_stream;
+	friend struct _stream_state;
+	friend class cl_dataset;
+	friend class cl_tape;
+	friend class cl_workspace;
+	friend class cl_graph;
+	friend struct sgd;
+	friend struct rmsprop;
+	friend struct adam;
+	friend struct philox;
+	friend struct _queue_owner;
 	friend _opencl_context opencl_context();
 protected:
+	int id;
 	cl_platform_id platform;
 	cl_device_id device;
 	cl_context context;
-	cl_command_queue queue;
 	cl_program program;
+
+	// guards everything below
+	std::mutex lock;
+	// set while more than one queue is in use
+	bool shared;
+	// all queues, and the ones no thread holds
+	std::vector<_opencl_queue*> queues, idle;
+	int active;
 	std::map<int, std::vector<cl_mem>> available_buffers;
-	std::map<std::string, cl_kernel> kernel_cache;
+	std::map<cl_mem, _opencl_use> uses;
+	// handles and size of the buffers that have views
+	std::map<cl_mem, std::pair<int, int>> views;
+	// views.size(), read without the lock by recycle()
+	std::atomic<int> nviews;
 
 	cl_platform_id get_platform();
 	cl_device_id get_device(cl_platform_id platform);
 	cl_context get_context(cl_platform_id platform);
 	cl_command_queue get_command_queue(cl_context context, cl_device_id device);
 	cl_program get_program(cl_device_id device, cl_context context);
-	cl_kernel get_kernel(std::string name);
+	_opencl_queue& get_queue();
+	void release_queue(_opencl_queue* q);
+	_opencl_kernel& get_kernel(_opencl_queue& q, const std::string& name);
 	_opencl_context();
 	cl_mem new_buffer(int len);
+	cl_mem pool_buffer(int len);
+	void retain(cl_mem mem);
 	void recycle(int n, cl_mem mem);
 	void mem_read(cl_mem src, void* dest, int n);
 	void mem_write(const void* src, cl_mem dest, int n);
+	// h runs of w floats, pitch floats apart, starting at off
+	void mem_read(cl_mem src, int off, int pitch, float* dest, int w, int h);
+	void mem_write(const float* src, cl_mem dest, int off, int pitch, int w, int h);
 	void mem_copy(cl_mem src, cl_mem dest, int n);
+	// throws while this thread records a graph on the context, a philox
+	// draw moves its counter on the host and a replay would repeat it
+	void check_draw();
+
+	template<class F>
+	cl_event enqueue(_opencl_queue& q, int cnt, const cl_mem* mems,
+		const char* writes, F cmd);
+
+	static cl_mem buffer_of(cl_mem m) { return m; }
+
+	template<class T>
+	static cl_mem buffer_of(const T&) { return NULL; }
 
 	template<class T, class... U>
-	void run_kernel_impl(std::string name, std::vector<int> dims,
-		int cnt, T arg, U... args);
+	void run_kernel_impl(_opencl_queue& q, _opencl_kernel& k,
+		const std::vector<int>& dims, int cnt, T arg, U... args);
 
-	void run_kernel_impl(std::string name, std::vector<int> dims, int cnt);
+	void run_kernel_impl(_opencl_queue& q, _opencl_kernel& k,
+		const std::vector<int>& dims, int cnt);
 	
 	template<class... T>
 	void run_kernel(std::string name, std::vector<int> dims, T... args);
 
-	// TODO: destructor, delete copy constructor, etc.
 public:
+	_opencl_context(_opencl_context&& b);
+	~_opencl_context();
+	_opencl_context(const _opencl_context&) = delete;
+	_opencl_context& operator= (const _opencl_context&) = delete;
+
 	cl_mat mat(int n, int m);
 	cl_vec vec(int n);
 	cl_val val(float f);
+	cl_hmat hmat(int n, int m);
+	cl_hmat half(const cl_mat& a);
+	cl_qmat quantize(const cl_mat& w);
+	// out of core, the host memory stays the caller's and is not copied
+	cl_stream stream(la::mat& a, long long tile_bytes = 64 << 20);
+	cl_stream stream(float* a, int n, int m, long long tile_bytes = 64 << 20);
+	// straight from the mapping, read ahead one block at a time
+	cl_stream stream(la::mmat& a, long long tile_bytes = 64 << 20);
+	// x holds n samples of d features one after another, y their labels
+	cl_dataset dataset(int n, int d, int k, const float* x, const int* y);
+	cl_dataset dataset(int n, int d, int k, const unsigned char* x, const int* y,
+		float scale);
+	cl_workspace workspace(bool strict = false);
+	cl_graph graph();
+
+	// waits for the work queued by every thread
+	void finish();
 };
 
 _opencl_context opencl_context();
 
+// Fused optimizer steps, each is a single pass over the parameter p and
+// its state. The gradient is a buffer g, or the factors of g = u w^T so
+// a rank-1 update never materializes the outer product. decay is the
+// decoupled weight decay, p *= 1 - decay after the step.
+
+struct sgd {
+	float rate, momentum, decay;
+
+	void step(cl_vec& p, cl_vec& v, const cl_vec& g) const;
+	void step(cl_mat& p, cl_mat& v, const cl_mat& g) const;
+	void step(cl_mat& p, cl_mat& v, const cl_vec& u, const cl_vec& w) const;
+	// p stays the fp32 master copy, h gets its halves in the same pass
+	void step(cl_mat& p, cl_mat& v, const cl_mat& g, cl_hmat& h) const;
+};
+
+struct rmsprop {
+	float rate, rho, eps, decay;
+
+	void step(cl_vec& p, cl_vec& s, const cl_vec& g) const;
+	void step(cl_mat& p, cl_mat& s, const cl_mat& g) const;
+	void step(cl_mat& p, cl_mat& s, const cl_vec& u, const cl_vec& w) const;
+};
+
+// call next() once per training step, before the steps of that iteration
+struct adam {
+	float rate, beta1, beta2, eps, decay;
+	int t;
+
+	void next();
+	void step(cl_vec& p, cl_vec& m, cl_vec& v, const cl_vec& g) const;
+	void step(cl_mat& p, cl_mat& m, cl_mat& v, const cl_mat& g) const;
+	void step(cl_mat& p, cl_mat& m, cl_mat& v, const cl_vec& u, const cl_vec& w) const;
+};
+
+// Device fills from a counter-based stream, the same as la::rng: value k
+// depends only on (seed, k), so a fill can be repeated or skipped over
+// and gives the same numbers on any device. Every fill starts at counter
+// and moves it past itself; element j of a matrix is value counter + j
+// in device order (column-major).
+struct philox {
+	unsigned long long seed, counter;
+
+	void uniform(cl_mat& a, float lo, float hi);
+	void uniform(cl_vec& a, float lo, float hi);
+	void normal(cl_mat& a, float mean, float sd);
+	void normal(cl_vec& a, float mean, float sd);
+	// for y = W x, the fan-in is cols(): Xavier is uniform within
+	// sqrt(6 / (rows + cols)), He normal with sd sqrt(2 / cols)
+	void xavier(cl_mat& w);
+	void he(cl_mat& w);
+	// a *= mask / (1 - p), every element dropped with probability p. The
+	// mask is not stored; the returned position given to the second form
+	// applies the same mask again, to the gradient in backward
+	unsigned long long dropout(cl_mat& a, float p);
+	void dropout(cl_mat& a, float p, unsigned long long at) const;
+
+protected:
+	void fill(const char* fn, _opencl_context* context, cl_mem mem,
+		cl_int4 d, int n, float x, float y);
+};
+
+// Reverse-mode autodiff. The graph is recorded once with the ops below,
+// which return node ids, then forward() runs it and backward() the
+// generated backward pass. Intermediate values and gradients get their
+// buffers from a plan made by the first forward(): every buffer lives
+// from the op that writes it to its last use, and buffers of one size
+// with disjoint lifetimes share memory, so steps allocate nothing.
+//
+// Inputs and parameters are views of the caller's buffers and have to
+// be written in place (set, batch, optimizer steps), not reassigned. A
+// parameter given with a momentum buffer is stepped by backward(opt) as
+// soon as its gradient is complete, rank-1 gradients are never formed;
+// the gradient of any other parameter is kept for grad().
+struct _tape_node {
+	enum { input, param, matmul, add, mul, add_col, tanh, relu, dense,
+		dropout, softmax_xent } op;
+	int a, b, c;
+	bool ta, tb;
+	act f;
+	int n, m;
+	// depends on a param; the gradient of a param is only used as u w^T
+	bool grad, factored;
+	cl_mat *pm, *vm;
+	cl_vec *pv, *vv;
+	// dropout: the stream and where the mask of the last forward() starts
+	float p;
+	philox* rng;
+	unsigned long long at;
+};
+
+class cl_tape {
+protected:
+	_opencl_context* context;
+	std::vector<_tape_node> nodes;
+	bool planned;
+	std::vector<cl_mat> slots;
+	// views of the caller's buffers, then of the planned slots
+	std::vector<cl_mat*> leaves, values, aux, grads;
+	// kept: bit 0 for the value, bit 1 for the gradient
+	std::vector<char> runs, kept, written;
+	std::vector<int> pending;
+	int add_node(_tape_node t);
+	int leaf(int op, cl_mat* v, cl_mat* pm, cl_mat* vm, cl_vec* pv, cl_vec* vv);
+	static cl_mat* column(const cl_vec& v);
+	void plan();
+	void clear();
+	cl_mat& val(int i) const;
+	void acc(int i, const cl_mat& g);
+	void acc(int i, const cl_vec& g);
+	void acc_sums(int i, const cl_mat& g);
+	void acc_gemm(int i, const cl_mat& a, bool ta, const cl_mat& b, bool tb);
+	void done(int i, const sgd* opt, const std::function<void(int)>* ready);
+	void step(int i, const sgd* opt);
+	void backward_impl(const sgd* opt, const std::function<void(int)>* ready);
+public:
+	cl_tape();
+	cl_tape(const cl_tape&) = delete;
+	cl_tape& operator= (const cl_tape&) = delete;
+	~cl_tape();
+
+	int input(const cl_mat& x);
+	int input(const cl_vec& x);
+	int param(cl_mat& p);
+	int param(cl_vec& p);
+	int param(cl_mat& p, cl_mat& v);
+	int param(cl_vec& p, cl_vec& v);
+
+	// vectors are n x 1 matrices here
+	int matmul(int a, int b, bool ta = false, bool tb = false);
+	int add(int a, int b);
+	int mul(int a, int b);
+	// b is n x 1, added to every column of a
+	int add_col(int a, int b);
+	int tanh(int a);
+	int relu(int a);
+	// f(W X + b) in one kernel, as cl_mat::dense
+	int dense(int w, int x, int b, act f);
+	// drops elements of a with probability p, a new mask from rng every
+	// forward(). Only the position of the mask is kept for backward; the
+	// forward() of a tape with dropout cannot be recorded in a cl_graph
+	int dropout(int a, float p, philox& rng);
+	// the softmax of every column of o; backward() starts from the cross
+	// entropy against t summed over the columns, so this is the last op
+	int softmax_xent(int o, int t);
+
+	void forward();
+	void backward();
+	void backward(const sgd& opt);
+	// ready(i) runs for every param i as soon as the last kernel of its
+	// gradient is queued, while the rest of the pass is still being
+	// queued; another thread can then read the gradient, the events of
+	// the shared queues make it wait for the kernel
+	void backward(const std::function<void(int)>& ready);
+
+	// only while the plan keeps them; the last node and the gradients of
+	// params without a momentum buffer are always kept
+	const cl_mat& value(int i) const;
+	const cl_mat& grad(int i) const;
+	// device memory of the plan
+	long long bytes() const;
+};
+
 cl_vec sqrt(const cl_vec& v);
 cl_vec exp(const cl_vec& v);
 cl_vec relu(const cl_vec& v);
 cl_vec relu_d(const cl_vec& v);
 cl_vec tanh(const cl_vec& v);
 cl_vec tanh_d(const cl_vec& v);
+cl_vec softmax(const cl_vec& v);
+cl_vec log_softmax(const cl_vec& v);
+cl_mat sqrt(const cl_mat& a);
+cl_mat exp(const cl_mat& a);
+cl_mat relu(const cl_mat& a);
+cl_mat relu_d(const cl_mat& a);
+cl_mat tanh(const cl_mat& a);
+cl_mat tanh_d(const cl_mat& a);
+cl_mat softmax(const cl_mat& a);
+cl_mat log_softmax(const cl_mat& a);
 
 } // end namespace iopp
\ No newline at end of file
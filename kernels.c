@@ -3,232 +3,565 @@
 #define BLOCK_SIZE 1
 #define LOOP int i = get_global_id(0) * BLOCK_SIZE, j; for (j=i; j<i+BLOCK_SIZE; j++) if (j < n)
 
+// Every buffer operand is followed by its view, an int4 of the offset,
+// the number of rows and the row and column strides. at() walks a view
+// in column-major order, at2() indexes it by row and column.
+
+int at(
+	int4 d,
+	int k
+) {
+	if (d.z == 1 && d.w == d.y)
+		return d.x + k;
+	return d.x + k % d.y * d.z + k / d.y * d.w;
+}
+
+int at2(
+	int4 d,
+	int i,
+	int j
+) {
+	return d.x + i * d.z + j * d.w;
+}
+
 // u + v
 
 kernel void vadd(
-	global float* a,
-	global float* b,
+	global const float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
 	global float* c,
+	int4 dc,
 	int n
 ) {
 	LOOP
-		c[j] = a[j] + b[j];
+		c[at(dc, j)] = a[at(da, j)] + b[at(db, j)];
 }
 
 kernel void vsub(
-	global float* a,
-	global float* b,
+	global const float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
 	global float* c,
+	int4 dc,
 	int n
 ) {
 	LOOP
-		c[j] = a[j] - b[j];
+		c[at(dc, j)] = a[at(da, j)] - b[at(db, j)];
 }
 
 kernel void vmul(
-	global float* a,
-	global float* b,
+	global const float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
 	global float* c,
+	int4 dc,
 	int n
 ) {
 	LOOP
-		c[j] = a[j] * b[j];
+		c[at(dc, j)] = a[at(da, j)] * b[at(db, j)];
 }
 
 kernel void vdiv(
-	global float* a,
-	global float* b,
+	global const float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
 	global float* c,
+	int4 dc,
 	int n
 ) {
 	LOOP
-		c[j] = a[j] / b[j];
+		c[at(dc, j)] = a[at(da, j)] / b[at(db, j)];
 }
 
 // u += v
 
 kernel void vaddc(
 	global float* a,
-	global float* b,
+	int4 da,
+	global const float* b,
+	int4 db,
 	int n
 ) {
 	LOOP
-		a[j] += b[j];
+		a[at(da, j)] += b[at(db, j)];
 }
 
 kernel void vsubc(
 	global float* a,
-	global float* b,
+	int4 da,
+	global const float* b,
+	int4 db,
 	int n
 ) {
 	LOOP
-		a[j] -= b[j];
+		a[at(da, j)] -= b[at(db, j)];
 }
 
 kernel void vmulc(
 	global float* a,
-	global float* b,
+	int4 da,
+	global const float* b,
+	int4 db,
 	int n
 ) {
 	LOOP
-		a[j] *= b[j];
+		a[at(da, j)] *= b[at(db, j)];
 }
 
 kernel void vdivc(
 	global float* a,
-	global float* b,
+	int4 da,
+	global const float* b,
+	int4 db,
 	int n
 ) {
 	LOOP
-		a[j] /= b[j];
+		a[at(da, j)] /= b[at(db, j)];
 }
 
 // u + x
 
 kernel void vsadd(
-	global float* a,
+	global const float* a,
+	int4 da,
 	global float* b,
+	int4 db,
 	float y,
 	int n
 ) {
 	LOOP
-		b[j] = a[j] + y;
+		b[at(db, j)] = a[at(da, j)] + y;
 }
 
 kernel void vssub(
-	global float* a,
+	global const float* a,
+	int4 da,
 	global float* b,
+	int4 db,
 	float y,
 	int n
 ) {
 	LOOP
-		b[j] = a[j] - y;
+		b[at(db, j)] = a[at(da, j)] - y;
 }
 
 kernel void vsmul(
-	global float* a,
+	global const float* a,
+	int4 da,
 	global float* b,
+	int4 db,
 	float y,
 	int n
 ) {
 	LOOP
-		b[j] = a[j] * y;
+		b[at(db, j)] = a[at(da, j)] * y;
 }
 
 kernel void vsdiv(
-	global float* a,
+	global const float* a,
+	int4 da,
 	global float* b,
+	int4 db,
 	float y,
 	int n
 ) {
 	LOOP
-		b[j] = a[j] / y;
+		b[at(db, j)] = a[at(da, j)] / y;
 }
 
 // u += x
 
 kernel void vsaddc(
 	global float* a,
+	int4 da,
 	float y,
 	int n
 ) {
 	LOOP
-		a[j] += y;
+		a[at(da, j)] += y;
 }
 
 kernel void vssubc(
 	global float* a,
+	int4 da,
 	float y,
 	int n
 ) {
 	LOOP
-		a[j] -= y;
+		a[at(da, j)] -= y;
 }
 
 kernel void vsmulc(
 	global float* a,
+	int4 da,
 	float y,
 	int n
 ) {
 	LOOP
-		a[j] *= y;
+		a[at(da, j)] *= y;
 }
 
 kernel void vsdivc(
 	global float* a,
+	int4 da,
 	float y,
 	int n
 ) {
 	LOOP
-		a[j] /= y;
+		a[at(da, j)] /= y;
+}
+
+// u + x, x in device memory
+
+kernel void vgadd(
+	global const float* a,
+	int4 da,
+	global float* b,
+	int4 db,
+	global const float* y,
+	int n
+) {
+	float x = y[0];
+	LOOP
+		b[at(db, j)] = a[at(da, j)] + x;
+}
+
+kernel void vgsub(
+	global const float* a,
+	int4 da,
+	global float* b,
+	int4 db,
+	global const float* y,
+	int n
+) {
+	float x = y[0];
+	LOOP
+		b[at(db, j)] = a[at(da, j)] - x;
+}
+
+kernel void vgmul(
+	global const float* a,
+	int4 da,
+	global float* b,
+	int4 db,
+	global const float* y,
+	int n
+) {
+	float x = y[0];
+	LOOP
+		b[at(db, j)] = a[at(da, j)] * x;
+}
+
+kernel void vgdiv(
+	global const float* a,
+	int4 da,
+	global float* b,
+	int4 db,
+	global const float* y,
+	int n
+) {
+	float x = y[0];
+	LOOP
+		b[at(db, j)] = a[at(da, j)] / x;
+}
+
+// u += x, x in device memory
+
+kernel void vgaddc(
+	global float* a,
+	int4 da,
+	global const float* y,
+	int n
+) {
+	float x = y[0];
+	LOOP
+		a[at(da, j)] += x;
+}
+
+kernel void vgsubc(
+	global float* a,
+	int4 da,
+	global const float* y,
+	int n
+) {
+	float x = y[0];
+	LOOP
+		a[at(da, j)] -= x;
+}
+
+kernel void vgmulc(
+	global float* a,
+	int4 da,
+	global const float* y,
+	int n
+) {
+	float x = y[0];
+	LOOP
+		a[at(da, j)] *= x;
+}
+
+kernel void vgdivc(
+	global float* a,
+	int4 da,
+	global const float* y,
+	int n
+) {
+	float x = y[0];
+	LOOP
+		a[at(da, j)] /= x;
 }
 
 // matrix ops
 
 kernel void mt(
-	global float* a,
+	global const float* a,
+	int4 da,
 	global float* b,
+	int4 db,
 	int n,
 	int m
 ) {
 	int i = get_global_id(0);
 	int j = get_global_id(1);
 	if (i < n && j < m) {
-		b[j + i * m] = a[i + j * n];
+		b[at2(db, j, i)] = a[at2(da, i, j)];
 	}
 }
 
-kernel void mvdot(
-	global float* a,
-	global float* b,
-	global float* c,
+// activations for the fused kernels: 0 identity, 1 tanh, 2 relu
+float activate(
+	float x,
+	int f
+) {
+	if (f == 1)
+		return tanh(x);
+	if (f == 2 && x < 0.0f)
+		return 0.0f;
+	return x;
+}
+
+// y = f(a x + b), z = a x + b unless z is null
+kernel void mvdense(
+	global const float* a,
+	int4 da,
+	global const float* x,
+	int4 dx,
+	global const float* b,
+	int4 db,
+	global float* y,
+	int4 dy,
+	global float* z,
+	int4 dz,
 	int n,
-	int m
+	int m,
+	int f
 ) {
 	int i = get_global_id(0), j;
-	float z = 0.0f;
-	for (j = 0; j < m; j++) {
-		z += a[i + j*n] * b[j];
+	if (i < n) {
+		float s = b[at(db, i)];
+		for (j = 0; j < m; j++) {
+			s += a[at2(da, i, j)] * x[at(dx, j)];
+		}
+		if (z)
+			z[at(dz, i)] = s;
+		y[at(dy, i)] = activate(s, f);
 	}
-	c[i] = z;
 }
 
-kernel void mmdot(
-	global float* a,
-	global float* b,
-	global float* c,
+// y = f(a x + b), b is added to every column
+kernel void mmdense(
+	global const float* a,
+	int4 da,
+	global const float* x,
+	int4 dx,
+	global const float* b,
+	int4 db,
+	global float* y,
+	int4 dy,
+	global float* z,
+	int4 dz,
 	int n,
 	int m,
-	int l
+	int l,
+	int f
 ) {
 	int i = get_global_id(0);
 	int j = get_global_id(1);
 	int k;
-	if (i < n && j < m) {
-		float z = 0.0f;
-		for (k=0; k<m; k++) {
-			z += a[i + k*n] * b[k + j*m];
+	if (i < n && j < l) {
+		float s = b[at(db, i)];
+		for (k = 0; k < m; k++) {
+			s += a[at2(da, i, k)] * x[at2(dx, k, j)];
 		}
-		c[i + j*n] = z;
+		if (z)
+			z[at2(dz, i, j)] = s;
+		y[at2(dy, i, j)] = activate(s, f);
 	}
 }
 
-kernel void vvouter(
+// broadcasts, c = a op b 1^T; a row broadcast runs on the transposed views
+
+kernel void mbadd(
+	global const float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
+	global float* c,
+	int4 dc,
+	int n,
+	int m
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i < n && j < m)
+		c[at2(dc, i, j)] = a[at2(da, i, j)] + b[at(db, i)];
+}
+
+kernel void mbsub(
+	global const float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
+	global float* c,
+	int4 dc,
+	int n,
+	int m
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i < n && j < m)
+		c[at2(dc, i, j)] = a[at2(da, i, j)] - b[at(db, i)];
+}
+
+kernel void mbmul(
+	global const float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
+	global float* c,
+	int4 dc,
+	int n,
+	int m
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i < n && j < m)
+		c[at2(dc, i, j)] = a[at2(da, i, j)] * b[at(db, i)];
+}
+
+kernel void mbdiv(
+	global const float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
+	global float* c,
+	int4 dc,
+	int n,
+	int m
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i < n && j < m)
+		c[at2(dc, i, j)] = a[at2(da, i, j)] / b[at(db, i)];
+}
+
+kernel void mbaddc(
 	global float* a,
-	global float* b,
+	int4 da,
+	global const float* b,
+	int4 db,
+	int n,
+	int m
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i < n && j < m)
+		a[at2(da, i, j)] += b[at(db, i)];
+}
+
+kernel void mbsubc(
+	global float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
+	int n,
+	int m
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i < n && j < m)
+		a[at2(da, i, j)] -= b[at(db, i)];
+}
+
+kernel void mbmulc(
+	global float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
+	int n,
+	int m
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i < n && j < m)
+		a[at2(da, i, j)] *= b[at(db, i)];
+}
+
+kernel void mbdivc(
+	global float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
+	int n,
+	int m
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i < n && j < m)
+		a[at2(da, i, j)] /= b[at(db, i)];
+}
+
+// a += alpha * b 1^T
+kernel void mvadd(
+	global float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
+	int n,
+	int m,
+	float alpha
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i < n && j < m)
+		a[at2(da, i, j)] += alpha * b[at(db, i)];
+}
+
+kernel void vvouter(
+	global const float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
 	global float* c,
+	int4 dc,
 	int n,
 	int m
 ) {
 	int i = get_global_id(0);
 	int j = get_global_id(1);
 	if (i < n && j < m) {
-		c[i + n*j] = a[i] * b[j];
+		c[at2(dc, i, j)] = a[at(da, i)] * b[at(db, j)];
 	}
 }
 
 kernel void rdsum_1(
-	global float* a,
+	global const float* a,
+	int4 da,
 	global float* b,
 	int n,
 	int m
@@ -236,13 +569,32 @@ kernel void rdsum_1(
 	int i = get_global_id(0), j;
 	float z = 0.0f;
 	for (j=i; j<n; j+=m) {
-		z += a[j];
+		z += a[at(da, j)];
 	}
 	b[i] = z;
 }
 
+// rdsum_1 of the products a[j] * b[j]
+kernel void rddot_1(
+	global const float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
+	global float* c,
+	int n,
+	int m
+) {
+	int i = get_global_id(0), j;
+	float z = 0.0f;
+	for (j=i; j<n; j+=m) {
+		z += a[at(da, j)] * b[at(db, j)];
+	}
+	c[i] = z;
+}
+
 kernel void rdsum_2(
-	global float* a,
+	global const float* a,
+	global float* b,
 	int n
 ) {
 	int i;
@@ -250,62 +602,1480 @@ kernel void rdsum_2(
 	for (i=0; i<n; i++) {
 		z += a[i];
 	}
-	a[0] = z;
+	b[0] = z;
 }
 
 // vector functions
 
 kernel void vsqrtc(
 	global float* a,
+	int4 da,
 	int n
 ) {
 	LOOP
-		a[j] = sqrt(a[j]);
+		a[at(da, j)] = sqrt(a[at(da, j)]);
 }
 
 kernel void vexpc(
 	global float* a,
+	int4 da,
 	int n
 ) {
 	LOOP
-		a[j] = exp(a[j]);
+		a[at(da, j)] = exp(a[at(da, j)]);
 }
 
 kernel void vreluc(
 	global float* a,
+	int4 da,
 	int n
 ) {
 	LOOP
-		if (a[j] < 0.0f)
-			a[j] = 0.0f;
+		if (a[at(da, j)] < 0.0f)
+			a[at(da, j)] = 0.0f;
 }
 
 kernel void vrelu_dc(
 	global float* a,
+	int4 da,
 	int n
 ) {
 	LOOP
-		if (a[j] < 0.0f)
-			a[j] = 0.0f;
+		if (a[at(da, j)] < 0.0f)
+			a[at(da, j)] = 0.0f;
 		else
-			a[j] = 1.0f;
+			a[at(da, j)] = 1.0f;
 }
 
 kernel void vtanhc(
 	global float* a,
+	int4 da,
 	int n
 ) {
 	LOOP
-		a[j] = tanh(a[j]);
+		a[at(da, j)] = tanh(a[at(da, j)]);
 }
 
 kernel void vtanh_dc(
 	global float* a,
+	int4 da,
 	int n
 ) {
 	LOOP
 		{
-			float t = 1.0f / cosh(a[j]);
-			a[j] = t * t;
+			float t = 1.0f / cosh(a[at(da, j)]);
+			a[at(da, j)] = t * t;
+		}
+}
+
+// work group reductions, every work item gets the result
+
+float group_sum(
+	local float* t,
+	float x
+) {
+	int i = get_local_id(0), k;
+	t[i] = x;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (k = LOCAL_SIZE / 2; k > 0; k >>= 1) {
+		if (i < k)
+			t[i] += t[i + k];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	x = t[0];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return x;
+}
+
+float group_max(
+	local float* t,
+	float x
+) {
+	int i = get_local_id(0), k;
+	t[i] = x;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (k = LOCAL_SIZE / 2; k > 0; k >>= 1) {
+		if (i < k)
+			t[i] = fmax(t[i], t[i + k]);
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	x = t[0];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return x;
+}
+
+// the index k of the largest x, the smallest index on ties
+int group_argmax(
+	local float* t,
+	local int* u,
+	float x,
+	int k
+) {
+	int i = get_local_id(0), s;
+	t[i] = x;
+	u[i] = k;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (s = LOCAL_SIZE / 2; s > 0; s >>= 1) {
+		if (i < s && (t[i + s] > t[i] || (t[i + s] == t[i] && u[i + s] < u[i]))) {
+			t[i] = t[i + s];
+			u[i] = u[i + s];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	k = u[0];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return k;
+}
+
+
+// reductions of column c of a into b[c], one work group per column;
+// a row reduction runs on the transposed view
+
+kernel void msum(
+	global const float* a,
+	int4 da,
+	global float* b,
+	int4 db,
+	int n
+) {
+	local float t[LOCAL_SIZE];
+	int i = get_local_id(0), j;
+	int c = get_group_id(0);
+	float s = 0.0f;
+	for (j = i; j < n; j += LOCAL_SIZE)
+		s += a[at2(da, j, c)];
+	s = group_sum(t, s);
+	if (i == 0)
+		b[at(db, c)] = s;
+}
+
+// as msum, adding to b
+kernel void msum_acc(
+	global const float* a,
+	int4 da,
+	global float* b,
+	int4 db,
+	int n
+) {
+	local float t[LOCAL_SIZE];
+	int i = get_local_id(0), j;
+	int c = get_group_id(0);
+	float s = 0.0f;
+	for (j = i; j < n; j += LOCAL_SIZE)
+		s += a[at2(da, j, c)];
+	s = group_sum(t, s);
+	if (i == 0)
+		b[at(db, c)] += s;
+}
+
+kernel void mmean(
+	global const float* a,
+	int4 da,
+	global float* b,
+	int4 db,
+	int n
+) {
+	local float t[LOCAL_SIZE];
+	int i = get_local_id(0), j;
+	int c = get_group_id(0);
+	float s = 0.0f;
+	for (j = i; j < n; j += LOCAL_SIZE)
+		s += a[at2(da, j, c)];
+	s = group_sum(t, s);
+	if (i == 0)
+		b[at(db, c)] = s / n;
+}
+
+kernel void mmax(
+	global const float* a,
+	int4 da,
+	global float* b,
+	int4 db,
+	int n
+) {
+	local float t[LOCAL_SIZE];
+	int i = get_local_id(0), j;
+	int c = get_group_id(0);
+	float z = -INFINITY;
+	for (j = i; j < n; j += LOCAL_SIZE)
+		z = fmax(z, a[at2(da, j, c)]);
+	z = group_max(t, z);
+	if (i == 0)
+		b[at(db, c)] = z;
+}
+
+// the index is stored as a float, exact below 2^24
+kernel void margmax(
+	global const float* a,
+	int4 da,
+	global float* b,
+	int4 db,
+	int n
+) {
+	local float t[LOCAL_SIZE];
+	local int u[LOCAL_SIZE];
+	int i = get_local_id(0), j, k = n;
+	int c = get_group_id(0);
+	float z = -INFINITY;
+	for (j = i; j < n; j += LOCAL_SIZE) {
+		float v = a[at2(da, j, c)];
+		if (v > z || k == n) {
+			z = v;
+			k = j;
 		}
-}
\ No newline at end of file
+	}
+	k = group_argmax(t, u, z, k);
+	if (i == 0)
+		b[at(db, c)] = k;
+}
+
+// softmax and friends, one work group per column of length n
+
+kernel void msoftmax(
+	global const float* a,
+	int4 da,
+	global float* b,
+	int4 db,
+	int n
+) {
+	local float t[LOCAL_SIZE];
+	int i = get_local_id(0), j;
+	int c = get_group_id(0);
+	float z = -INFINITY, s = 0.0f;
+	for (j = i; j < n; j += LOCAL_SIZE)
+		z = fmax(z, a[at2(da, j, c)]);
+	z = group_max(t, z);
+	for (j = i; j < n; j += LOCAL_SIZE)
+		s += exp(a[at2(da, j, c)] - z);
+	s = 1.0f / group_sum(t, s);
+	for (j = i; j < n; j += LOCAL_SIZE)
+		b[at2(db, j, c)] = exp(a[at2(da, j, c)] - z) * s;
+}
+
+kernel void mlogsoftmax(
+	global const float* a,
+	int4 da,
+	global float* b,
+	int4 db,
+	int n
+) {
+	local float t[LOCAL_SIZE];
+	int i = get_local_id(0), j;
+	int c = get_group_id(0);
+	float z = -INFINITY, s = 0.0f;
+	for (j = i; j < n; j += LOCAL_SIZE)
+		z = fmax(z, a[at2(da, j, c)]);
+	z = group_max(t, z);
+	for (j = i; j < n; j += LOCAL_SIZE)
+		s += exp(a[at2(da, j, c)] - z);
+	z += log(group_sum(t, s));
+	for (j = i; j < n; j += LOCAL_SIZE)
+		b[at2(db, j, c)] = a[at2(da, j, c)] - z;
+}
+
+// r = J(s)^T g, the jacobian of softmax is diag(s) - s s^T
+kernel void msoftmax_d(
+	global const float* s,
+	int4 ds,
+	global const float* g,
+	int4 dg,
+	global float* r,
+	int4 dr,
+	int n
+) {
+	local float t[LOCAL_SIZE];
+	int i = get_local_id(0), j;
+	int c = get_group_id(0);
+	float z = 0.0f;
+	for (j = i; j < n; j += LOCAL_SIZE)
+		z += s[at2(ds, j, c)] * g[at2(dg, j, c)];
+	z = group_sum(t, z);
+	for (j = i; j < n; j += LOCAL_SIZE)
+		r[at2(dr, j, c)] = s[at2(ds, j, c)] * (g[at2(dg, j, c)] - z);
+}
+
+// s = softmax(a), l = -sum(y * log(s)), g = dl/da = s * sum(y) - y
+kernel void msoftmax_xent(
+	global const float* a,
+	int4 da,
+	global const float* y,
+	int4 dy,
+	global float* s,
+	int4 ds,
+	global float* g,
+	int4 dg,
+	global float* l,
+	int n
+) {
+	local float t[LOCAL_SIZE];
+	int i = get_local_id(0), j;
+	int c = get_group_id(0);
+	float z = -INFINITY, e = 0.0f, ys = 0.0f, yl = 0.0f;
+	for (j = i; j < n; j += LOCAL_SIZE)
+		z = fmax(z, a[at2(da, j, c)]);
+	z = group_max(t, z);
+	for (j = i; j < n; j += LOCAL_SIZE) {
+		float x = a[at2(da, j, c)], w = y[at2(dy, j, c)];
+		e += exp(x - z);
+		ys += w;
+		yl += w * (x - z);
+	}
+	e = group_sum(t, e);
+	ys = group_sum(t, ys);
+	yl = group_sum(t, yl);
+	for (j = i; j < n; j += LOCAL_SIZE) {
+		float p = exp(a[at2(da, j, c)] - z) / e;
+		s[at2(ds, j, c)] = p;
+		g[at2(dg, j, c)] = p * ys - y[at2(dy, j, c)];
+	}
+	if (i == 0)
+		l[c] = ys * log(e) - yl;
+}
+
+// g = s * sum(y) - y, the same gradient given s = softmax(a)
+kernel void msoftmax_xent_d(
+	global const float* s,
+	int4 ds,
+	global const float* y,
+	int4 dy,
+	global float* g,
+	int4 dg,
+	int n
+) {
+	local float t[LOCAL_SIZE];
+	int i = get_local_id(0), j;
+	int c = get_group_id(0);
+	float ys = 0.0f;
+	for (j = i; j < n; j += LOCAL_SIZE)
+		ys += y[at2(dy, j, c)];
+	ys = group_sum(t, ys);
+	for (j = i; j < n; j += LOCAL_SIZE)
+		g[at2(dg, j, c)] = s[at2(ds, j, c)] * ys - y[at2(dy, j, c)];
+}
+
+
+// optimizer steps, one pass over the parameter p and its state;
+// g is the gradient, or g = a b^T for the _outer variants;
+// rg = 1 - weight decay, applied to p after the step
+
+kernel void vsgd(
+	global float* p,
+	int4 dp,
+	global float* v,
+	int4 dv,
+	global const float* g,
+	int4 dg,
+	int n,
+	float rate,
+	float mu,
+	float rg
+) {
+	LOOP
+		{
+			int kp = at(dp, j), kv = at(dv, j);
+			float w = mu * v[kv] - rate * g[at(dg, j)];
+			v[kv] = w;
+			p[kp] = (p[kp] + w) * rg;
+		}
+}
+
+kernel void msgd_outer(
+	global float* p,
+	int4 dp,
+	global float* v,
+	int4 dv,
+	global const float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
+	int n,
+	int m,
+	float rate,
+	float mu,
+	float rg
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i < n && j < m) {
+		int kp = at2(dp, i, j), kv = at2(dv, i, j);
+		float w = mu * v[kv] - rate * a[at(da, i)] * b[at(db, j)];
+		v[kv] = w;
+		p[kp] = (p[kp] + w) * rg;
+	}
+}
+
+kernel void vrmsprop(
+	global float* p,
+	int4 dp,
+	global float* s,
+	int4 ds,
+	global const float* g,
+	int4 dg,
+	int n,
+	float rate,
+	float rho,
+	float eps,
+	float rg
+) {
+	LOOP
+		{
+			int kp = at(dp, j), ks = at(ds, j);
+			float x = g[at(dg, j)];
+			float w = rho * s[ks] + (1.0f - rho) * x * x;
+			s[ks] = w;
+			p[kp] = (p[kp] - rate * x / (sqrt(w) + eps)) * rg;
+		}
+}
+
+kernel void mrmsprop_outer(
+	global float* p,
+	int4 dp,
+	global float* s,
+	int4 ds,
+	global const float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
+	int n,
+	int m,
+	float rate,
+	float rho,
+	float eps,
+	float rg
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i < n && j < m) {
+		int kp = at2(dp, i, j), ks = at2(ds, i, j);
+		float g = a[at(da, i)] * b[at(db, j)];
+		float w = rho * s[ks] + (1.0f - rho) * g * g;
+		s[ks] = w;
+		p[kp] = (p[kp] - rate * g / (sqrt(w) + eps)) * rg;
+	}
+}
+
+// c1 and c2 are the bias corrections 1 / (1 - beta^t)
+kernel void vadam(
+	global float* p,
+	int4 dp,
+	global float* u,
+	int4 du,
+	global float* v,
+	int4 dv,
+	global const float* g,
+	int4 dg,
+	int n,
+	float rate,
+	float b1,
+	float b2,
+	float eps,
+	float rg,
+	float c1,
+	float c2
+) {
+	LOOP
+		{
+			int kp = at(dp, j), ku = at(du, j), kv = at(dv, j);
+			float w = g[at(dg, j)];
+			float x = b1 * u[ku] + (1.0f - b1) * w;
+			float y = b2 * v[kv] + (1.0f - b2) * w * w;
+			u[ku] = x;
+			v[kv] = y;
+			p[kp] = (p[kp] - rate * x * c1 / (sqrt(y * c2) + eps)) * rg;
+		}
+}
+
+kernel void madam_outer(
+	global float* p,
+	int4 dp,
+	global float* u,
+	int4 du,
+	global float* v,
+	int4 dv,
+	global const float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
+	int n,
+	int m,
+	float rate,
+	float b1,
+	float b2,
+	float eps,
+	float rg,
+	float c1,
+	float c2
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i < n && j < m) {
+		int kp = at2(dp, i, j), ku = at2(du, i, j), kv = at2(dv, i, j);
+		float g = a[at(da, i)] * b[at(db, j)];
+		float x = b1 * u[ku] + (1.0f - b1) * g;
+		float y = b2 * v[kv] + (1.0f - b2) * g * g;
+		u[ku] = x;
+		v[kv] = y;
+		p[kp] = (p[kp] - rate * x * c1 / (sqrt(y * c2) + eps)) * rg;
+	}
+}
+
+
+// BLAS-style routines; the view of a is the view of op(a), n x m, so
+// a transpose is only a swap of its strides
+
+// y = alpha * op(a) x + beta * y, one work item per row, for da.z == 1
+kernel void gemv_n(
+	global const float* a,
+	int4 da,
+	global const float* x,
+	int4 dx,
+	global float* y,
+	int4 dy,
+	int n,
+	int m,
+	float alpha,
+	float beta
+) {
+	int i = get_global_id(0), j;
+	if (i < n) {
+		float z = 0.0f;
+		int k = at(dy, i);
+		for (j = 0; j < m; j++) {
+			z += a[at2(da, i, j)] * x[at(dx, j)];
+		}
+		y[k] = beta == 0.0f ? alpha * z : alpha * z + beta * y[k];
+	}
+}
+
+// the same, one work group per row, for da.w == 1
+kernel void gemv_t(
+	global const float* a,
+	int4 da,
+	global const float* x,
+	int4 dx,
+	global float* y,
+	int4 dy,
+	int n,
+	int m,
+	float alpha,
+	float beta
+) {
+	local float t[LOCAL_SIZE];
+	int i = get_group_id(0), j;
+	float z = 0.0f;
+	for (j = get_local_id(0); j < m; j += LOCAL_SIZE) {
+		z += a[at2(da, i, j)] * x[at(dx, j)];
+	}
+	z = group_sum(t, z);
+	if (get_local_id(0) == 0) {
+		int k = at(dy, i);
+		y[k] = beta == 0.0f ? alpha * z : alpha * z + beta * y[k];
+	}
+}
+
+// c = alpha * op(a) op(b) + beta * c, op(a) is n x m, op(b) is m x l
+kernel void gemm(
+	global const float* a,
+	int4 da,
+	global const float* b,
+	int4 db,
+	global float* c,
+	int4 dc,
+	int n,
+	int m,
+	int l,
+	float alpha,
+	float beta
+) {
+	local float ta[LOCAL_SIZE_SQRT][LOCAL_SIZE_SQRT];
+	local float tb[LOCAL_SIZE_SQRT][LOCAL_SIZE_SQRT];
+	int li = get_local_id(0), lj = get_local_id(1);
+	int i = get_global_id(0), j = get_global_id(1);
+	int k, q;
+	float z = 0.0f;
+	for (k = 0; k < m; k += LOCAL_SIZE_SQRT) {
+		ta[lj][li] = i < n && k + lj < m ? a[at2(da, i, k + lj)] : 0.0f;
+		tb[lj][li] = k + li < m && j < l ? b[at2(db, k + li, j)] : 0.0f;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (q = 0; q < LOCAL_SIZE_SQRT; q++) {
+			z += ta[q][li] * tb[lj][q];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (i < n && j < l) {
+		int o = at2(dc, i, j);
+		c[o] = beta == 0.0f ? alpha * z : alpha * z + beta * c[o];
+	}
+}
+
+// a += alpha * x y^T
+kernel void ger(
+	global float* a,
+	int4 da,
+	global const float* x,
+	int4 dx,
+	global const float* y,
+	int4 dy,
+	int n,
+	int m,
+	float alpha
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i < n && j < m) {
+		a[at2(da, i, j)] += alpha * x[at(dx, i)] * y[at(dy, j)];
+	}
+}
+
+// y += alpha * x
+kernel void axpy(
+	global const float* x,
+	int4 dx,
+	global float* y,
+	int4 dy,
+	int n,
+	float alpha
+) {
+	LOOP
+		y[at(dy, j)] += alpha * x[at(dx, j)];
+}
+
+// y += s * p / q * x, with the ratio of two device values; nothing if q
+// is 0, as when a solver has already converged
+kernel void vaxpyq(
+	global const float* x,
+	int4 dx,
+	global float* y,
+	int4 dy,
+	int n,
+	global const float* p,
+	global const float* q,
+	float s
+) {
+	float alpha = *q != 0.0f ? s * *p / *q : 0.0f;
+	LOOP
+		y[at(dy, j)] += alpha * x[at(dx, j)];
+}
+
+// y = x + p / q * y
+kernel void vxpayq(
+	global const float* x,
+	int4 dx,
+	global float* y,
+	int4 dy,
+	int n,
+	global const float* p,
+	global const float* q
+) {
+	float beta = *q != 0.0f ? *p / *q : 0.0f;
+	LOOP
+		y[at(dy, j)] = x[at(dx, j)] + beta * y[at(dy, j)];
+}
+
+// b = a, for copies between views
+kernel void vcopy(
+	global const float* a,
+	int4 da,
+	global float* b,
+	int4 db,
+	int n
+) {
+	LOOP
+		b[at(db, j)] = a[at(da, j)];
+}
+
+// datasets
+
+// a keyed bijection on [0, 4^h), a four round feistel network
+uint feistel(
+	uint x,
+	int h,
+	uint key
+) {
+	uint mask = (1u << h) - 1;
+	uint l = x >> h, r = x & mask, f;
+	int k;
+	for (k = 0; k < 4; k++) {
+		f = (r + key + k * 0x9e3779b9u) * 0x85ebca6bu;
+		f ^= f >> 13;
+		f *= 0xc2b2ae35u;
+		f ^= f >> 16;
+		f = (l ^ f) & mask;
+		l = r;
+		r = f;
+	}
+	return l << h | r;
+}
+
+// p = a random permutation of [0, n) for 4^h >= n, values out of the
+// range are mapped again until they fall into it
+kernel void dshuffle(
+	global int* p,
+	int n,
+	int h,
+	uint key
+) {
+	int i = get_global_id(0);
+	if (i < n) {
+		uint x = i;
+		do
+			x = feistel(x, h, key);
+		while (x >= (uint)n);
+		p[i] = x;
+	}
+}
+
+// column j of x = scale * sample p[(i + j) % n] of a, n samples of d
+// features; column j of t = the one-hot label of that sample
+kernel void dgather(
+	global const float* a,
+	global const int* y,
+	global const int* p,
+	global float* x,
+	int4 dx,
+	global float* t,
+	int4 dt,
+	int n,
+	int d,
+	int k,
+	int i,
+	int l,
+	float scale
+) {
+	int r = get_global_id(0);
+	int j = get_global_id(1);
+	if (j < l) {
+		int s = p[(i + j) % n];
+		if (r < d)
+			x[at2(dx, r, j)] = a[s*d + r] * scale;
+		if (r < k)
+			t[at2(dt, r, j)] = y[s] == r ? 1.0f : 0.0f;
+	}
+}
+
+// the same for samples stored as bytes
+kernel void dgather_u8(
+	global const uchar* a,
+	global const int* y,
+	global const int* p,
+	global float* x,
+	int4 dx,
+	global float* t,
+	int4 dt,
+	int n,
+	int d,
+	int k,
+	int i,
+	int l,
+	float scale
+) {
+	int r = get_global_id(0);
+	int j = get_global_id(1);
+	if (j < l) {
+		int s = p[(i + j) % n];
+		if (r < d)
+			x[at2(dx, r, j)] = a[s*d + r] * scale;
+		if (r < k)
+			t[at2(dt, r, j)] = y[s] == r ? 1.0f : 0.0f;
+	}
+}
+
+// c[argmax of column j of a][label of sample p[(i + j) % n]] += 1, a
+// holds the scores of k classes for l samples
+kernel void dcount(
+	global const float* a,
+	int4 da,
+	global const int* y,
+	global const int* p,
+	global int* c,
+	int n,
+	int k,
+	int i,
+	int l
+) {
+	int j = get_global_id(0);
+	if (j < l) {
+		int b = 0;
+		float mx = a[at2(da, 0, j)];
+		for (int r=1; r<k; r++) {
+			float v = a[at2(da, r, j)];
+			if (v > mx) {
+				mx = v;
+				b = r;
+			}
+		}
+		atomic_inc(c + b*k + y[p[(i + j) % n]]);
+	}
+}
+
+// fp16 storage; values are loaded as floats and everything is computed
+// and accumulated in fp32. vload_half and vstore_half need no extension,
+// with cl_khr_fp16 a half is loaded directly
+
+#ifdef cl_khr_fp16
+#pragma OPENCL EXTENSION cl_khr_fp16 : enable
+#define LOAD_HALF(p, i) ((float)(p)[i])
+#else
+#define LOAD_HALF(p, i) vload_half(i, p)
+#endif
+
+// h = a, rounded to nearest even
+kernel void hpack(
+	global const float* a,
+	int4 da,
+	global half* h,
+	int4 dh,
+	int n
+) {
+	LOOP
+		vstore_half(a[at(da, j)], at(dh, j), h);
+}
+
+// a = h
+kernel void hunpack(
+	global const half* h,
+	int4 dh,
+	global float* a,
+	int4 da,
+	int n
+) {
+	LOOP
+		a[at(da, j)] = LOAD_HALF(h, at(dh, j));
+}
+
+kernel void hrdsum_1(
+	global const half* a,
+	int4 da,
+	global float* b,
+	int n,
+	int m
+) {
+	int i = get_global_id(0), j;
+	float z = 0.0f;
+	for (j=i; j<n; j+=m) {
+		z += LOAD_HALF(a, at(da, j));
+	}
+	b[i] = z;
+}
+
+// gemv_n, gemv_t and gemm with op(a) in halves
+kernel void hgemv_n(
+	global const half* a,
+	int4 da,
+	global const float* x,
+	int4 dx,
+	global float* y,
+	int4 dy,
+	int n,
+	int m,
+	float alpha,
+	float beta
+) {
+	int i = get_global_id(0), j;
+	if (i < n) {
+		float z = 0.0f;
+		int k = at(dy, i);
+		for (j = 0; j < m; j++) {
+			z += LOAD_HALF(a, at2(da, i, j)) * x[at(dx, j)];
+		}
+		y[k] = beta == 0.0f ? alpha * z : alpha * z + beta * y[k];
+	}
+}
+
+kernel void hgemv_t(
+	global const half* a,
+	int4 da,
+	global const float* x,
+	int4 dx,
+	global float* y,
+	int4 dy,
+	int n,
+	int m,
+	float alpha,
+	float beta
+) {
+	local float t[LOCAL_SIZE];
+	int i = get_group_id(0), j;
+	float z = 0.0f;
+	for (j = get_local_id(0); j < m; j += LOCAL_SIZE) {
+		z += LOAD_HALF(a, at2(da, i, j)) * x[at(dx, j)];
+	}
+	z = group_sum(t, z);
+	if (get_local_id(0) == 0) {
+		int k = at(dy, i);
+		y[k] = beta == 0.0f ? alpha * z : alpha * z + beta * y[k];
+	}
+}
+
+kernel void hgemm(
+	global const half* a,
+	int4 da,
+	global const float* b,
+	int4 db,
+	global float* c,
+	int4 dc,
+	int n,
+	int m,
+	int l,
+	float alpha,
+	float beta
+) {
+	local float ta[LOCAL_SIZE_SQRT][LOCAL_SIZE_SQRT];
+	local float tb[LOCAL_SIZE_SQRT][LOCAL_SIZE_SQRT];
+	int li = get_local_id(0), lj = get_local_id(1);
+	int i = get_global_id(0), j = get_global_id(1);
+	int k, q;
+	float z = 0.0f;
+	for (k = 0; k < m; k += LOCAL_SIZE_SQRT) {
+		ta[lj][li] = i < n && k + lj < m ? LOAD_HALF(a, at2(da, i, k + lj)) : 0.0f;
+		tb[lj][li] = k + li < m && j < l ? b[at2(db, k + li, j)] : 0.0f;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (q = 0; q < LOCAL_SIZE_SQRT; q++) {
+			z += ta[q][li] * tb[lj][q];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (i < n && j < l) {
+		int o = at2(dc, i, j);
+		c[o] = beta == 0.0f ? alpha * z : alpha * z + beta * c[o];
+	}
+}
+
+// mmdense with the weights in halves
+kernel void hmmdense(
+	global const half* a,
+	int4 da,
+	global const float* x,
+	int4 dx,
+	global const float* b,
+	int4 db,
+	global float* y,
+	int4 dy,
+	global float* z,
+	int4 dz,
+	int n,
+	int m,
+	int l,
+	int f
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	int k;
+	if (i < n && j < l) {
+		float s = b[at(db, i)];
+		for (k = 0; k < m; k++) {
+			s += LOAD_HALF(a, at2(da, i, k)) * x[at2(dx, k, j)];
+		}
+		if (z)
+			z[at2(dz, i, j)] = s;
+		y[at2(dy, i, j)] = activate(s, f);
+	}
+}
+
+// vsgd on fp32 master weights p that also stores their halves in h
+kernel void vsgd_h(
+	global float* p,
+	int4 dp,
+	global float* v,
+	int4 dv,
+	global const float* g,
+	int4 dg,
+	global half* h,
+	int4 dh,
+	int n,
+	float rate,
+	float mu,
+	float rg
+) {
+	LOOP
+		{
+			int kp = at(dp, j), kv = at(dv, j);
+			float w = mu * v[kv] - rate * g[at(dg, j)];
+			float x = (p[kp] + w) * rg;
+			v[kv] = w;
+			p[kp] = x;
+			vstore_half(x, at(dh, j), h);
+		}
+}
+
+// int8 weights for inference, w_ik ~ s_i q_ik; q is stored by rows
+
+// s_i = max |w_ik| / 127 and q_ik = w_ik / s_i rounded, one work group
+// per row
+kernel void qpack(
+	global const float* w,
+	int4 dw,
+	global char* q,
+	global float* s,
+	int n,
+	int m
+) {
+	local float t[LOCAL_SIZE];
+	int i = get_group_id(0), k;
+	float hi = 0.0f, c;
+	for (k = get_local_id(0); k < m; k += LOCAL_SIZE)
+		hi = fmax(hi, fabs(w[at2(dw, i, k)]));
+	hi = group_max(t, hi);
+	c = hi > 0.0f ? hi / 127 : 1.0f;
+	for (k = get_local_id(0); k < m; k += LOCAL_SIZE)
+		q[i*m + k] = convert_char_sat_rte(w[at2(dw, i, k)] / c);
+	if (get_local_id(0) == 0)
+		s[i] = c;
+}
+
+// y = f(s_i * scale * sum_k q_ik x_k + b_i) with int32 accumulation; x is
+// sample p[(i0 + j) % nn] of the byte samples in a, as in dgather_u8
+kernel void qdense_u8(
+	global const char* q,
+	global const float* s,
+	global const uchar* a,
+	global const int* p,
+	int i0,
+	int nn,
+	global const float* b,
+	int4 db,
+	global float* y,
+	int4 dy,
+	int n,
+	int m,
+	int l,
+	float scale,
+	int f
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	int k, z = 0;
+	if (i < n && j < l) {
+		global const char* w = q + i*m;
+		global const uchar* x = a + p[(i0 + j) % nn] * m;
+		for (k = 0; k < m; k++)
+			z += w[k] * x[k];
+		y[at2(dy, i, j)] = activate(s[i] * scale * z + b[at(db, i)], f);
+	}
+}
+
+// counter-based random numbers, Philox4x32-10 as la::rng. Value k of a
+// stream is word k % 4 of block k / 4 encrypted with the seed (k0, k1);
+// the fill starts at position (c0, c1) and element j of a view takes
+// position c + j, so every element is made on its own
+
+void philox(
+	uint* c,
+	uint k0,
+	uint k1
+) {
+	int r;
+	for (r = 0; r < 10; r++) {
+		uint h0 = mul_hi(0xD2511F53u, c[0]), l0 = 0xD2511F53u * c[0];
+		uint h1 = mul_hi(0xCD9E8D57u, c[2]), l1 = 0xCD9E8D57u * c[2];
+		c[0] = h1 ^ c[1] ^ k0;
+		c[1] = l1;
+		c[2] = h0 ^ c[3] ^ k1;
+		c[3] = l0;
+		k0 += 0x9E3779B9u;
+		k1 += 0xBB67AE85u;
+	}
+}
+
+// the block of position c + j, c = (c0, c1) as a 64-bit number
+void rng_block(
+	uint* w,
+	uint k0,
+	uint k1,
+	uint c0,
+	uint c1,
+	int j
+) {
+	uint lo = c0 + (uint)j;
+	uint hi = c1 + (lo < c0 ? 1 : 0);
+	w[0] = lo >> 2 | hi << 30;
+	w[1] = hi >> 2;
+	w[2] = 0;
+	w[3] = 0;
+	philox(w, k0, k1);
+}
+
+// (2x + 1) / 2^24 from the top 23 bits, exact and in (0, 1)
+float rng_unit(
+	uint x
+) {
+	return (float)((x >> 9) * 2 + 1) * (1.0f / 16777216);
+}
+
+float rng_uniform(
+	uint k0,
+	uint k1,
+	uint c0,
+	uint c1,
+	int j
+) {
+	uint w[4];
+	rng_block(w, k0, k1, c0, c1, j);
+	return rng_unit(w[(c0 + (uint)j) & 3]);
+}
+
+// Box-Muller on the word pairs (0, 1) and (2, 3) of a block
+float rng_normal(
+	uint k0,
+	uint k1,
+	uint c0,
+	uint c1,
+	int j
+) {
+	uint w[4];
+	int p = (c0 + (uint)j) & 3;
+	rng_block(w, k0, k1, c0, c1, j);
+	float r = sqrt(-2.0f * log(rng_unit(w[p & 2])));
+	float t = 6.2831853f * rng_unit(w[p | 1]);
+	return r * (p & 1 ? sin(t) : cos(t));
+}
+
+kernel void vrand_uniform(
+	global float* a,
+	int4 da,
+	int n,
+	uint k0,
+	uint k1,
+	uint c0,
+	uint c1,
+	float lo,
+	float hi
+) {
+	LOOP
+		a[at(da, j)] = lo + (hi - lo) * rng_uniform(k0, k1, c0, c1, j);
+}
+
+kernel void vrand_normal(
+	global float* a,
+	int4 da,
+	int n,
+	uint k0,
+	uint k1,
+	uint c0,
+	uint c1,
+	float mean,
+	float sd
+) {
+	LOOP
+		a[at(da, j)] = mean + sd * rng_normal(k0, k1, c0, c1, j);
+}
+
+// b = a * mask / (1 - p), element j is dropped when its uniform is below
+// p; the mask is never stored, the same arguments make it again for the
+// gradient. a and b may be the same
+kernel void vdropout(
+	global const float* a,
+	int4 da,
+	global float* b,
+	int4 db,
+	int n,
+	uint k0,
+	uint k1,
+	uint c0,
+	uint c1,
+	float p
+) {
+	LOOP
+		b[at(db, j)] = rng_uniform(k0, k1, c0, c1, j) < p
+			? 0.0f : a[at(da, j)] / (1.0f - p);
+}
+
+// Cholesky by blocks: the diagonal block is factored by one work group,
+// the panel below it is solved row by row, the rest is a gemm.
+
+// the nb x nb block d of a becomes its own factor; flag is set if a
+// pivot is not positive
+kernel void chol_diag(
+	global float* a,
+	int4 da,
+	int nb,
+	global int* flag
+) {
+	int t = get_local_id(0), i, j, k;
+	for (j=0; j<nb; j++) {
+		barrier(CLK_GLOBAL_MEM_FENCE);
+		float d = a[at2(da, j, j)];
+		if (!(d > 0.0f)) {
+			if (t == 0)
+				*flag = 1;
+			d = 1.0f;
+		}
+		d = sqrt(d);
+		barrier(CLK_GLOBAL_MEM_FENCE);
+		for (i=j+1+t; i<nb; i+=LOCAL_SIZE)
+			a[at2(da, i, j)] /= d;
+		if (t == 0)
+			a[at2(da, j, j)] = d;
+		barrier(CLK_GLOBAL_MEM_FENCE);
+		for (i=j+1+t; i<nb; i+=LOCAL_SIZE) {
+			float l = a[at2(da, i, j)];
+			for (k=j+1; k<=i; k++)
+				a[at2(da, i, k)] -= l * a[at2(da, k, j)];
+		}
+	}
+}
+
+// the h x nb panel p of a becomes p L^-T, L the factored block l
+kernel void chol_panel(
+	global float* a,
+	int4 dl,
+	int4 dp,
+	int h,
+	int nb
+) {
+	int i = get_global_id(0), j, k;
+	if (i >= h)
+		return;
+	for (j=0; j<nb; j++) {
+		float s = a[at2(dp, i, j)];
+		for (k=0; k<j; k++)
+			s -= a[at2(dp, i, k)] * a[at2(dl, j, k)];
+		a[at2(dp, i, j)] = s / a[at2(dl, j, j)];
+	}
+}
+
+// x = L^-1 x, or L^-T x with t, for a small lower triangular block;
+// a single work item
+kernel void trsv_l(
+	global const float* l,
+	int4 dl,
+	global float* x,
+	int4 dx,
+	int nb,
+	int t
+) {
+	int i, k;
+	for (i=0; i<nb; i++) {
+		int r = t ? nb-1-i : i;
+		float s = x[at(dx, r)];
+		if (t)
+			for (k=r+1; k<nb; k++)
+				s -= l[at2(dl, k, r)] * x[at(dx, k)];
+		else
+			for (k=0; k<r; k++)
+				s -= l[at2(dl, r, k)] * x[at(dx, k)];
+		x[at(dx, r)] = s / l[at2(dl, r, r)];
+	}
+}
+
+// zeroes a above the diagonal
+kernel void mtril(
+	global float* a,
+	int4 da,
+	int n
+) {
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i < n && j < n && j > i)
+		a[at2(da, i, j)] = 0.0f;
+}
+
+// Batched gemm for many small matrices, one work group per product:
+// C_k = alpha op(A_k) op(B_k) + beta C_k, n x l = (n x m)(m x l). Matrix
+// k of each operand starts sa, sb, sc floats after the first, the views
+// describe the first. A panel of t columns of op(A_k) and t rows of
+// op(B_k) is read into local memory at a time, C_k is summed in tc;
+// with t >= m both are read once. Every work item keeps the entries e =
+// i + j*n of C_k it started with, so only the loads need barriers.
+void bgemm_local(
+	global const float* a,
+	int4 da,
+	int sa,
+	global const float* b,
+	int4 db,
+	int sb,
+	global float* c,
+	int4 dc,
+	int sc,
+	int n,
+	int m,
+	int l,
+	float alpha,
+	float beta,
+	local float* ta,
+	local float* tb,
+	local float* tc,
+	int t
+) {
+	int k = get_group_id(0), lid = get_local_id(0), e, p, q;
+	a += k * sa;
+	b += k * sb;
+	c += k * sc;
+	for (e=lid; e<n*l; e+=LOCAL_SIZE)
+		tc[e] = 0.0f;
+	for (p=0; p<m; p+=t) {
+		int w = min(t, m - p);
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (e=lid; e<n*w; e+=LOCAL_SIZE)
+			ta[e] = a[at2(da, e % n, p + e / n)];
+		for (e=lid; e<w*l; e+=LOCAL_SIZE)
+			tb[e] = b[at2(db, p + e % w, e / w)];
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (e=lid; e<n*l; e+=LOCAL_SIZE) {
+			int i = e % n, j = e / n;
+			float z = 0.0f;
+			for (q=0; q<w; q++)
+				z += ta[i + q*n] * tb[q + j*w];
+			tc[e] += z;
+		}
+	}
+	for (e=lid; e<n*l; e+=LOCAL_SIZE) {
+		int o = at2(dc, e % n, e / n);
+		c[o] = beta == 0.0f ? alpha * tc[e] : alpha * tc[e] + beta * c[o];
+	}
+}
+
+// all of n, m and l at most 8
+kernel void bgemm_8(
+	global const float* a,
+	int4 da,
+	int sa,
+	global const float* b,
+	int4 db,
+	int sb,
+	global float* c,
+	int4 dc,
+	int sc,
+	int n,
+	int m,
+	int l,
+	float alpha,
+	float beta
+) {
+	local float ta[8 * 8];
+	local float tb[8 * 8];
+	local float tc[8 * 8];
+	bgemm_local(a, da, sa, b, db, sb, c, dc, sc, n, m, l, alpha, beta,
+		ta, tb, tc, 8);
+}
+
+// at most 16
+kernel void bgemm_16(
+	global const float* a,
+	int4 da,
+	int sa,
+	global const float* b,
+	int4 db,
+	int sb,
+	global float* c,
+	int4 dc,
+	int sc,
+	int n,
+	int m,
+	int l,
+	float alpha,
+	float beta
+) {
+	local float ta[16 * 16];
+	local float tb[16 * 16];
+	local float tc[16 * 16];
+	bgemm_local(a, da, sa, b, db, sb, c, dc, sc, n, m, l, alpha, beta,
+		ta, tb, tc, 16);
+}
+
+// at most 32
+kernel void bgemm_32(
+	global const float* a,
+	int4 da,
+	int sa,
+	global const float* b,
+	int4 db,
+	int sb,
+	global float* c,
+	int4 dc,
+	int sc,
+	int n,
+	int m,
+	int l,
+	float alpha,
+	float beta
+) {
+	local float ta[32 * 32];
+	local float tb[32 * 32];
+	local float tc[32 * 32];
+	bgemm_local(a, da, sa, b, db, sb, c, dc, sc, n, m, l, alpha, beta,
+		ta, tb, tc, 32);
+}
+
+// at most 64, in panels of 16 so local memory stays at 24 KB
+kernel void bgemm_64(
+	global const float* a,
+	int4 da,
+	int sa,
+	global const float* b,
+	int4 db,
+	int sb,
+	global float* c,
+	int4 dc,
+	int sc,
+	int n,
+	int m,
+	int l,
+	float alpha,
+	float beta
+) {
+	local float ta[64 * 16];
+	local float tb[16 * 64];
+	local float tc[64 * 64];
+	bgemm_local(a, da, sa, b, db, sb, c, dc, sc, n, m, l, alpha, beta,
+		ta, tb, tc, 16);
+}
+
+// any size, an item per entry of every C_k; the second index runs over
+// the columns of all of them
+kernel void bgemm(
+	global const float* a,
+	int4 da,
+	int sa,
+	global const float* b,
+	int4 db,
+	int sb,
+	global float* c,
+	int4 dc,
+	int sc,
+	int n,
+	int m,
+	int l,
+	float alpha,
+	float beta,
+	int count
+) {
+	int i = get_global_id(0), e = get_global_id(1), q;
+	if (i >= n || e >= l * count)
+		return;
+	int k = e / l, j = e % l;
+	float z = 0.0f;
+	for (q=0; q<m; q++)
+		z += a[k*sa + at2(da, i, q)] * b[k*sb + at2(db, q, j)];
+	int o = k*sc + at2(dc, i, j);
+	c[o] = beta == 0.0f ? alpha * z : alpha * z + beta * c[o];
+}
+
+// y_k = alpha op(A_k) x_k + beta y_k, an item per entry of every y_k;
+// x_k and y_k start sx and sy floats after x_0 and y_0
+kernel void bgemv(
+	global const float* a,
+	int4 da,
+	int sa,
+	global const float* x,
+	int4 dx,
+	int sx,
+	global float* y,
+	int4 dy,
+	int sy,
+	int n,
+	int m,
+	float alpha,
+	float beta,
+	int count
+) {
+	int g = get_global_id(0), q;
+	if (g >= n * count)
+		return;
+	int k = g / n, i = g % n;
+	float z = 0.0f;
+	for (q=0; q<m; q++)
+		z += a[k*sa + at2(da, i, q)] * x[k*sx + at(dx, q)];
+	int o = k*sy + at(dy, i);
+	y[o] = beta == 0.0f ? alpha * z : alpha * z + beta * y[o];
+}
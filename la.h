@@ -6,6 +6,16 @@
 */
 #include <initializer_list>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 namespace la {
 
@@ -14,9 +24,13 @@ class _mat;
 
 template<class T>
 class _vec {
+	template<class U>
+	friend class _mat;
 protected:
 	int n;
 	T* a;
+	// false for a view of memory owned by someone else
+	bool own;
 
 	void check_dims(const _vec& b) const {
 		if (n != b.n)
@@ -27,31 +41,44 @@ public:
 
 	// Generic OOP stvari
 
-	_vec() : n(0), a(nullptr) {}
+	_vec() : n(0), a(nullptr), own(true) {}
 
-	_vec(int n) : n(n), a(new T[n]) {}
+	_vec(int n) : n(n), a(new T[n]), own(true) {}
 
-	_vec(int n, const T& val) : n(n), a(new T[n]) {
+	_vec(int n, const T& val) : n(n), a(new T[n]), own(true) {
 		for (int i=0; i<n; i++)
 			a[i] = val;
 	}
 
+	// a view of n elements at a, which stay the caller's; copies of it
+	// own their elements, and so does a vector it is move-assigned to.
+	// Assigning to it writes into a, a view never gives up its memory
+	static _vec view(T* a, int n) {
+		_vec v;
+		v.n = n;
+		v.a = a;
+		v.own = false;
+		return v;
+	}
+
 	~_vec() {
-		delete[] a;
+		if (own)
+			delete[] a;
 	}
 
-	_vec(const _vec& b) : n(b.n), a(new T[n]) {
+	_vec(const _vec& b) : n(b.n), a(new T[n]), own(true) {
 		for (int i=0; i<n; i++)
 			a[i] = b.a[i];
 	}
 
-	_vec(_vec&& b) : n(b.n), a(b.a) {
+	_vec(_vec&& b) : n(b.n), a(b.a), own(b.own) {
 		b.a = nullptr;
 		b.n = 0;
+		b.own = true;
 	}
 
 	template<class U>
-	_vec(std::initializer_list<U> b) : n(b.size()), a(new T[n]) {
+	_vec(std::initializer_list<U> b) : n(b.size()), a(new T[n]), own(true) {
 		auto it = b.begin();
 		int i = 0;
 		while (it != b.end()) {
@@ -64,22 +91,40 @@ public:
 		if (&b == this)
 			return *this;
 
+		if (!own) {
+			check_dims(b);
+			for (int i=0; i<n; i++)
+				a[i] = b.a[i];
+			return *this;
+		}
+		T* t = new T[b.n];
+		for (int i=0; i<b.n; i++)
+			t[i] = b.a[i];
 		delete[] a;
 		n = b.n;
-		a = new T[n];
-		for (int i=0; i<n; i++)
-			a[i] = b.a[i];
+		a = t;
 		return *this;
 	}
 
 	_vec& operator= (_vec&& b) {
+		if (&b == this)
+			return *this;
+
+		if (!own) {
+			check_dims(b);
+			for (int i=0; i<n; i++)
+				a[i] = std::move(b.a[i]);
+			return *this;
+		}
+		// the memory of a view may go away with b, it is copied
+		if (!b.own)
+			return *this = b;
 		delete[] a;
 		n = b.n;
-		a = new T[n];
-		for (int i=0; i<n; i++)
-			a[i] = b.a[i];
+		a = b.a;
 		b.a = nullptr;
-		b.a = 0;
+		b.n = 0;
+		b.own = true;
 		return *this;
 	}
 
@@ -286,9 +331,65 @@ protected:
 		}
 	};
 
+	// the rows are views, as in an mmat
+	bool views() const {
+		return rows() > 0 && !a[0].own;
+	}
+
+	// n rows, row i a view of the m elements at p + i*m
+	void view_rows(U* p, int n, int m) {
+		a = _vec<_vec<U>>(n);
+		for (int i=0; i<n; i++) {
+			a[i].n = m;
+			a[i].a = p + (size_t)i * m;
+			a[i].own = false;
+		}
+	}
+
 public:
 	_mat() : a() {}
 
+	_mat(const _mat&) = default;
+
+	// rows that are views of someone else's memory are copied, so the
+	// result owns its elements
+	_mat(_mat&& b) {
+		if (b.views())
+			a = b.a;
+		else
+			a = std::move(b.a);
+	}
+
+	// a matrix of views keeps them and gets the elements of b
+	_mat& operator= (const _mat& b) {
+		if (&b == this)
+			return *this;
+		if (!views()) {
+			a = b.a;
+			return *this;
+		}
+		check_dims(b);
+		for (int i=0; i<rows(); i++)
+			a[i] = b.a[i];
+		return *this;
+	}
+
+	_mat& operator= (_mat&& b) {
+		if (&b == this)
+			return *this;
+		if (!views()) {
+			if (b.views())
+				a = b.a;
+			else
+				a = std::move(b.a);
+			return *this;
+		}
+		check_dims(b);
+		for (int i=0; i<rows(); i++)
+			a[i] = b.a[i];
+		return *this;
+	}
+
 	_mat(int n, int m) : a(n, _vec<U>(m)) {}
 
 	_mat(int n, int m, const U& val) :
@@ -527,5 +628,394 @@ std::ostream& operator<< (std::ostream& os, const _mat<T>& v) {
 typedef _vec<float> vec;
 typedef _mat<float> mat;
 
+#if defined(__x86_64__) || defined(__i386__)
+// the AVX2 and VNNI bodies of dot_u8i8, built for those targets whatever
+// the compiler flags and picked at run time; both do the first n / 32 * 32
+// elements
+
+__attribute__((target("avx2")))
+inline int _hsum_avx2(__m256i acc) {
+	__m128i h = _mm_add_epi32(_mm256_castsi256_si128(acc),
+		_mm256_extracti128_si256(acc, 1));
+	h = _mm_add_epi32(h, _mm_shuffle_epi32(h, 0x4e));
+	h = _mm_add_epi32(h, _mm_shuffle_epi32(h, 0xb1));
+	return _mm_cvtsi128_si32(h);
+}
+
+// both are widened to 16 bits first so the pairwise sums cannot
+// saturate like vpmaddubsw would
+__attribute__((target("avx2")))
+inline int _dot_u8i8_avx2(const unsigned char* a, const signed char* b, int n) {
+	__m256i acc = _mm256_setzero_si256();
+	for (int i=0; i+32 <= n; i+=32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+		__m256i xl = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(x));
+		__m256i xh = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(x, 1));
+		__m256i yl = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(y));
+		__m256i yh = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(y, 1));
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(xl, yl));
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(xh, yh));
+	}
+	return _hsum_avx2(acc);
+}
+
+__attribute__((target("avx2,avxvnni")))
+inline int _dot_u8i8_vnni(const unsigned char* a, const signed char* b, int n) {
+	__m256i acc = _mm256_setzero_si256();
+	for (int i=0; i+32 <= n; i+=32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+		acc = _mm256_dpbusd_avx_epi32(acc, x, y);
+	}
+	return _hsum_avx2(acc);
+}
+#endif
+
+// sum of a[i] * b[i], bytes times signed bytes with int32 accumulation;
+// vpdpbusd where the CPU has AVX-VNNI, AVX2 otherwise, else plain C
+inline int dot_u8i8(const unsigned char* a, const signed char* b, int n) {
+	int i = 0, z = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	static const int isa = __builtin_cpu_supports("avxvnni") ? 2
+		: __builtin_cpu_supports("avx2") ? 1 : 0;
+	if (isa) {
+		z = isa == 2 ? _dot_u8i8_vnni(a, b, n) : _dot_u8i8_avx2(a, b, n);
+		i = n / 32 * 32;
+	}
+#endif
+	for (; i<n; i++)
+		z += a[i] * b[i];
+	return z;
+}
+
+// Weights quantized to int8 for inference, w[i][j] ~ scale[i] * q[i][j],
+// with scale[i] = max |w[i][j]| / 127 so every row uses the full range.
+// Rows are contiguous for dot_u8i8.
+class qmat {
+protected:
+	int n, m;
+	_vec<signed char> q;
+	_vec<float> s;
+
+public:
+	qmat(const mat& w) : n(w.rows()), m(w.cols()), q(n * m), s(n) {
+		for (int i=0; i<n; i++) {
+			float hi = 0;
+			for (int j=0; j<m; j++)
+				hi = std::max(hi, std::fabs(w[i][j]));
+			s[i] = hi > 0 ? hi / 127 : 1;
+			for (int j=0; j<m; j++)
+				q[i*m + j] = (signed char)std::nearbyint(w[i][j] / s[i]);
+		}
+	}
+
+	int rows() const { return n; }
+	int cols() const { return m; }
+	float scale(int i) const { return s[i]; }
+	const signed char* row(int i) const { return &q[i*m]; }
+
+	// y = W x for x = sx * the m bytes at x
+	vec dot(const unsigned char* x, float sx) const {
+		vec y(n);
+		for (int i=0; i<n; i++)
+			y[i] = s[i] * sx * dot_u8i8(x, row(i), m);
+		return y;
+	}
+};
+
+// Counter-based random numbers, Philox4x32-10. Value k of a stream is a
+// function of (seed, k) alone: block k / 4 is encrypted with the seed as
+// the key and word k % 4 is taken, so any part of a stream can be made
+// again or skipped without generating what comes before. The device
+// kernels in iopp compute the same words; uniforms are bit-identical,
+// normals agree up to the rounding of log, sqrt and cos.
+class rng {
+public:
+	unsigned long long seed, counter;
+
+	rng(unsigned long long seed = 0, unsigned long long counter = 0) :
+		seed(seed), counter(counter) {}
+
+	static void philox(unsigned* c, unsigned k0, unsigned k1) {
+		for (int r=0; r<10; r++) {
+			unsigned long long p = 0xD2511F53ull * c[0], q = 0xCD9E8D57ull * c[2];
+			unsigned c1 = c[1], c3 = c[3];
+			c[0] = (unsigned)(q >> 32) ^ c1 ^ k0;
+			c[1] = (unsigned)q;
+			c[2] = (unsigned)(p >> 32) ^ c3 ^ k1;
+			c[3] = (unsigned)p;
+			k0 += 0x9E3779B9u;
+			k1 += 0xBB67AE85u;
+		}
+	}
+
+	static unsigned word(unsigned long long seed, unsigned long long k) {
+		unsigned long long b = k / 4;
+		unsigned c[4] = {(unsigned)b, (unsigned)(b >> 32), 0, 0};
+		philox(c, (unsigned)seed, (unsigned)(seed >> 32));
+		return c[k % 4];
+	}
+
+	// 23 random bits, (2x + 1) / 2^24 is exact and never 0 or 1
+	static float uniform_at(unsigned long long seed, unsigned long long k) {
+		return ((word(seed, k) >> 9) * 2 + 1) * (1.0f / 16777216);
+	}
+
+	// Box-Muller on the word pairs (0, 1) and (2, 3) of a block, the even
+	// position of a pair takes the cosine and the odd one the sine
+	static float normal_at(unsigned long long seed, unsigned long long k) {
+		float u = uniform_at(seed, k & ~1ull), v = uniform_at(seed, k | 1);
+		float r = std::sqrt(-2 * std::log(u)), t = 6.2831853f * v;
+		return r * (k & 1 ? std::sin(t) : std::cos(t));
+	}
+
+	float uniform() {
+		return uniform_at(seed, counter++);
+	}
+
+	float normal() {
+		return normal_at(seed, counter++);
+	}
+
+	// element (i, j) is value i + j * rows() of the fill, the column-major
+	// order a cl_mat of the same size uses
+	void uniform(mat& a, float lo, float hi) {
+		for (int j=0; j<a.cols(); j++)
+			for (int i=0; i<a.rows(); i++)
+				a[i][j] = lo + (hi - lo) * uniform_at(seed, counter + i + (unsigned long long)j * a.rows());
+		counter += (unsigned long long)a.rows() * a.cols();
+	}
+
+	void uniform(vec& a, float lo, float hi) {
+		for (int i=0; i<a.size(); i++)
+			a[i] = lo + (hi - lo) * uniform_at(seed, counter + i);
+		counter += a.size();
+	}
+
+	void normal(mat& a, float mean, float sd) {
+		for (int j=0; j<a.cols(); j++)
+			for (int i=0; i<a.rows(); i++)
+				a[i][j] = mean + sd * normal_at(seed, counter + i + (unsigned long long)j * a.rows());
+		counter += (unsigned long long)a.rows() * a.cols();
+	}
+
+	void normal(vec& a, float mean, float sd) {
+		for (int i=0; i<a.size(); i++)
+			a[i] = mean + sd * normal_at(seed, counter + i);
+		counter += a.size();
+	}
+};
+
+// A file of rows x cols floats stored by rows after a 16 byte header,
+// mapped instead of read: opening it costs nothing however large it is,
+// pages are read on first touch and the kernel drops them again when
+// memory runs low. Opened for writing the mapping is shared with the
+// file, otherwise writes stay in the process.
+class mfile {
+public:
+	enum access { normal, sequential, random };
+
+	struct header {
+		char magic[4];
+		int rows, cols, elem;
+	};
+
+protected:
+	char* base;
+	size_t len;
+	int n, m;
+
+	// the pages holding rows i .. i + h - 1
+	void range(int i, int h, char*& p, size_t& l) const {
+		if (h < 0)
+			h = n - i;
+		if (i < 0 || h < 0 || i + h > n)
+			throw "row range out of bounds";
+		long long lo = sizeof(header) + (long long)i * m * sizeof(float);
+		long long hi = lo + (long long)h * m * sizeof(float);
+		lo -= lo % sysconf(_SC_PAGESIZE);
+		p = base + lo;
+		l = hi - lo;
+	}
+
+	void destroy() {
+		if (base)
+			munmap(base, len);
+		base = nullptr;
+	}
+
+public:
+	mfile(const char* fn, bool write = false, access acc = normal) :
+		base(nullptr), len(0), n(0), m(0)
+	{
+		int fd = open(fn, write ? O_RDWR : O_RDONLY);
+		if (fd < 0)
+			throw "cannot open matrix file";
+		struct stat st;
+		header h;
+		if (fstat(fd, &st) || pread(fd, &h, sizeof h, 0) != sizeof h ||
+			memcmp(h.magic, "LAM1", 4) || h.elem != sizeof(float) ||
+			h.rows < 0 || h.cols < 0)
+		{
+			close(fd);
+			throw "not a matrix file";
+		}
+		len = sizeof h + (size_t)h.rows * h.cols * sizeof(float);
+		if ((size_t)st.st_size < len) {
+			close(fd);
+			throw "matrix file is too short";
+		}
+		void* p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			write ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			throw "cannot map matrix file";
+		base = (char*)p;
+		n = h.rows;
+		m = h.cols;
+		advise(acc);
+	}
+
+	mfile(const mfile&) = delete;
+	mfile& operator= (const mfile&) = delete;
+
+	mfile(mfile&& b) : base(b.base), len(b.len), n(b.n), m(b.m) {
+		b.base = nullptr;
+	}
+
+	mfile& operator= (mfile&& b) {
+		if (&b == this)
+			return *this;
+		destroy();
+		base = b.base;
+		len = b.len;
+		n = b.n;
+		m = b.m;
+		b.base = nullptr;
+		return *this;
+	}
+
+	~mfile() {
+		destroy();
+	}
+
+	// n x m zeros, the file is sized but nothing is written
+	static void create(const char* fn, int n, int m) {
+		header h = {{'L', 'A', 'M', '1'}, n, m, sizeof(float)};
+		int fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			throw "cannot create matrix file";
+		bool ok = ::write(fd, &h, sizeof h) == sizeof h &&
+			ftruncate(fd, sizeof h + (off_t)n * m * sizeof(float)) == 0;
+		close(fd);
+		if (!ok)
+			throw "cannot create matrix file";
+	}
+
+	int rows() const { return n; }
+	int cols() const { return m; }
+	float* data() { return (float*)(base + sizeof(header)); }
+	const float* data() const { return (const float*)(base + sizeof(header)); }
+
+	// how rows i .. i + h - 1 will be read, all of them by default;
+	// sequential makes the kernel read far ahead and drop pages behind
+	void advise(access acc, int i = 0, int h = -1) const {
+		char* p;
+		size_t l;
+		range(i, h, p, l);
+		madvise(p, l, acc == sequential ? MADV_SEQUENTIAL :
+			acc == random ? MADV_RANDOM : MADV_NORMAL);
+	}
+
+	// starts reading rows i .. i + h - 1 in the background
+	void prefetch(int i, int h) const {
+		char* p;
+		size_t l;
+		range(i, h, p, l);
+		madvise(p, l, MADV_WILLNEED);
+	}
+
+	// writes the changed pages of a shared mapping to the file
+	void flush() {
+		if (msync(base, len, MS_SYNC))
+			throw "cannot write matrix file";
+	}
+};
+
+// An mfile used as a mat, every row is a view of the mapping, so the
+// rows of a multi-GB file cost only their headers until they are read.
+class mmat : public mat {
+protected:
+	mfile f;
+
+public:
+	mmat(const char* fn, bool write = false, mfile::access acc = mfile::normal) :
+		f(fn, write, acc)
+	{
+		view_rows(f.data(), f.rows(), f.cols());
+	}
+
+	mmat(mmat&& b) : f(std::move(b.f)) {
+		a = std::move(b.a);
+	}
+
+	// takes over the file of b, unlike assigning to the mat
+	mmat& operator= (mmat&& b) {
+		f = std::move(b.f);
+		a = std::move(b.a);
+		return *this;
+	}
+
+	// a new file of n x m zeros, opened for writing
+	static mmat create(const char* fn, int n, int m) {
+		mfile::create(fn, n, m);
+		return mmat(fn, true);
+	}
+
+	mfile& file() { return f; }
+	const mfile& file() const { return f; }
+};
+
+// An mfile used as a vec of all its rows * cols elements
+class mvec : public vec {
+protected:
+	mfile f;
+
+public:
+	mvec(const char* fn, bool write = false, mfile::access acc = mfile::normal) :
+		f(fn, write, acc)
+	{
+		if ((long long)f.rows() * f.cols() > 0x7fffffff)
+			throw "matrix file is too large for a vector";
+		n = f.rows() * f.cols();
+		a = f.data();
+		own = false;
+	}
+
+	mvec(mvec&&) = default;
+
+	// takes over the file of b, unlike assigning to the vec
+	mvec& operator= (mvec&& b) {
+		if (&b == this)
+			return *this;
+		f = std::move(b.f);
+		n = b.n;
+		a = b.a;
+		b.n = 0;
+		b.a = nullptr;
+		return *this;
+	}
+
+	// a new file of n zeros, opened for writing
+	static mvec create(const char* fn, int n) {
+		mfile::create(fn, n, 1);
+		return mvec(fn, true);
+	}
+
+	mfile& file() { return f; }
+	const mfile& file() const { return f; }
+};
+
 } // end namespace la
 
@@ -1,12 +1,31 @@
 #include "iopp.h"
+#include "stopwatch.h"
 #include <iostream>
 #include <iomanip>
-#include <sstream>
 #include <fstream>
 #include <string>
 #include <vector>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <algorithm>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <exception>
+#include <chrono>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/wait.h>
 using namespace std;
 using namespace iopp;
 using namespace la;
@@ -15,105 +34,727 @@ namespace mnist {
 
 auto ct = opencl_context();
 
-vector<pair<int, vector<int>>> read_data(string fn) {
-	ifstream ifs(fn);
-	vector<pair<int, vector<int>>> result;
-	while (ifs) {
-		string ln;
-		getline(ifs, ln);
-		if (ln.size() == 0)
-			return result;
-		for (char& x : ln)
-			if (x == ',')
-				x = ' ';
-		istringstream iss(ln);
-		int label;
-		iss >> label;
-		vector<int> data;
-		int x;
-		while (iss >> x)
-			data.push_back(x);
-		result.push_back({label, data});
-	}
-	return result;
+// n uzoraka po d piksela; x i y pokazuju ili u mapiran kes fajl ili
+// u xs i ys
+struct mnist_data {
+	int n, d;
+	const unsigned char* x;
+	const int* y;
+
+	void* map;
+	size_t map_len;
+	vector<unsigned char> xs;
+	vector<int> ys;
+
+	mnist_data() : n(0), d(0), x(NULL), y(NULL), map(NULL), map_len(0) {}
+
+	mnist_data(const mnist_data&) = delete;
+
+	mnist_data(mnist_data&& b) : n(b.n), d(b.d), x(b.x), y(b.y),
+		map(b.map), map_len(b.map_len),
+		xs(move(b.xs)), ys(move(b.ys))
+	{
+		b.map = NULL;
+	}
+
+	~mnist_data() {
+		if (map)
+			munmap(map, map_len);
+	}
+};
+
+// ceo fajl, samo za citanje; NULL ako ne postoji
+const char* map_file(const string& fn, size_t& len, time_t* mtime = NULL) {
+	int fd = open(fn.c_str(), O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	fstat(fd, &st);
+	len = st.st_size;
+	if (mtime)
+		*mtime = st.st_mtime;
+	void* p = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+	madvise(p, len, MADV_SEQUENTIAL);
+	return (const char*)p;
 }
 
-vector<pair<vec, vec>> preprocess(vector<pair<int, vector<int>>> data) {
-	vector<pair<vec, vec>> result;
-	for (auto p : data) {
-		vec x(p.second.size());
-		copy(p.second.begin(), p.second.end(), x.begin());
-		vec t(10, 0.0f);
-		t[p.first] = 1.0f;
-		result.push_back({x / 256, t});		
+time_t file_mtime(const string& fn) {
+	struct stat st;
+	if (stat(fn.c_str(), &st))
+		return 0;
+	return st.st_mtime;
+}
+
+// kes: "MNC1", n, d, 0, pa n labela kao int i n*d piksela
+const char CACHE_MAGIC[4] = {'M', 'N', 'C', '1'};
+
+bool read_cache(const string& fn, mnist_data& r) {
+	size_t len;
+	const char* s = map_file(fn, len);
+	if (!s)
+		return false;
+	int h[4];
+	if (len >= sizeof(h))
+		memcpy(h, s, sizeof(h));
+	if (len < sizeof(h) || memcmp(h, CACHE_MAGIC, 4)
+		|| len != sizeof(h) + (size_t)h[1] * (sizeof(int) + h[2]))
+	{
+		munmap((void*)s, len);
+		return false;
 	}
-	return result;
+	r.n = h[1];
+	r.d = h[2];
+	r.y = (const int*)(s + sizeof(h));
+	r.x = (const unsigned char*)(r.y + r.n);
+	r.map = (void*)s;
+	r.map_len = len;
+	return true;
 }
 
-struct mnist_model {
-	cl_mat A, B;
-	cl_vec c, d;
+void write_cache(const string& fn, const mnist_data& r) {
+	string tmp = fn + ".tmp";
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if (!f)
+		return;
+	int h[4];
+	memcpy(h, CACHE_MAGIC, 4);
+	h[1] = r.n;
+	h[2] = r.d;
+	h[3] = 0;
+	bool ok = fwrite(h, sizeof(h), 1, f) == 1
+		&& fwrite(r.y, sizeof(int), r.n, f) == (size_t)r.n
+		&& fwrite(r.x, r.d, r.n, f) == (size_t)r.n;
+	ok = fclose(f) == 0 && ok;
+	if (ok)
+		rename(tmp.c_str(), fn.c_str());
+	else
+		remove(tmp.c_str());
+}
 
-	cl_mat vA, vB;
-	cl_vec vc, vd;
+int be32(const char* p) {
+	const unsigned char* u = (const unsigned char*)p;
+	return u[0] << 24 | u[1] << 16 | u[2] << 8 | u[3];
+}
 
-	cl_vec x, t;
-	cl_vec k, l, m, n, o, p;
-	cl_val q;
+// originalni format, fn je fajl sa slikama, labele su u paru
+// (train-images-idx3-ubyte i train-labels-idx1-ubyte)
+void parse_idx(const string& fn, const char* s, size_t len, mnist_data& r) {
+	string lfn = fn;
+	size_t k = lfn.find("images-idx3");
+	if (k == string::npos)
+		throw "no idx label file";
+	lfn.replace(k, 11, "labels-idx1");
+	size_t llen;
+	const char* l = map_file(lfn, llen);
+	if (!l)
+		throw "no idx label file";
+
+	r.n = be32(s + 4);
+	r.d = be32(s + 8) * be32(s + 12);
+	if (llen < 8 || be32(l) != 0x801 || be32(l + 4) != r.n
+		|| llen < 8 + (size_t)r.n || len < 16 + (size_t)r.n * r.d)
+	{
+		munmap((void*)l, llen);
+		throw "bad idx file";
+	}
+	r.xs.assign(s + 16, s + 16 + (size_t)r.n * r.d);
+	r.ys.assign((const unsigned char*)l + 8, (const unsigned char*)l + 8 + r.n);
+	munmap((void*)l, llen);
+}
+
+// sledeci red sa bar jednim znakom, p je na pocetku reda
+const char* next_line(const char* p, const char* e, const char*& q) {
+	while (p < e) {
+		q = (const char*)memchr(p, '\n', e - p);
+		if (!q)
+			q = e;
+		if (q > p && !(q == p + 1 && *p == '\r'))
+			return p;
+		p = q + 1;
+	}
+	return NULL;
+}
 
-	mat random_mat(int n, int m, float lo, float hi) {
-		mat a(n, m);
-		for (int i=0; i<n; i++) {
-			for (int j=0; j<m; j++) {
-				a[i][j] = lo + (hi - lo) * rand() / RAND_MAX;
+// label,p1,...,pd; brojevi se citaju rucno
+void parse_line(const char* p, const char* e, int d, int& y, unsigned char* x) {
+	int v = 0, k = -1;
+	for (; p < e; p++) {
+		char c = *p;
+		if (c >= '0' && c <= '9') {
+			v = v * 10 + (c - '0');
+		} else if (c == ',') {
+			if (k < 0)
+				y = v;
+			else if (k < d)
+				x[k] = v;
+			k++;
+			v = 0;
+		}
+	}
+	if (k != d - 1)
+		throw "bad csv line";
+	x[k] = v;
+}
+
+// fajl se deli na delove koji pocinju na pocetku reda, svaka nit prvo
+// prebroji svoje redove, a onda ih parsira direktno na svoje mesto
+void parse_csv(const char* s, size_t len, mnist_data& r) {
+	const char* e = s + len;
+	const char* q;
+	const char* p = next_line(s, e, q);
+	if (!p)
+		return;
+	r.d = count(p, q, ',');
+
+	int nt = max(1u, thread::hardware_concurrency());
+	vector<const char*> b(nt + 1);
+	b[0] = s;
+	b[nt] = e;
+	for (int t=1; t<nt; t++) {
+		const char* c = max(s + len * t / nt, b[t-1]);
+		const char* nl = (const char*)memchr(c, '\n', e - c);
+		b[t] = nl ? nl + 1 : e;
+	}
+
+	vector<int> first(nt + 1, 0);
+	vector<thread> th;
+	for (int t=0; t<nt; t++) {
+		th.emplace_back([&, t]() {
+			const char* q;
+			for (const char* p = b[t]; (p = next_line(p, b[t+1], q)); p = q + 1)
+				first[t+1]++;
+		});
+	}
+	for (auto& x : th)
+		x.join();
+	th.clear();
+	for (int t=0; t<nt; t++)
+		first[t+1] += first[t];
+
+	r.n = first[nt];
+	r.xs.resize((size_t)r.n * r.d);
+	r.ys.resize(r.n);
+	vector<const char*> err(nt, NULL);
+	for (int t=0; t<nt; t++) {
+		th.emplace_back([&, t]() {
+			const char* q;
+			int i = first[t];
+			try {
+				for (const char* p = b[t]; (p = next_line(p, b[t+1], q)); p = q + 1, i++)
+					parse_line(p, q, r.d, r.ys[i], &r.xs[(size_t)i * r.d]);
+			} catch (const char* m) {
+				err[t] = m;
+			}
+		});
+	}
+	for (auto& x : th)
+		x.join();
+	for (auto m : err)
+		if (m)
+			throw m;
+}
+
+// csv ili idx; rezultat se kesira u fn.cache, koji se sledeci put samo
+// mapira, dok god nije stariji od fn
+mnist_data read_data(string fn) {
+	mnist_data r;
+	string cfn = fn + ".cache";
+	time_t mtime = file_mtime(fn);
+	if (file_mtime(cfn) >= mtime && read_cache(cfn, r))
+		return r;
+
+	size_t len;
+	const char* s = map_file(fn, len);
+	if (!s)
+		throw "cannot open data file";
+	try {
+		if (len >= 16 && be32(s) == 0x803)
+			parse_idx(fn, s, len, r);
+		else
+			parse_csv(s, len, r);
+	} catch (...) {
+		munmap((void*)s, len);
+		throw;
+	}
+	munmap((void*)s, len);
+	r.x = r.xs.data();
+	r.y = r.ys.data();
+	write_cache(cfn, r);
+	return r;
+}
+
+// pikseli ostaju bajtovi, deli ih gather kernel
+cl_dataset upload(const mnist_data& data) {
+	return ct.dataset(data.n, data.d, 10, data.x, data.y, 1.0f / 256);
+}
+
+// faza pripreme jednog uzorka: d piksela u [0, 1) i oznaka; g daje
+// slucajne brojeve samo tom uzorku
+typedef function<void(float* x, int d, int& y, la::rng& g)> stage;
+
+// pomera kvadratnu sliku za najvise k piksela po svakoj osi, sa strane
+// ulazi crno
+stage shift(int k) {
+	return [k](float* x, int d, int&, la::rng& g) {
+		int w = (int)sqrt((float)d);
+		int dx = (int)(g.uniform() * (2*k + 1)) - k;
+		int dy = (int)(g.uniform() * (2*k + 1)) - k;
+		static thread_local vector<float> t;
+		t.assign(x, x + d);
+		for (int i=0; i<w; i++)
+			for (int j=0; j<w; j++) {
+				int si = i - dy, sj = j - dx;
+				bool in = si >= 0 && si < w && sj >= 0 && sj < w;
+				x[i*w + j] = in ? t[si*w + sj] : 0;
 			}
+	};
+}
+
+struct batch_slot {
+	atomic<long long> seq;
+	// d x batch i 10 x batch, po kolonama kao na uredjaju
+	vector<float> x, t;
+};
+
+// Priprema serija na procesoru, u pozadini. Serija k su uzorci
+// k*batch .. k*batch + batch - 1 niza u kome je svaka epoha nova
+// permutacija skupa. Od t niti, nit w priprema serije k = w (mod t) i
+// stavlja ih na mesto k % depth prstena. Mesto ima redni broj: 2k kad
+// je slobodno za seriju k, 2k + 1 kad je serija spremna; niti i petlja
+// treninga cekaju samo na njega, bez brava. Redosled serija i ono sto
+// faze urade ne zavise od broja niti.
+class batch_pipeline {
+	const mnist_data& data;
+	int batch, depth;
+	unsigned long long seed;
+	vector<stage> stages;
+	unique_ptr<batch_slot[]> slots;
+	vector<thread> threads;
+	atomic<bool> quit, failed;
+	// prva greska neke niti, pop() je ponovo baca
+	mutex err_lock;
+	exception_ptr err;
+	long long next;
+
+	// ceka da mesto dobije redni broj v; false ako se staje
+	bool wait(const atomic<long long>& seq, long long v) const {
+		for (int i=0; seq.load(memory_order_acquire) != v; i++) {
+			if (quit.load(memory_order_relaxed) || failed.load())
+				return false;
+			if (i < 64)
+				this_thread::yield();
+			else
+				this_thread::sleep_for(chrono::microseconds(50));
 		}
-		return a;
+		return true;
 	}
 
-	vec random_vec(int n, float lo, float hi) {
-		vec a(n);
-		for (int i=0; i<n; i++) {
-			a[i] = lo + (hi - lo) * rand() / RAND_MAX;
+	void prepare(long long k, batch_slot& s, vector<int>& perm, long long& epoch) {
+		int n = data.n, d = data.d;
+		for (int c=0; c<batch; c++) {
+			long long j = k * batch + c;
+			if (j / n != epoch) {
+				epoch = j / n;
+				perm.resize(n);
+				for (int i=0; i<n; i++)
+					perm[i] = i;
+				for (int i=n-1; i>0; i--)
+					swap(perm[i], perm[la::rng::word(seed, epoch * n + i) % (i + 1)]);
+			}
+			int i = perm[j % n], y = data.y[i];
+			float* x = &s.x[(size_t)c * d];
+			for (int p=0; p<d; p++)
+				x[p] = data.x[(size_t)i * d + p] * (1.0f / 256);
+			la::rng g(seed + 1, (unsigned long long)j << 16);
+			for (auto& f : stages)
+				f(x, d, y, g);
+			if (y < 0 || y >= 10)
+				throw "label out of range";
+			fill(&s.t[c * 10], &s.t[c * 10] + 10, 0.0f);
+			s.t[c * 10 + y] = 1;
 		}
-		return a;
 	}
 
-	void mwrite(ostream& os, const mat& a) {
-		os.precision(10);
-		os << fixed;
-		for (int i=0; i<a.rows(); i++)
-			for (int j=0; j<a.cols(); j++)
-				os << a[i][j] << ' ';
+	void produce(int w, int t) {
+		vector<int> perm;
+		long long epoch = -1;
+		try {
+			for (long long k=w; ; k+=t) {
+				auto& s = slots[k % depth];
+				if (!wait(s.seq, 2*k))
+					return;
+				prepare(k, s, perm, epoch);
+				s.seq.store(2*k + 1, memory_order_release);
+			}
+		} catch (...) {
+			lock_guard<mutex> g(err_lock);
+			if (!err)
+				err = current_exception();
+			failed = true;
+		}
 	}
 
+public:
+	// t niti, podrazumevano sva jezgra osim jednog, i depth mesta
+	batch_pipeline(const mnist_data& data, int batch, vector<stage> stages = {},
+		int t = 0, int depth = 0, unsigned long long seed = 3211) :
+		data(data), batch(batch), depth(depth), seed(seed),
+		stages(move(stages)), quit(false), failed(false), next(0)
+	{
+		if (t <= 0)
+			t = max(1, (int)thread::hardware_concurrency() - 1);
+		if (this->depth <= 0)
+			this->depth = 2*t + 2;
+		slots.reset(new batch_slot[this->depth]);
+		for (int i=0; i<this->depth; i++) {
+			slots[i].seq = 2*i;
+			slots[i].x.resize((size_t)batch * data.d);
+			slots[i].t.resize((size_t)batch * 10);
+		}
+		for (int w=0; w<t; w++)
+			threads.emplace_back([this, w, t]() { produce(w, t); });
+	}
+
+	batch_pipeline(const batch_pipeline&) = delete;
+	batch_pipeline& operator= (const batch_pipeline&) = delete;
+
+	~batch_pipeline() {
+		quit = true;
+		for (auto& x : threads)
+			x.join();
+	}
+
+	int size() const { return data.n; }
+
+	// ceka sledecu seriju i salje je u x (d x batch) i t (10 x batch)
+	void pop(cl_mat& x, cl_mat& t) {
+		if (x.rows() != data.d || t.rows() != 10 || x.cols() != batch || t.cols() != batch)
+			throw "batch size mismatch";
+		auto& s = slots[next % depth];
+		if (!wait(s.seq, 2*next + 1)) {
+			if (failed) {
+				lock_guard<mutex> g(err_lock);
+				rethrow_exception(err);
+			}
+			throw "pipeline stopped";
+		}
+		x.write(s.x.data());
+		t.write(s.t.data());
+		s.seq.store(2*(next + depth), memory_order_release);
+		next++;
+	}
+};
+
+// checkpoint: zaglavlje, tabela tenzora, pa podaci u redosledu kao na
+// uredjaju (po kolonama); svaki tenzor pocinje na novoj strani, tako da
+// mapiran fajl moze direktno da se salje na uredjaj
+const char CKPT_MAGIC[4] = {'I', 'O', 'P', 'C'};
+const int CKPT_VERSION = 1;
+const long long CKPT_ALIGN = 4096;
+
+struct ckpt_header {
+	char magic[4];
+	int version, count, pad;
+};
+
+// vektor je matrica n x 1
+struct ckpt_entry {
+	char name[16];
+	int rows, cols;
+	long long offset;
+};
+
+long long ckpt_align(long long x) {
+	return (x + CKPT_ALIGN - 1) / CKPT_ALIGN * CKPT_ALIGN;
+}
+
+typedef vector<pair<string, cl_mat>> mat_list;
+typedef vector<pair<string, cl_vec>> vec_list;
+
+bool write_checkpoint(const string& fn, const mat_list& ms, const vec_list& vs) {
+	ckpt_header h;
+	memcpy(h.magic, CKPT_MAGIC, 4);
+	h.version = CKPT_VERSION;
+	h.count = ms.size() + vs.size();
+	h.pad = 0;
+
+	vector<ckpt_entry> e(h.count);
+	long long off = ckpt_align(sizeof(h) + h.count * sizeof(ckpt_entry));
+	for (int i=0; i<h.count; i++) {
+		bool mt = i < (int)ms.size();
+		const string& name = mt ? ms[i].first : vs[i - ms.size()].first;
+		memset(e[i].name, 0, sizeof(e[i].name));
+		strncpy(e[i].name, name.c_str(), sizeof(e[i].name) - 1);
+		e[i].rows = mt ? ms[i].second.rows() : vs[i - ms.size()].second.size();
+		e[i].cols = mt ? ms[i].second.cols() : 1;
+		e[i].offset = off;
+		off = ckpt_align(off + (long long)e[i].rows * e[i].cols * sizeof(float));
+	}
+
+	string tmp = fn + ".tmp";
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if (!f)
+		return false;
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+		&& fwrite(e.data(), sizeof(ckpt_entry), h.count, f) == (size_t)h.count;
+	vector<float> buff;
+	for (int i=0; i<h.count && ok; i++) {
+		buff.resize((size_t)e[i].rows * e[i].cols);
+		if (i < (int)ms.size())
+			ms[i].second.read(buff.data());
+		else
+			vs[i - ms.size()].second.read(buff.data());
+		ok = fseek(f, e[i].offset, SEEK_SET) == 0
+			&& fwrite(buff.data(), sizeof(float), buff.size(), f) == buff.size();
+	}
+	ok = fclose(f) == 0 && ok;
+	if (ok)
+		ok = rename(tmp.c_str(), fn.c_str()) == 0;
+	else
+		remove(tmp.c_str());
+	return ok;
+}
+
+// Ring all-reduce preko POSIX deljene memorije. Svaki od size procesa
+// ima svoj deo od len float-ova i brojac zavrsenih koraka. Deo se deli
+// na size komada; u koraku s proces q dodaje komad q-1-s levog suseda
+// svom, kao da mu ga je levi poslao, pa posle size-1 koraka ima ceo zbir
+// komada q+1. Jos size-1 koraka prepisuje gotove komade od levog, i
+// tada svi imaju ceo prosek. Cita se samo deo levog suseda, pa se ceka
+// samo na susede.
+struct ring_slot {
+	atomic<long long> step;
+	// sta radnik javlja roditelju na kraju
+	double rate, check;
+	char pad[40];
+};
+
+class shm_ring {
+	string name;
+	int rank, size;
+	long long len, base;
+	size_t bytes;
+	bool owner;
+	char* map;
+	ring_slot* slots;
+	float* data;
+
+	void wait(int r, long long s) const {
+		while (slots[r].step.load(memory_order_acquire) < s)
+			sched_yield();
+	}
+
+	void publish(long long s) {
+		slots[rank].step.store(s, memory_order_release);
+	}
+
+public:
+	// roditelj (create) pravi segment, radnici ga samo otvaraju
+	shm_ring(const string& name, int rank, int size, long long len, bool create) :
+		name(name), rank(rank), size(size), len(len), base(0), owner(create)
+	{
+		bytes = size * sizeof(ring_slot) + size * len * sizeof(float);
+		int fd = shm_open(name.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+		if (fd < 0)
+			throw "cannot open shared memory";
+		if (create && ftruncate(fd, bytes) != 0) {
+			close(fd);
+			shm_unlink(name.c_str());
+			throw "cannot size shared memory";
+		}
+		void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) {
+			if (create)
+				shm_unlink(name.c_str());
+			throw "cannot map shared memory";
+		}
+		map = (char*)p;
+		slots = (ring_slot*)map;
+		data = (float*)(map + size * sizeof(ring_slot));
+		if (create)
+			for (int i=0; i<size; i++)
+				new (&slots[i]) ring_slot();
+	}
+
+	shm_ring(const shm_ring&) = delete;
+	shm_ring& operator= (const shm_ring&) = delete;
+
+	~shm_ring() {
+		munmap(map, bytes);
+		if (owner)
+			shm_unlink(name.c_str());
+	}
+
+	ring_slot& slot(int r) {
+		return slots[r];
+	}
+
+	// mesto za [off, off + n) ovog procesa, kad ga desni sused vise ne
+	// cita iz prethodne runde
+	float* acquire(long long off) {
+		wait((rank + 1) % size, base);
+		return data + rank * len + off;
+	}
+
+	// prosek [off, off + n) svih procesa, ostaje na mestu iz acquire()
+	void all_reduce(long long off, long long n) {
+		int N = size, q = rank, l = (q + N - 1) % N, r = (q + 1) % N;
+		float* me = data + q * len + off;
+		const float* left = data + l * len + off;
+		auto lo = [&](int c) { return n * ((c % N + N) % N) / N; };
+		auto hi = [&](int c) { return n * ((c % N + N) % N + 1) / N; };
+		publish(base + 1);
+		for (int s=0; s<N-1; s++) {
+			wait(l, base + 1 + s);
+			int c = q - 1 - s;
+			for (long long k=lo(c); k<hi(c); k++)
+				me[k] += left[k];
+			// komad je zbir svih, deli se pre nego sto ga drugi prepisu
+			if (s == N-2)
+				for (long long k=lo(c); k<hi(c); k++)
+					me[k] /= N;
+			publish(base + 2 + s);
+		}
+		for (int s=0; s<N-1; s++) {
+			// desni je procitao zbir koji se sad prepisuje
+			wait(l, base + N + s);
+			wait(r, base + 2 + s);
+			int c = q - s;
+			copy(left + lo(c), left + hi(c), me + lo(c));
+			publish(base + N + 1 + s);
+		}
+		base += 2*N - 1;
+	}
+};
+
+// tezine za evaluate(): kako su naucene, u polovinama ili u int8
+enum class precision { fp32, fp16, int8 };
+
+struct mnist_model {
+	cl_mat A, B;
+	cl_vec c, d;
+
+	cl_mat vA, vB;
+	cl_vec vc, vd;
+
+	cl_vec x, t;
+	cl_vec l, m, o, p;
+	cl_val q;
+
+	// pocetne tezine i maske dropout-a, sve na uredjaju
+	philox rng;
+
+	// serija od bs uzoraka, jedan po koloni; ista mreza je zapisana na
+	// traci pa se backward izvodi sam, out je softmax izlaza. sa drop > 0
+	// se skriveni sloj prorezuje na traci, takav korak se ne snima u graf
+	int bs;
+	cl_mat X, T;
+	cl_tape tp;
+	int out;
+
 	void mread(istream& is, mat& a) {
 		for (int i=0; i<a.rows(); i++)
 			for (int j=0; j<a.cols(); j++)
 				is >> a[i][j];
 	}
 
-	void vwrite(ostream& os, const vec& a) {
-		os.precision(10);
-		os << fixed;
-		for (float f : a)
-			os << f << ' ';
-	}
-
 	void vread(istream& is, vec& a) {
 		for (float& f : a)
 			is >> f;
 	}
 
+	// tezine i stanje optimizatora, po imenu
+	vector<pair<string, cl_mat*>> mats() {
+		return {{"A", &A}, {"B", &B}, {"vA", &vA}, {"vB", &vB}};
+	}
+
+	vector<pair<string, cl_vec*>> vecs() {
+		return {{"c", &c}, {"d", &d}, {"vc", &vc}, {"vd", &vd}};
+	}
+
+	thread saver;
+
+	void wait_save() {
+		if (saver.joinable())
+			saver.join();
+	}
+
+	// kopije na uredjaju su brze, citanje i upis idu na pozadinskoj niti
+	// dok trening nastavlja
 	void save(string fn) {
-		ofstream ofs(fn);
-		mwrite(ofs, A.get());
-		mwrite(ofs, B.get());
-		vwrite(ofs, c.get());
-		vwrite(ofs, d.get());
+		wait_save();
+		auto ms = make_shared<mat_list>();
+		auto vs = make_shared<vec_list>();
+		ms->reserve(4);
+		vs->reserve(4);
+		for (auto& a : mats())
+			ms->emplace_back(a.first, *a.second);
+		for (auto& v : vecs())
+			vs->emplace_back(v.first, *v.second);
+		saver = thread([fn, ms, vs]() {
+			if (!write_checkpoint(fn, *ms, *vs))
+				cerr << "checkpoint " << fn << " not saved\n";
+		});
 	}
 
 	void load(string fn) {
+		size_t len;
+		const char* s = map_file(fn, len);
+		if (!s)
+			throw "cannot open checkpoint";
+		ckpt_header h;
+		if (len < sizeof(h) || memcmp(s, CKPT_MAGIC, 4)) {
+			munmap((void*)s, len);
+			load_text(fn);
+			return;
+		}
+		memcpy(&h, s, sizeof(h));
+		if (h.version != CKPT_VERSION
+			|| len < sizeof(h) + h.count * sizeof(ckpt_entry))
+		{
+			munmap((void*)s, len);
+			throw "unsupported checkpoint";
+		}
+		madvise((void*)s, len, MADV_WILLNEED);
+
+		auto ms = mats();
+		auto vs = vecs();
+		const ckpt_entry* e = (const ckpt_entry*)(s + sizeof(h));
+		try {
+			for (int i=0; i<h.count; i++) {
+				string name(e[i].name, strnlen(e[i].name, sizeof(e[i].name)));
+				size_t size = (size_t)e[i].rows * e[i].cols;
+				if (e[i].offset < 0 || e[i].offset + size * sizeof(float) > len)
+					throw "bad checkpoint";
+				const float* data = (const float*)(s + e[i].offset);
+				for (auto& a : ms) {
+					if (a.first != name)
+						continue;
+					if (a.second->rows() != e[i].rows || a.second->cols() != e[i].cols)
+						throw "checkpoint size mismatch";
+					a.second->write(data);
+				}
+				for (auto& v : vs) {
+					if (v.first != name)
+						continue;
+					if (v.second->size() != e[i].rows || e[i].cols != 1)
+						throw "checkpoint size mismatch";
+					v.second->write(data);
+				}
+			}
+		} catch (...) {
+			munmap((void*)s, len);
+			throw;
+		}
+		munmap((void*)s, len);
+	}
+
+	// stari tekstualni format, samo tezine
+	void load_text(string fn) {
 		ifstream ifs(fn);
 
 		mat AA = A.get();
@@ -133,7 +774,7 @@ struct mnist_model {
 		d.set(dd);
 	}
 
-	mnist_model() :
+	mnist_model(int bs = 1, float drop = 0) :
 		A(ct.mat(800, 784)),
 		B(ct.mat(10, 800)),
 		c(ct.vec(800)),
@@ -147,24 +788,51 @@ struct mnist_model {
 		x(ct.vec(784)),
 		t(ct.vec(10)),
 
-		k(ct.vec(800)),
 		l(ct.vec(800)),
 		m(ct.vec(800)),
-		n(ct.vec(10)),
 		o(ct.vec(10)),
 		p(ct.vec(10)),
 
-		q(ct.val(0))
+		q(ct.val(0)),
+
+		rng{3211, 0},
+
+		bs(bs),
+		X(ct.mat(784, bs)),
+		T(ct.mat(10, bs))
 	{
-		A.set(random_mat(800, 784, -0.01, 0.01));
-		B.set(random_mat(10, 800, -0.01, 0.01));
-		c.set(random_vec(800, -0.01, 0.01));
-		d.set(random_vec(10, -0.01, 0.01));
+		rng.uniform(A, -0.01, 0.01);
+		rng.uniform(B, -0.01, 0.01);
+		rng.uniform(c, -0.01, 0.01);
+		rng.uniform(d, -0.01, 0.01);
+
+		rng.uniform(vA, 0, 0);
+		rng.uniform(vB, 0, 0);
+		rng.uniform(vc, 0, 0);
+		rng.uniform(vd, 0, 0);
+
+		out = record(tp, drop, true);
+	}
 
-		vA.set(random_mat(800, 784, 0, 0));
-		vB.set(random_mat(10, 800, 0, 0));
-		vc.set(random_vec(800, 0, 0));
-		vd.set(random_vec(10, 0, 0));
+	// mreza na traci t, vraca softmax izlaza. sa momentum se parametri
+	// menjaju vec u backward(opt); bez njega gradijenti ostaju na traci,
+	// a params dobija cvorove A, c, B, d tim redom
+	int record(cl_tape& t, float drop, bool momentum, vector<int>* params = NULL) {
+		int pA = momentum ? t.param(A, vA) : t.param(A);
+		int pc = momentum ? t.param(c, vc) : t.param(c);
+		int pB = momentum ? t.param(B, vB) : t.param(B);
+		int pd = momentum ? t.param(d, vd) : t.param(d);
+		if (params)
+			*params = {pA, pc, pB, pd};
+		int h = t.dense(pA, t.input(X), pc, act::tanh);
+		if (drop > 0)
+			h = t.dropout(h, drop, rng);
+		int o = t.dense(pB, h, pd, act::identity);
+		return t.softmax_xent(o, t.input(T));
+	}
+
+	~mnist_model() {
+		wait_save();
 	}
 
 	void check_matrix(cl_mat& a) {
@@ -192,63 +860,88 @@ struct mnist_model {
 		cerr << "span: " << lo << ' ' << hi << '\n';
 	}
 
-	float feed_forward(pair<vec, vec> data) {
-		x.set(data.first);
-		t.set(data.second);
+	void feed_forward(const cl_dataset& data, int i) {
+		data.batch(i, x, t);
+		feed_forward();
+	}
 
-		k = A.dot(x);
-		l = k + c;
-		m = tanh(l);
-		n = B.dot(m);
-		o = n + d;
+	void feed_forward() {
+		m = A.dense(x, c, act::tanh, &l);
+		o = B.dense(m, d, act::identity);
 		p = softmax(o);
 		q = p.dot(t);
-
-		return q.get();
 	}
 
-	cl_vec softmax(const cl_vec& o) {
-		cl_vec tmp = exp(o);
-		return tmp / tmp.sum();
+	// cela baza u serijama od bs uzoraka, redom; softmax ne menja argmax
+	// pa se preskace, na host se cita samo matrica konfuzije. sa fp16 se
+	// tezine jednom prepisu u polovine, racun ostaje u fp32. sa int8 se
+	// kvantizuje samo A, prvi sloj cita bajtove piksela direktno iz baze
+	// i sabira u int32; B je oko 1% racuna i ostaje u fp32
+	vector<int> evaluate(cl_dataset& data, int bs,
+		precision pr = precision::fp32
+	) {
+		auto xb = ct.mat(784, bs);
+		auto tb = ct.mat(10, bs);
+		auto hb = ct.mat(800, bs);
+		vector<cl_hmat> h;
+		vector<cl_qmat> qa;
+		h.reserve(2);
+		if (pr == precision::fp16) {
+			h.push_back(ct.half(A));
+			h.push_back(ct.half(B));
+		}
+		if (pr == precision::int8)
+			qa.push_back(ct.quantize(A));
+		data.clear_counts();
+		for (int i=0; i<data.size(); i+=bs) {
+			int k = min(bs, data.size() - i);
+			if (pr == precision::int8) {
+				auto hv = hb.cols(0, k);
+				qa[0].dense(data, i, c, act::tanh, hv);
+				data.count(i, B.dense(hv, d, act::identity));
+				continue;
+			}
+			auto xv = xb.cols(0, k);
+			auto tv = tb.cols(0, k);
+			data.batch(i, xv, tv);
+			if (pr == precision::fp16)
+				data.count(i, h[1].dense(h[0].dense(xv, c, act::tanh), d, act::identity));
+			else
+				data.count(i, B.dense(A.dense(xv, c, act::tanh), d, act::identity));
+		}
+		return data.counts();
 	}
 
-	cl_vec softmax_jacobian_dot(cl_vec& o, cl_vec& t) {
-		auto s = softmax(o);
-		return s * t - s * (s.dot(t));
+	// isto za seriju, gradijenti su zbir po seriji, kao bs koraka sa po
+	// jednim uzorkom
+	void feed_forward_batch(const cl_dataset& data, int i) {
+		data.batch(i, X, T);
+		tp.forward();
 	}
 
-	// maksimizujemo q pa je zato + gradijent
-	void back_propagate(float rate, float reg, float momentum_gamma) {
-		auto g1 = ct.vec(10);
-		auto g2 = ct.vec(800);
-		auto g3 = ct.vec(784);
-		auto e = ct.val(rate);
-		auto rg = ct.val(1.0f - reg);
-		auto mg = ct.val(momentum_gamma);
-
-		g1 = t / (p + ct.val(1e-4)); // extract this as a parameter maybe?
-		g1 = softmax_jacobian_dot(o, g1);
-
-		vd = vd * mg + g1 * e;
-		d += vd;
+	void back_propagate_batch(float rate, float reg, float momentum_gamma) {
+		sgd opt = {rate, momentum_gamma, reg};
+		tp.backward(opt);
+	}
 
-		g2 = B.T().dot(g1);
+	// verovatnoca tacne klase za svaki uzorak serije
+	cl_vec gain() const {
+		return (tp.value(out) * T).col_sums();
+	}
 
-		vB = vB * mg + g1.outer(m) * e;
-		B += vB;
+	// g1 je gradijent cross entropy, optimizator ide u suprotnom smeru
+	void back_propagate(float rate, float reg, float momentum_gamma) {
+		sgd opt = {rate, momentum_gamma, reg};
 
+		auto g1 = p.softmax_xent_d(t);
+		auto g2 = ct.vec(800);
+		g2.gemv(1, B, true, g1, 0);
 		g2 *= tanh_d(l);
 
-		vc = vc * mg + g2 * e;
-		c +=  vc;
-
-		vA = vA * mg + g2.outer(x) * e;
-		A += vA;
-
-		A *= rg;
-		B *= rg;
-		c *= rg;
-		d *= rg;
+		opt.step(d, vd, g1);
+		opt.step(B, vB, g1, m);
+		opt.step(c, vc, g2);
+		opt.step(A, vA, g2, x);
 	}
 
 	void print_diag() {
@@ -270,15 +963,24 @@ struct mnist_model {
 
 }
 
-void train() {
+// batch uzoraka po koraku; gradijent je zbir po seriji pa stopa ucenja
+// ostaje ista, a regularizacija se skalira jer ima manje koraka. Serije
+// pripremaju niti u pozadini dok uredjaj racuna; sa shift_px > 0 se
+// slike nasumicno pomeraju za najvise toliko piksela
+void train(int batch = 32, int shift_px = 0) {
 	srand(3211);
 	cerr << setw(9) << fixed;
 	using namespace mnist;
-	auto r = preprocess(read_data("mnist_train.csv"));
-	cerr << "testcases: " << r.size() << '\n';
-	random_shuffle(r.begin(), r.end());
-
-	mnist_model model;
+	stopwatch sw(0);
+	auto data = read_data("mnist_train.csv");
+	sw.tock();
+	cerr << "testcases: " << data.n << '\n';
+	vector<stage> stages;
+	if (shift_px)
+		stages.push_back(shift(shift_px));
+	batch_pipeline r(data, batch, stages);
+
+	mnist_model model(batch);
 	// model.load("model_main");
 
 	// {
@@ -286,40 +988,265 @@ void train() {
 	// 	cl_vec w = ct.vec(3);
 	// 	t.set({-1, 0, 2});
 	// 	w.set({1, 10, 100});
-	// 	cerr << model.softmax_jacobian_dot(t, w).get() << '\n';
+	// 	cerr << softmax(t).softmax_d(w).get() << '\n';
 	// }
 
-	int acc_acc = 0;
+	int acc_acc = 0, cnt = 0;
 	float gain_acc = 0;
 
-	for (int i=0; i<600000; i++) {
-		model.feed_forward(r[i % r.size()]);
-		model.back_propagate(3e-3, 3e-5, 0.9);
-		float t = model.q.get();
-		gain_acc += t;
-		if (t > 0.5f) {
-			acc_acc++;
+	// prva dva koraka odrede bafere, posle se koraci izvode bez alokacija
+	auto ws = ct.workspace();
+	// korak posle ucitavanja serije se snimi jednom, posle se samo
+	// ponavlja; X i T ostaju isti baferi
+	auto step = ct.graph();
+	auto gain = ct.vec(batch);
+
+	sw.tick();
+	for (int i=0; i<600000; i+=batch) {
+		if (i % r.size() < batch) {
+			// cuvanje ide u pozadini, trening ne ceka
+			if (i)
+				model.save("model_momentum_log");
 		}
-		if (i % 501 == 0) {
+		ws.begin();
+		r.pop(model.X, model.T);
+		if (step.empty()) {
+			step.begin();
+			model.tp.forward();
+			model.back_propagate_batch(3e-3, 3e-5 * batch, 0.9);
+			gain = model.gain();
+			step.end();
+		} else {
+			step.replay();
+		}
+		auto g = gain.get();
+		ws.end();
+		for (float t : g) {
+			gain_acc += t;
+			if (t > 0.5f) {
+				acc_acc++;
+			}
+		}
+		cnt += batch;
+		if (cnt >= 500) {
 			cerr << "epoch: " << i << '\n';
-			cerr << "acc_acc: " << acc_acc << '\n';
-			cerr << "gain_acc: " << gain_acc / 501 << '\n';
+			cerr << "acc_acc: " << acc_acc << "/" << cnt << '\n';
+			cerr << "gain_acc: " << gain_acc / cnt << '\n';
+			cerr << "samples/s: " << cnt / sw.elapsed() << '\n';
+			sw.tick();
 			acc_acc = 0;
 			gain_acc = 0;
-			model.print_diag();
+			cnt = 0;
 		}
 	}
 
+	if (ws.misses())
+		cerr << "allocations after the first step: " << ws.misses() << '\n';
 	model.save("model_momentum_log");
 }
 
+// Jedan od size procesa za train_parallel(), sa svojim kontekstom (i
+// uredjajem, IOPP_DEVICE) i svojim serijama: korak s uzima seriju
+// s*size + rank. Gradijenti ostaju na traci; cim je jedan gotov, nit
+// za komunikaciju ga cita u deljenu memoriju, uprosecuje sa ostalima i
+// vraca na uredjaj dok se ostatak backward-a jos racuna. Korak
+// optimizatora ceka sve gradijente, pa su tezine svuda iste.
+int worker(int rank, int size, const char* name, int batch, int steps) {
+	srand(3211);
+	using namespace mnist;
+	auto r = upload(read_data("mnist_train.csv"));
+	mnist_model model(batch);
+	cl_tape tp;
+	vector<int> params;
+	int out = model.record(tp, 0, false, &params);
+
+	// A, c, B, d jedan za drugim
+	vector<cl_mat> avg;
+	avg.push_back(ct.mat(800, 784));
+	avg.push_back(ct.mat(800, 1));
+	avg.push_back(ct.mat(10, 800));
+	avg.push_back(ct.mat(10, 1));
+	vector<long long> off = {0};
+	for (auto& a : avg)
+		off.push_back(off.back() + a.rows() * a.cols());
+	shm_ring ring(name, rank, size, off.back(), false);
+
+	mutex m;
+	condition_variable cv;
+	deque<pair<int, const cl_mat*>> todo;
+	int reduced = 0;
+	bool quit = false;
+	const char* err = NULL;
+	thread comm([&]() {
+		unique_lock<mutex> g(m);
+		for (;;) {
+			cv.wait(g, [&]() { return quit || !todo.empty(); });
+			if (quit)
+				return;
+			auto k = todo.front();
+			todo.pop_front();
+			g.unlock();
+			try {
+				int i = k.first;
+				float* p = ring.acquire(off[i]);
+				k.second->read(p);
+				ring.all_reduce(off[i], off[i+1] - off[i]);
+				avg[i].write(p);
+			} catch (const char* e) {
+				err = e;
+			}
+			g.lock();
+			reduced++;
+			cv.notify_all();
+		}
+	});
+
+	sgd opt = {3e-3, 0.9, 3e-5f * batch};
+	int acc_acc = 0, cnt = 0;
+	stopwatch sw(0);
+	try {
+		for (int s=0; s<=steps; s++) {
+			// prvi korak pravi plan trake, ne meri se
+			if (s == 1) {
+				ct.finish();
+				sw.tick();
+			}
+			long long i = (long long)s * size * batch;
+			if (i % r.size() < size * batch)
+				r.shuffle();
+			r.batch((i + rank * batch) % r.size(), model.X, model.T);
+			tp.forward();
+			tp.backward([&](int p) {
+				int k = find(params.begin(), params.end(), p) - params.begin();
+				lock_guard<mutex> g(m);
+				todo.push_back({k, &tp.grad(p)});
+				cv.notify_all();
+			});
+			{
+				unique_lock<mutex> g(m);
+				cv.wait(g, [&]() { return reduced == 4; });
+				reduced = 0;
+			}
+			if (err)
+				throw err;
+			opt.step(model.A, model.vA, avg[0]);
+			opt.step(model.c, model.vc, avg[1].col(0));
+			opt.step(model.B, model.vB, avg[2]);
+			opt.step(model.d, model.vd, avg[3].col(0));
+
+			if (rank == 0 && s % 20 == 0) {
+				for (float t : (tp.value(out) * model.T).col_sums().get())
+					acc_acc += t > 0.5f;
+				cnt += batch;
+				if (cnt >= 500) {
+					cerr << "step: " << s << ", acc_acc: " << acc_acc << "/" << cnt << '\n';
+					acc_acc = cnt = 0;
+				}
+			}
+		}
+		ct.finish();
+	} catch (...) {
+		{
+			lock_guard<mutex> g(m);
+			quit = true;
+		}
+		cv.notify_all();
+		comm.join();
+		throw;
+	}
+	double t = sw.elapsed();
+	{
+		lock_guard<mutex> g(m);
+		quit = true;
+	}
+	cv.notify_all();
+	comm.join();
+
+	// isti koraci na svim procesima daju iste tezine
+	double check = 0;
+	auto A = model.A.get();
+	for (int i=0; i<A.rows(); i++)
+		for (int j=0; j<A.cols(); j++)
+			check += A[i][j] * (1 + (i + j) % 7);
+	ring.slot(rank).rate = steps * batch / t;
+	ring.slot(rank).check = check;
+	return 0;
+}
+
+// workers procesa na jednoj masini, svaki uzima svoje serije; posle
+// svakog koraka se gradijenti uprosecuju. meri se protok za 1, 2, 4, ...
+// procesa do workers
+void train_parallel(int workers = 4, int batch = 32, int steps = 1000) {
+	using namespace mnist;
+	// serija parametara kao u worker()
+	long long len = 800 * 784 + 800 + 10 * 800 + 10;
+	for (int n=1; n<=workers; n*=2) {
+		string name = "/iopp_mnist_" + to_string(getpid()) + "_" + to_string(n);
+		shm_ring ring(name, 0, n, len, true);
+
+		vector<pid_t> pids;
+		bool failed = false;
+		for (int k=0; k<n; k++) {
+			vector<string> args = {"/proc/self/exe", "--worker", to_string(k),
+				to_string(n), name, to_string(batch), to_string(steps)};
+			// proces k uzima uredjaj k, ukrug ako ih ima manje
+			vector<string> env;
+			for (char** e = environ; *e; e++)
+				if (strncmp(*e, "IOPP_DEVICE=", 12))
+					env.push_back(*e);
+			env.push_back("IOPP_DEVICE=" + to_string(k));
+			vector<char*> argv, envp;
+			for (auto& a : args)
+				argv.push_back(&a[0]);
+			for (auto& e : env)
+				envp.push_back(&e[0]);
+			argv.push_back(NULL);
+			envp.push_back(NULL);
+			pid_t pid;
+			if (posix_spawn(&pid, argv[0], NULL, NULL, argv.data(), envp.data())) {
+				failed = true;
+				break;
+			}
+			pids.push_back(pid);
+		}
+		// ako jedan padne ostali bi cekali zauvek
+		for (int left = pids.size(); left > 0; left--) {
+			int st;
+			pid_t p = failed ? -1 : wait(&st);
+			if (p < 0 || !WIFEXITED(st) || WEXITSTATUS(st)) {
+				failed = true;
+				for (pid_t q : pids)
+					kill(q, SIGKILL);
+				while (wait(&st) > 0)
+					;
+				break;
+			}
+		}
+		if (failed) {
+			cerr << "workers: " << n << " failed\n";
+			continue;
+		}
+
+		double rate = 0;
+		bool same = true;
+		for (int k=0; k<n; k++) {
+			rate += ring.slot(k).rate;
+			same = same && ring.slot(k).check == ring.slot(0).check;
+		}
+		cerr << "workers: " << n << ", samples/s: " << (int)rate << " ("
+			<< (int)(rate / n) << " per worker), weights "
+			<< (same ? "equal" : "differ") << '\n';
+	}
+}
+
 void train_degenerate() {
 	srand(3211);
 	cerr << setw(9) << fixed;
 	using namespace mnist;
-	auto r = preprocess(read_data("mnist_train.csv"));
+	stopwatch sw(0);
+	auto r = upload(read_data("mnist_train.csv"));
+	sw.tock();
 	cerr << "testcases: " << r.size() << '\n';
-	random_shuffle(r.begin(), r.end());
 
 	mnist_model model;
 	// model.load("model_main");
@@ -329,15 +1256,19 @@ void train_degenerate() {
 	// 	cl_vec w = ct.vec(3);
 	// 	t.set({-1, 0, 2});
 	// 	w.set({1, 10, 100});
-	// 	cerr << model.softmax_jacobian_dot(t, w).get() << '\n';
+	// 	cerr << softmax(t).softmax_d(w).get() << '\n';
 	// }
 
 	int acc_acc = 0;
 	float gain_acc = 0;
+	auto ws = ct.workspace();
 
+	r.shuffle();
 	for (int i=0; i<300000; i++) {
-		model.feed_forward(r[i % 1000]);
+		ws.begin();
+		model.feed_forward(r, i % 1000);
 		model.back_propagate(1e-2, 1e-4, 0.9);
+		ws.end();
 		float t = model.q.get();
 		gain_acc += t;
 		if (t > 0.5f) {
@@ -353,50 +1284,161 @@ void train_degenerate() {
 		}
 	}
 
+	if (ws.misses())
+		cerr << "allocations after the first step: " << ws.misses() << '\n';
 	model.save("model_alt");
 }
 
-void test() {
+void test(int batch = 1000) {
 	using namespace mnist;
 
 	mnist_model model;
 	model.load("model_momentum_log");
 
-	int acc_acc = 0;
-
-	auto r = preprocess(read_data("mnist_test.csv"));
-
-	vector<vector<int>> confusion(10, vector<int>(10, 0));
-
-	for (int i=0; i<(int)r.size(); i++) {
-		model.feed_forward(r[i]);
-		auto d1 = model.p.get();
-		auto d2 = r[i].second;
-		int y = max_element(d1.begin(), d1.end()) - d1.begin();
-		int t = max_element(d2.begin(), d2.end()) - d2.begin();
-
-		if (y == t) {
-			acc_acc++;
-		}
+	auto data = read_data("mnist_test.csv");
+	auto r = upload(data);
 
-		confusion[y][t]++;
+	// bez shuffle() redosled je originalni
+	stopwatch sw(0);
+	auto confusion = model.evaluate(r, batch);
+	double t32 = sw.elapsed();
 
-		if (i % 501 == 0) {
-			cerr << "accuracy: " << acc_acc << "/" << i+1 << '\n';
-		}
-	}
+	int acc_acc = 0;
+	for (int i=0; i<10; i++)
+		acc_acc += confusion[i*10 + i];
 
 	cerr << "accuracy: " << acc_acc << "/" << r.size() << '\n';
 
 	for (int i=0; i<10; i++) {
 		for (int j=0; j<10; j++)
-			cerr << setw(5) << confusion[i][j] << ' ';
+			cerr << setw(5) << confusion[i*10 + j] << ' ';
 		cerr << '\n';
 	}
 
+	// iste tezine u fp16 i int8, tacnost i uzoraka u sekundi
+	const char* names[] = {"fp32", "fp16", "int8"};
+	for (int p=0; p<3; p++) {
+		sw.tick();
+		auto cf = p ? model.evaluate(r, batch, (precision)p) : confusion;
+		double t = p ? sw.elapsed() : t32;
+		int acc = 0;
+		for (int i=0; i<10; i++)
+			acc += cf[i*10 + i];
+		cerr << names[p] << " accuracy: " << acc << "/" << r.size()
+			<< " (" << showpos << acc - acc_acc << noshowpos << "), "
+			<< (int)(r.size() / t) << " samples/s\n";
+	}
+
+	// isto na procesoru, prvi sloj u int8 sa dot_u8i8 protiv fp32
+	int n = min(1000, data.n), agree = 0;
+	auto A = model.A.get(), B = model.B.get();
+	auto c = model.c.get(), d = model.d.get();
+	la::qmat qa(A);
+	la::vec x(784);
+	vector<int> y32(n);
+	sw.tick();
+	for (int i=0; i<n; i++) {
+		for (int k=0; k<784; k++)
+			x[k] = data.x[i*784 + k] / 256.0f;
+		auto h = A.dot(x) + c;
+		for (int k=0; k<800; k++)
+			h[k] = tanh(h[k]);
+		auto o = B.dot(h) + d;
+		y32[i] = max_element(&o[0], &o[0] + 10) - &o[0];
+	}
+	double c32 = sw.elapsed();
+	sw.tick();
+	for (int i=0; i<n; i++) {
+		auto h = qa.dot(data.x + i*784, 1 / 256.0f) + c;
+		for (int k=0; k<800; k++)
+			h[k] = tanh(h[k]);
+		auto o = B.dot(h) + d;
+		agree += max_element(&o[0], &o[0] + 10) - &o[0] == y32[i];
+	}
+	double c8 = sw.elapsed();
+	cerr << "cpu fp32: " << (int)(n / c32) << " samples/s, int8: "
+		<< (int)(n / c8) << " samples/s, same class " << agree << "/"
+		<< n << '\n';
 }
 
-int main() {
+// vreme koraka serije, traka protiv rucno izvedenog backward-a
+void bench(int batch = 32, int steps = 200) {
+	srand(3211);
+	using namespace mnist;
+	auto r = upload(read_data("mnist_train.csv"));
+	mnist_model model(batch);
+	stopwatch sw(0);
+
+	auto L = ct.mat(800, batch), M = ct.mat(800, batch), P = ct.mat(10, batch);
+	auto manual = [&](int i) {
+		auto& m = model;
+		sgd opt = {3e-3, 0.9, 3e-5f * batch};
+		r.batch(i, m.X, m.T);
+		M = m.A.dense(m.X, m.c, act::tanh, &L);
+		P = softmax(m.B.dense(M, m.d, act::identity));
+
+		auto g1 = P.softmax_xent_d(m.T);
+		auto g2 = ct.mat(800, batch);
+		g2.gemm(1, m.B, true, g1, false, 0);
+		g2 *= tanh_d(L);
+		auto gB = ct.mat(10, 800);
+		gB.gemm(1, g1, false, M, true, 0);
+		auto gA = ct.mat(800, 784);
+		gA.gemm(1, g2, false, m.X, true, 0);
+
+		opt.step(m.d, m.vd, g1.row_sums());
+		opt.step(m.B, m.vB, gB);
+		opt.step(m.c, m.vc, g2.row_sums());
+		opt.step(m.A, m.vA, gA);
+	};
+
+	// treci put se korak trake snimi i ponavlja
+	auto step = ct.graph();
+	const char* names[] = {"manual: ", "tape: ", "graph: "};
+	for (int k=0; k<3; k++) {
+		// prvi korak pravi plan i bafere, ne meri se
+		for (int i=0; i<=steps*batch; i+=batch) {
+			if (i == batch) {
+				ct.finish();
+				sw.tick();
+			}
+			if (k == 0) {
+				manual(i);
+			} else if (k == 1) {
+				model.feed_forward_batch(r, i);
+				model.back_propagate_batch(3e-3, 3e-5 * batch, 0.9);
+			} else {
+				r.batch(i, model.X, model.T);
+				if (step.empty()) {
+					step.begin();
+					model.tp.forward();
+					model.back_propagate_batch(3e-3, 3e-5 * batch, 0.9);
+					step.end();
+				} else {
+					step.replay();
+				}
+			}
+		}
+		ct.finish();
+		cerr << names[k] << sw.elapsed() * 1000 / steps
+			<< " ms/step, batch " << batch << '\n';
+	}
+	cerr << "tape buffers: " << model.tp.bytes() << " bytes\n";
+}
+
+int main(int argc, char** argv) {
+	// proces koji je pokrenuo train_parallel()
+	if (argc == 7 && !strcmp(argv[1], "--worker")) {
+		try {
+			return worker(atoi(argv[2]), atoi(argv[3]), argv[4],
+				atoi(argv[5]), atoi(argv[6]));
+		} catch (const char* e) {
+			cerr << "worker " << argv[2] << ": " << e << '\n';
+			return 1;
+		}
+	}
 	// train();
+	// train_parallel();
+	// bench();
 	test();
 }
\ No newline at end of file
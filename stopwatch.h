@@ -11,10 +11,15 @@ struct stopwatch {
 		last_tick = std::chrono::high_resolution_clock::now();
 	}
 
-	void tock() const {
+	// seconds since the last tick()
+	double elapsed() const {
 		std::chrono::duration<double> dur =
 			std::chrono::high_resolution_clock::now() - last_tick;
-		std::cerr << "Time: " << dur.count() << '\n';
+		return dur.count();
+	}
+
+	void tock() const {
+		std::cerr << "Time: " << elapsed() << '\n';
 	}
 
 	stopwatch() {
@@ -4,6 +4,7 @@
 #include <numeric>
 #include <algorithm>
 #include <cmath>
+#include <thread>
 // using namespace iopp;
 
 auto ct = iopp::opencl_context();
@@ -54,6 +55,12 @@ void compile_check() {
 		v.set(w);
 		auto f = (v.dot(v)).get();
 		std::cerr << "suma: " << f << '\n';
+
+		// the sum stays on the device until get()
+		auto s = v.sum();
+		auto u = v / s;
+		u *= s;
+		std::cerr << "suma: " << s.get() << ' ' << u.sum().get() << '\n';
 	}
 
 	{
@@ -72,6 +79,336 @@ void compile_check() {
 		b.set({91, 108, -44});
 		std::cerr << a.outer(b).get() << '\n';
 	}
+
+	{
+		auto a = ct.mat(3, 2);
+		auto y = ct.mat(3, 2);
+		auto s = ct.mat(3, 2);
+		auto g = ct.mat(3, 2);
+		a.set({{1, -100}, {2, 0}, {3, 100}});
+		y.set({{0, 0}, {0, 1}, {1, 0}});
+		auto l = a.softmax_xent(y, s, g);
+		std::cerr << s.get() << g.get() << "loss: " << l.get() << '\n';
+		std::cerr << iopp::log_softmax(a).get() << '\n';
+	}
+
+	{
+		auto a = ct.mat(2, 3);
+		auto x = ct.vec(3);
+		auto b = ct.vec(2);
+		auto z = ct.vec(2);
+		a.set({{1, 2, 3}, {-4, -5, -6}});
+		x.set({1, 1, 1});
+		b.set({0.5, 0.5});
+		auto y = a.dense(x, b, iopp::act::relu, &z);
+		std::cerr << y.get() << ' ' << z.get() << '\n';
+	}
+
+	{
+		auto p = ct.mat(2, 2);
+		auto v = ct.mat(2, 2);
+		auto u = ct.vec(2);
+		auto w = ct.vec(2);
+		p.set({{1, 1}, {1, 1}});
+		v.set({{0, 0}, {0, 0}});
+		u.set({1, 2});
+		w.set({3, 4});
+		iopp::sgd opt = {0.1, 0.9, 0.5};
+		opt.step(p, v, u, w);
+		std::cerr << p.get() << v.get() << '\n';
+	}
+
+	{
+		// views write through to a
+		auto a = ct.mat(3, 4);
+		a.set({{1, 2, 3, 4}, {5, 6, 7, 8}, {9, 10, 11, 12}});
+		auto b = a.block(1, 1, 2, 2);
+		b *= ct.val(10);
+		a.row(0) += a.row(2);
+		a.col(3).slice(1, 2) = a.cols(0, 2).row(1).slice(0, 2);
+		std::cerr << a.get() << b.get() << b.T().get() << '\n';
+		auto x = ct.vec(2);
+		x.gemv(1, a.block(0, 1, 2, 3), false, a.row(2).slice(0, 3), 0);
+		std::cerr << x.get() << a.cols(1, 2).dot(b).get() << '\n';
+	}
+
+	{
+		unsigned char x[] = {0, 64, 128, 192, 255, 32};
+		int y[] = {2, 0, 1};
+		auto ds = ct.dataset(3, 2, 3, x, y, 1.0f / 256);
+		auto b = ct.mat(2, 4);
+		auto t = ct.mat(3, 4);
+		ds.shuffle();
+		ds.batch(1, b, t);
+		std::cerr << b.get() << t.get() << '\n';
+		// one-hot labels score as a diagonal
+		ds.count(1, t);
+		for (int c : ds.counts())
+			std::cerr << c << ' ';
+		std::cerr << '\n';
+	}
+
+	{
+		auto a = ct.mat(2, 3);
+		auto b = ct.vec(2);
+		auto c = ct.vec(3);
+		a.set({{1, 2, 3}, {4, 5, 6}});
+		b.set({10, 20});
+		c.set({1, 1, 1});
+		a.add_col(1, b).add_row(-1, c);
+		std::cerr << a.get() << a.row_sums().get() << ' ' << a.col_sums().get() << '\n';
+		std::cerr << iopp::tanh(a.cols(0, 1)).get() << '\n';
+	}
+
+	{
+		auto a = ct.mat(2, 3);
+		auto b = ct.vec(2);
+		a.set({{1, 5, 3}, {4, 2, 6}});
+		b.set({1, 2});
+		a = a * iopp::by_col(b) - iopp::by_row(a.col_means());
+		a /= iopp::by_col(a.row_max());
+		std::cerr << a.get() << a.row_argmax().get() << ' ' << a.col_argmax().get() << '\n';
+	}
+
+	{
+		// raw transfers are in device order, column by column
+		float x[] = {1, 2, 3, 4, 5, 6}, y[4];
+		auto a = ct.mat(2, 3);
+		a.write(x);
+		a.cols(1, 2).read(y);
+		std::cerr << a.get() << y[0] << ' ' << y[3] << ' ' << a.rows() << a.cols() << '\n';
+	}
+
+	{
+		auto w = ct.mat(2, 3);
+		auto b = ct.vec(2);
+		auto x = ct.mat(3, 2);
+		auto y = ct.mat(2, 2);
+		w.set({{1, 0, -1}, {0.5, 0.5, 0.5}});
+		b.set({0.1, -0.1});
+		x.set({{1, 2}, {3, 4}, {5, 6}});
+		y.set({{1, 0}, {0, 1}});
+		iopp::cl_tape tp;
+		int pw = tp.param(w), pb = tp.param(b);
+		int h = tp.tanh(tp.add_col(tp.matmul(pw, tp.input(x)), pb));
+		int l = tp.softmax_xent(h, tp.input(y));
+		tp.forward();
+		tp.backward();
+		std::cerr << tp.value(l).get() << tp.grad(pw).get() << tp.grad(pb).get() << '\n';
+	}
+
+	{
+		// ready reports each parameter once its gradient is final
+		auto w = ct.mat(2, 2);
+		auto y = ct.mat(2, 2);
+		w.set({{1, 2}, {3, 4}});
+		y.set({{1, 0}, {0, 1}});
+		iopp::cl_tape tp;
+		int pw = tp.param(w);
+		tp.softmax_xent(tp.mul(pw, pw), tp.input(y));
+		tp.forward();
+		tp.backward([&](int i) { std::cerr << (i == pw) << ' ' << tp.grad(i).get() << '\n'; });
+	}
+
+	{
+		// tape and hand-written gradients of one batch, side by side
+		auto w = ct.mat(2, 3);
+		auto b = ct.vec(2);
+		auto x = ct.mat(3, 2);
+		auto y = ct.mat(2, 2);
+		w.set({{1, 0, -1}, {0.5, -0.5, 0.25}});
+		b.set({0.1, -0.2});
+		x.set({{1, 2}, {-3, 4}, {1, -2}});
+		y.set({{1, 0}, {0, 1}});
+		iopp::cl_tape tp;
+		int pw = tp.param(w), pb = tp.param(b);
+		int z = tp.add_col(tp.matmul(pw, tp.input(x)), pb);
+		int o = tp.add_col(tp.mul(tp.tanh(z), tp.relu(z)), pb);
+		tp.softmax_xent(o, tp.input(y));
+		tp.forward();
+		tp.backward();
+
+		auto zm = ct.mat(2, 2);
+		zm.gemm(1, w, false, x, false, 0);
+		zm.add_col(1, b);
+		auto h1 = iopp::tanh(zm), h2 = iopp::relu(zm);
+		auto om = h1 * h2;
+		om.add_col(1, b);
+		auto go = om.softmax().softmax_xent_d(y);
+		auto gz = go * h2 * iopp::tanh_d(zm) + go * h1 * iopp::relu_d(zm);
+		auto gw = ct.mat(2, 3);
+		gw.gemm(1, gz, false, x, true, 0);
+		auto gb = gz.row_sums() + go.row_sums();
+		std::cerr << tp.grad(pw).get() << gw.get() << '\n'
+			<< tp.grad(pb).get() << gb.get() << '\n';
+	}
+
+	{
+		// after two steps the temporaries come from the arena
+		auto a = ct.vec(5);
+		auto ws = ct.workspace(true);
+		a.set({1, 2, 3, 4, 5});
+		for (int i=0; i<4; i++) {
+			ws.begin();
+			a = a * a / (a + a);
+			ws.end();
+		}
+		std::cerr << a.get() << ' ' << ws.allocations() << ' ' << ws.misses() << '\n';
+	}
+
+	{
+		// replayed with no host work, x rebound to y
+		auto x = ct.mat(2, 2);
+		auto y = ct.mat(2, 2);
+		auto z = ct.mat(2, 2);
+		x.set({{1, 2}, {3, 4}});
+		y.set({{-1, 0}, {0, -1}});
+		auto g = ct.graph();
+		int in = g.input(x);
+		g.begin();
+		z.gemm(1, x, true, x, false, 0);
+		z += x;
+		g.end();
+		g.replay();
+		std::cerr << z.get();
+		g.bind(in, y);
+		g.replay();
+		std::cerr << z.get() << g.size() << '\n';
+	}
+
+	{
+		// stored in halves, computed in fp32
+		auto a = ct.mat(2, 3);
+		auto x = ct.mat(3, 2);
+		auto b = ct.vec(2);
+		a.set({{1, 2, 3}, {4, 5, 2049}});
+		x.set({{1, 0}, {0, 1}, {1, 1}});
+		b.set({0, 0});
+		auto h = ct.half(a);
+		auto y = ct.mat(2, 2);
+		y.gemm(1, h, false, x, false, 0);
+		std::cerr << h.get() << y.get() << h.dense(x, b, iopp::act::relu).get()
+			<< h.sum().get() << '\n';
+	}
+
+	{
+		// int8 weights against byte samples, int32 accumulation
+		unsigned char x[] = {0, 64, 128, 192, 255, 32};
+		int y[] = {2, 0, 1};
+		auto ds = ct.dataset(3, 2, 3, x, y, 1.0f / 256);
+		auto a = ct.mat(2, 2);
+		auto b = ct.vec(2);
+		a.set({{1, -2}, {0, 3}});
+		b.set({0, 1});
+		auto q = ct.quantize(a);
+		auto z = ct.mat(2, 3);
+		q.dense(ds, 0, b, iopp::act::identity, z);
+		std::cerr << z.get() << q.rows() << q.cols() << '\n';
+		la::qmat cq(a.get());
+		std::cerr << cq.dot(x + 2, 1.0f / 256) << '\n';
+	}
+
+	{
+		// the same stream on the device and on the host
+		iopp::philox r = {7, 0};
+		la::rng h(7);
+		auto a = ct.mat(2, 3);
+		la::mat b(2, 3);
+		r.uniform(a, -1, 1);
+		h.uniform(b, -1, 1);
+		std::cerr << a.get() << b;
+		r.xavier(a);
+		auto at = r.dropout(a, 0.5f);
+		auto g = ct.mat(2, 3);
+		g.set({{1, 1, 1}, {1, 1, 1}});
+		r.dropout(g, 0.5f, at);
+		std::cerr << a.get() << g.get() << r.counter << '\n';
+	}
+
+	{
+		// out of core, blocks of one row
+		la::mat a = {{1, 2}, {3, 4}, {5, 6}};
+		auto s = ct.stream(a, 2 * sizeof(float));
+		auto x = ct.vec(2);
+		auto y = ct.vec(3);
+		x.set({1, 1});
+		y.gemv(1, s, false, x, 0);
+		x.gemv(1, s, true, y, 0);
+		s.each([](iopp::cl_mat& b, int) { b.run_function("vreluc"); }, true);
+		std::cerr << y.get() << x.get() << s.tile() << '\n' << a;
+	}
+
+	{
+		// file-backed, written through one mapping and read through another
+		{
+			auto w = la::mmat::create("check.lam", 3, 2);
+			w[1][0] = 2;
+			w += la::mat(3, 2, 1.0f);
+		}
+		{
+			// assigning to the vec or mat of a mapping writes the file
+			la::mvec u("check.lam", true);
+			la::vec t = u;
+			t[5] = 7;
+			static_cast<la::vec&>(u) = t;
+			la::mmat w("check.lam", true);
+			la::mat x = w;
+			x[0][0] = -1;
+			static_cast<la::mat&>(w) = std::move(x);
+		}
+		la::mmat a("check.lam");
+		la::mvec v("check.lam", false, la::mfile::sequential);
+		a *= 2;
+		auto s = ct.stream(a, 2 * sizeof(float));
+		auto x = ct.vec(2);
+		x.set({1, 1});
+		auto y = ct.vec(3);
+		y.gemv(1, s, false, x, 0);
+		std::cerr << a.dot(la::vec{1, 1}) << y.get() << v << '\n';
+		// moved out of a mapping, the elements outlive it
+		la::mat c;
+		la::vec d;
+		{
+			la::mmat b("check.lam");
+			la::mvec e("check.lam");
+			c = std::move(b);
+			d = std::move(e);
+		}
+		std::cerr << c << d << '\n';
+		unlink("check.lam");
+	}
+
+	{
+		// least squares both ways, and a Cholesky factor
+		auto f = ct.mat(3, 2);
+		auto t = ct.vec(3);
+		auto w = ct.vec(2);
+		f.set({{1, 0}, {0, 1}, {1, 1}});
+		t.set({1, 2, 4});
+		w.set({0, 0});
+		int k = f.cgls(w, t, 10, 1e-6f, 1);
+		auto g = ct.mat(2, 2);
+		g.gemm(1, f, true, f, false, 0);
+		auto ft = ct.vec(2);
+		ft.gemv(1, f, true, t, 0);
+		auto l = g.cholesky();
+		std::cerr << k << w.get() << l.cho_solve(ft).get() << l.get() << '\n';
+	}
+
+	{
+		// two 2x2 products in one launch, and two 2x2 times vectors
+		auto a = ct.mat(2, 4);
+		auto b = ct.mat(2, 4);
+		auto c = ct.mat(2, 4);
+		auto x = ct.vec(4);
+		auto y = ct.vec(4);
+		a.set({{1, 2, 0, 1}, {3, 4, 1, 0}});
+		b.set({{1, 0, 2, 0}, {0, 1, 0, 2}});
+		x.set({1, 1, 1, 2});
+		c.gemm_batched(2, 1, a, false, b, false, 0);
+		y.gemv_batched(2, 1, a, true, x, 0);
+		std::cerr << c.get() << y.get() << '\n';
+	}
 }
 
 void medium_test() {
@@ -80,7 +417,7 @@ void medium_test() {
 	auto F = ct.mat(n, m);
 	auto t = ct.vec(n);
 	auto w = ct.vec(m);
-	auto alpha = ct.val(1e-7);
+	float alpha = 1e-7;
 
 	// load some data
 	la::mat F_data(n, m);
@@ -97,21 +434,57 @@ void medium_test() {
 	t.set(t_data);
 	w.set(w_data);
 
-	auto FT = F.T();
-
 	stopwatch sw(0);
 
-	// auto bzvz = FT.dot(F);
+	// auto bzvz = ct.mat(m, m).gemm(1, F, true, F, false, 0);
 
 	sw.tock();
 
+	// |F w - t|
+	auto tmp = ct.vec(n);
+	auto residual = [&](const iopp::cl_vec& w) {
+		tmp = t;
+		tmp.gemv(1, F, false, w, -1);
+		return std::sqrt(tmp.dot(tmp).get());
+	};
+
 	// train w
 	for (int i=0; i<1 * 1024; i++) {
-		auto tmp = F.dot(w) - t;
-		w -= FT.dot(tmp) * alpha;
+		tmp = t;
+		tmp.gemv(1, F, false, w, -1);
+		w.gemv(-alpha, F, true, tmp, 1);
 	}
 
+	ct.finish();
+	sw.tock();
+	float target = residual(w);
+	std::cout << "gradient descent, residual " << target << '\n';
+
+	// the same residual with conjugate gradients, restarted every 32
+	// iterations to look at it; none are done once A^T r is 0
+	w.set(w_data);
+	sw.tick();
+	int k = 0;
+	while (k < 1024 && residual(w) > target) {
+		int d = F.cgls(w, t, 32, 0);
+		if (d == 0)
+			break;
+		k += d;
+	}
 	sw.tock();
+	std::cout << "cgls, " << k << " iterations, residual " << residual(w) << '\n';
+
+	// and directly from the normal equations, in floats only as good as
+	// the square of the condition number of F allows
+	sw.tick();
+	auto G = ct.mat(m, m);
+	G.gemm(1, F, true, F, false, 0);
+	auto ft = ct.vec(m);
+	ft.gemv(1, F, true, t, 0);
+	w = G.cholesky().cho_solve(ft);
+	ct.finish();
+	sw.tock();
+	std::cout << "cholesky, residual " << residual(w) << '\n';
 
 	// write output
 	auto w_out = w.get();
@@ -121,6 +494,55 @@ void medium_test() {
 }
 
 
+// the same least squares on a matrix that does not fit on the device;
+// one pass over F per step gives both the residual and the gradient
+void large_test() {
+	int n = 64 * 1024, m = 8192;
+
+	auto t = ct.vec(n);
+	auto w = ct.vec(m);
+	auto r = ct.vec(n);
+	auto g = ct.vec(m);
+	float alpha = 1e-8;
+
+	// 2 GB, in a file so it need not fit in memory
+	auto F_data = la::mmat::create("large_test.lam", n, m);
+	la::vec t_data(n, 0.0f);
+	la::vec w_data(m, 0.0f);
+	for (int i=0; i<n; i++) {
+		for (int j=0; j<m; j++) {
+			float f = rand() * 1.0f / RAND_MAX;
+			F_data[i][j] = f;
+			t_data[i] += j * f;
+		}
+	}
+
+	t.set(t_data);
+	w.set(w_data);
+	auto F = ct.stream(F_data);
+
+	stopwatch sw(0);
+
+	for (int i=0; i<64; i++) {
+		F.each([&](iopp::cl_mat& x, int k) {
+			auto rk = r.slice(k, x.cols());
+			rk = t.slice(k, x.cols());
+			rk.gemv(1, x, true, w, -1);
+			g.gemv(1, x, false, rk, k ? 1 : 0);
+		});
+		w.axpy(-alpha, g);
+	}
+
+	ct.finish();
+	sw.tock();
+
+	auto w_out = w.get();
+	for (int i=0; i<10; i++)
+		std::cout << w_out[i] << ' ';
+	std::cout << '\n';
+	unlink("large_test.lam");
+}
+
 void simple_test() {
 	const int SZ = 1 << 22;
 
@@ -144,6 +566,7 @@ void simple_test() {
 		c = a - b;
 	}
 
+	ct.finish();
 	sw.tock();
 
 	auto c_out = c.get();
@@ -173,6 +596,7 @@ void sqrt_test() {
 		iopp::exp(c);
 	}
 
+	ct.finish();
 	sw.tock();
 
 	auto c_out = c.get();
@@ -218,6 +642,7 @@ void transpose_test() {
 	for (int i=0; i<64; i++) {
 		auto b = a.T();
 	}
+	ct.finish();
 	sw.tock();
 }
 
@@ -236,6 +661,7 @@ void reduce_sum_test() {
 		f = u.sum();
 	}
 
+	ct.finish();
 	sw.tock();
 
 	std::cerr << "suma: " << f.get() << '\n';
@@ -261,16 +687,75 @@ void outer_sum_test() {
 		w = u.outer(v);
 	}
 
+	ct.finish();
+	sw.tock();
+}
+
+// concurrent inference, every thread has its own queue, a is shared
+void threads_test() {
+	const int n = 2048, steps = 256;
+	auto a = ct.mat(n, n);
+	a.set(la::mat(n, n, 1.0f / n));
+
+	for (int cnt=1; cnt<=8; cnt*=2) {
+		stopwatch sw(0);
+		std::vector<std::thread> threads;
+		for (int t=0; t<cnt; t++) {
+			threads.emplace_back([&]() {
+				auto x = ct.vec(n);
+				auto y = ct.vec(n);
+				x.set(la::vec(n, 1.0f));
+				for (int i=0; i<steps; i++) {
+					y.gemv(1, a, false, x, 0);
+					x.gemv(1, a, true, y, 0);
+				}
+				if (x.sum().get() != n)
+					std::cerr << "wrong result\n";
+			});
+		}
+		for (auto& t : threads)
+			t.join();
+		std::cerr << cnt << " threads, " << cnt * steps << " steps\n";
+		sw.tock();
+	}
+}
+
+// 10k products of 16x16 matrices, one launch each and then all in one
+void batched_test() {
+	const int n = 16, count = 10000;
+	auto a = ct.mat(n, n * count);
+	auto b = ct.mat(n, n * count);
+	auto c = ct.mat(n, n * count);
+	a.set(la::mat(n, n * count, 1.0f));
+	b.set(la::mat(n, n * count, 0.5f));
+
+	stopwatch sw(0);
+	for (int k=0; k<count; k++)
+		c.cols(k * n, n).gemm(1, a.cols(k * n, n), false, b.cols(k * n, n), false, 0);
+	ct.finish();
+	std::cerr << "one by one\n";
 	sw.tock();
+
+	sw.tick();
+	c.gemm_batched(count, 1, a, false, b, false, 0);
+	ct.finish();
+	std::cerr << "batched\n";
+	sw.tock();
+
+	if (c.col(n * count - 1).sum().get() != n * n * 0.5f)
+		std::cerr << "wrong result\n";
 }
 
 int main() {
 	compile_check();
 	// simple_test();
 	// medium_test();
+	// large_test();
 	// sqrt_test();
 	// cpu_test();
 	// transpose_test();
 	// reduce_sum_test();
 	// outer_sum_test();
+	// threads_test();
+	// batched_test();
 }
\ No newline at end of file